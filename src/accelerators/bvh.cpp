@@ -38,6 +38,23 @@
 #include "stats.h"
 #include "parallel.h"
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <thread>
+#ifdef PBRT_IS_WINDOWS
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#define PBRT_WIDE_BVH_SSE
+#include <immintrin.h>
+#endif
 
 namespace pbrt {
 
@@ -45,6 +62,14 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_COUNTER("BVH/Wide nodes", wideNodes);
+STAT_RATIO("BVH/Children per wide node", wideChildren, wideNodesTotal);
+STAT_COUNTER("BVH/Subtrees built in parallel", parallelSubtrees);
+STAT_FLOAT_DISTRIBUTION("BVH/SAH cost", sahCosts);
+STAT_PERCENT("BVH/Trees loaded from the cache", cacheHits, cacheLookups);
+STAT_RATIO("BVH/Node bytes per primitive", treeNodeBytes, treePrimitives);
+STAT_MEMORY_COUNTER("Memory/BVH nodes saved by quantization", quantizedSavings);
+STAT_RATIO("BVH/Nodes visited per query", nodesVisited, bvhQueries);
 
 // BVHAccel Local Declarations
 struct BVHPrimitiveInfo {
@@ -65,6 +90,7 @@ struct BVHBuildNode {
         nPrimitives = n;
         bounds = b;
         children[0] = children[1] = nullptr;
+        nSubtreeNodes = 0;
         ++leafNodes;
         ++totalLeafNodes;
         totalPrimitives += n;
@@ -75,11 +101,15 @@ struct BVHBuildNode {
         bounds = Union(c0->bounds, c1->bounds);
         splitAxis = axis;
         nPrimitives = 0;
+        nSubtreeNodes = 0;
         ++interiorNodes;
     }
     Bounds3f bounds;
     BVHBuildNode *children[2];
     int splitAxis, firstPrimOffset, nPrimitives;
+    // Number of nodes of the subtree under this node if it was built as one
+    // task, so that it can be flattened as one too; 0 otherwise
+    int nSubtreeNodes;
 };
 
 struct MortonPrimitive {
@@ -103,6 +133,171 @@ struct LinearBVHNode {
     uint8_t pad[1];        // ensure 32 byte total size
 };
 
+// Node of a BVH with up to _N_ children. The children's bounds are stored
+// as a structure of arrays, lower corners first, so that a ray is tested
+// against all of them with a few vector instructions; unused children
+// have empty bounds, which no ray hits.
+template <int N>
+struct alignas(16) WideBVHNode {
+    Float bounds[2][3][N];
+    // Node index of interior children; primitive offset of leaf children
+    int32_t offset[N];
+    // Primitives of leaf children; 0 for interior and unused children
+    uint16_t nPrimitives[N];
+};
+
+// Node of a BVH with up to _N_ children whose bounds are quantized to 8
+// bits on a grid over the node's own bounds, with a power-of-two spacing
+// so that decoding a bound only rounds once. Lower bounds are rounded
+// down and upper bounds up, so the decoded bounds contain the exact ones.
+// Interior children are consecutive nodes from _childBase_ and the
+// primitives of leaf children are consecutive from _primBase_, in the
+// order of the children.
+template <int N>
+struct QuantizedBVHNode {
+    Float origin[3], scale[3];
+    uint8_t lower[3][N], upper[3][N];
+    int32_t childBase, primBase;
+    // Primitives of leaf children; 0 for interior children and
+    // _emptyChild_ for unused ones
+    uint16_t nPrimitives[N];
+};
+static PBRT_CONSTEXPR uint16_t emptyChild = 0xffff;
+
+// Number of primitives per chunk that parallel loops over primitives, like
+// the binning and partitioning of a parallel build's upper levels, run as
+// separate tasks, and the fewest primitives for which binning in parallel
+// is worth it
+static PBRT_CONSTEXPR int parallelChunkPrims = 16384;
+static PBRT_CONSTEXPR int parallelBinPrims = 4 * parallelChunkPrims;
+
+// Smallest subtree that a parallel build hands to its own task
+static PBRT_CONSTEXPR int minSubtreePrims = 4096;
+
+// Subtree left for a task of a parallel build, to be copied into _node_
+struct BVHSubtree {
+    BVHBuildNode *node;
+    int start, end;
+};
+
+struct BVHSubtreeTasks {
+    int maxPrimitives;
+    std::vector<BVHSubtree> subtrees;
+};
+
+// Subtree built as one task that is flattened by its own task, starting at
+// node _offset_
+struct BVHFlattenTask {
+    BVHBuildNode *node;
+    int offset;
+};
+
+static int NumChunks(int start, int end) {
+    return (end - start + parallelChunkPrims - 1) / parallelChunkPrims;
+}
+
+// Calls _func_ in parallel for each chunk of the primitive range
+// [start, end) with the chunk's index and range. Trees can be built before
+// _ParallelInit()_, by tools and tests; the chunks then run serially.
+template <typename Func>
+static void ParallelForChunks(int start, int end, const Func &func) {
+    if (!ParallelThreadsStarted()) {
+        for (int c = 0; c < NumChunks(start, end); ++c) {
+            int chunkStart = start + c * parallelChunkPrims;
+            func(c, chunkStart, std::min(end, chunkStart + parallelChunkPrims));
+        }
+        return;
+    }
+    ParallelFor([&](int64_t c) {
+        int chunkStart = start + c * parallelChunkPrims;
+        func(int(c), chunkStart, std::min(end, chunkStart + parallelChunkPrims));
+    }, NumChunks(start, end), 1);
+}
+
+static void ComputeBounds(const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                          int start, int end, bool parallel, Bounds3f *bounds,
+                          Bounds3f *centroidBounds) {
+    if (!parallel) {
+        for (int i = start; i < end; ++i) {
+            *bounds = Union(*bounds, primitiveInfo[i].bounds);
+            *centroidBounds = Union(*centroidBounds, primitiveInfo[i].centroid);
+        }
+        return;
+    }
+    std::vector<Bounds3f> chunkBounds(NumChunks(start, end)),
+        chunkCentroidBounds(chunkBounds.size());
+    ParallelForChunks(start, end, [&](int c, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; ++i) {
+            chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bounds);
+            chunkCentroidBounds[c] =
+                Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+        }
+    });
+    for (size_t c = 0; c < chunkBounds.size(); ++c) {
+        *bounds = Union(*bounds, chunkBounds[c]);
+        *centroidBounds = Union(*centroidBounds, chunkCentroidBounds[c]);
+    }
+}
+
+// Moves the primitives of [start, end) that satisfy _pred_ before those
+// that do not and returns the index of the first that does not. The
+// parallel version keeps the primitives of each side in order.
+template <typename Predicate>
+static int PartitionPrimitives(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                               int start, int end, bool parallel,
+                               const Predicate &pred) {
+    if (!parallel)
+        return std::partition(&primitiveInfo[start],
+                              &primitiveInfo[end - 1] + 1, pred) -
+               &primitiveInfo[0];
+
+    // Count each chunk's primitives on both sides to find where they go
+    int nChunks = NumChunks(start, end);
+    std::vector<int> chunkBelow(nChunks);
+    ParallelForChunks(start, end, [&](int c, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; ++i)
+            if (pred(primitiveInfo[i])) ++chunkBelow[c];
+    });
+    std::vector<int> belowOffset(nChunks), aboveOffset(nChunks);
+    int nBelow = 0;
+    for (int c = 0; c < nChunks; ++c) {
+        belowOffset[c] = nBelow;
+        nBelow += chunkBelow[c];
+    }
+    for (int c = 0, offset = nBelow; c < nChunks; ++c) {
+        aboveOffset[c] = offset;
+        offset += std::min(parallelChunkPrims,
+                           end - start - c * parallelChunkPrims) -
+                  chunkBelow[c];
+    }
+
+    // Scatter the primitives to a copy of the range and copy them back
+    std::vector<BVHPrimitiveInfo> partitioned(end - start);
+    ParallelForChunks(start, end, [&](int c, int chunkStart, int chunkEnd) {
+        int below = belowOffset[c], above = aboveOffset[c];
+        for (int i = chunkStart; i < chunkEnd; ++i)
+            partitioned[pred(primitiveInfo[i]) ? below++ : above++] =
+                primitiveInfo[i];
+    });
+    ParallelForChunks(start, end, [&](int c, int chunkStart, int chunkEnd) {
+        std::copy(partitioned.begin() + (chunkStart - start),
+                  partitioned.begin() + (chunkEnd - start),
+                  primitiveInfo.begin() + chunkStart);
+    });
+    return start + nBelow;
+}
+
+// Returns the sum of the surface area of the nodes under _node_ weighted
+// by their cost: one for interior nodes and their number of primitives
+// for leaves
+static Float WeightedSurfaceArea(const BVHBuildNode *node) {
+    if (node->nPrimitives > 0)
+        return node->nPrimitives * node->bounds.SurfaceArea();
+    return node->bounds.SurfaceArea() +
+           WeightedSurfaceArea(node->children[0]) +
+           WeightedSurfaceArea(node->children[1]);
+}
+
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
     CHECK_LE(x, (1 << 10));
@@ -136,6 +331,10 @@ inline uint32_t EncodeMorton3(const Vector3f &v) {
     return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
 }
 
+// Sorts by Morton code with one pass per _bitsPerPass_ bits. Each pass
+// counts the digits of chunks of primitives in parallel and then moves
+// the chunks' primitives in parallel, each bucket of a chunk going after
+// that bucket's primitives from earlier chunks so that passes are stable.
 static void RadixSort(std::vector<MortonPrimitive> *v) {
     std::vector<MortonPrimitive> tempVector(v->size());
     PBRT_CONSTEXPR int bitsPerPass = 6;
@@ -143,6 +342,12 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
     static_assert((nBits % bitsPerPass) == 0,
                   "Radix sort bitsPerPass must evenly divide nBits");
     PBRT_CONSTEXPR int nPasses = nBits / bitsPerPass;
+    PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
+    PBRT_CONSTEXPR int bitMask = (1 << bitsPerPass) - 1;
+    int n = v->size(), nChunks = NumChunks(0, n);
+    // Primitives of each chunk in each bucket, and then their first index
+    // in the output array
+    std::vector<int> chunkBuckets(nChunks * nBuckets);
 
     for (int pass = 0; pass < nPasses; ++pass) {
         // Perform one pass of radix sort, sorting _bitsPerPass_ bits
@@ -152,38 +357,452 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
         std::vector<MortonPrimitive> &in = (pass & 1) ? tempVector : *v;
         std::vector<MortonPrimitive> &out = (pass & 1) ? *v : tempVector;
 
-        // Count number of zero bits in array for current radix sort bit
-        PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
-        int bucketCount[nBuckets] = {0};
-        PBRT_CONSTEXPR int bitMask = (1 << bitsPerPass) - 1;
-        for (const MortonPrimitive &mp : in) {
-            int bucket = (mp.mortonCode >> lowBit) & bitMask;
-            CHECK_GE(bucket, 0);
-            CHECK_LT(bucket, nBuckets);
-            ++bucketCount[bucket];
-        }
+        // Count number of primitives in each chunk for each bucket
+        std::fill(chunkBuckets.begin(), chunkBuckets.end(), 0);
+        ParallelForChunks(0, n, [&](int c, int chunkStart, int chunkEnd) {
+            int *bucketCount = &chunkBuckets[c * nBuckets];
+            for (int i = chunkStart; i < chunkEnd; ++i) {
+                int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+                CHECK_GE(bucket, 0);
+                CHECK_LT(bucket, nBuckets);
+                ++bucketCount[bucket];
+            }
+        });
 
-        // Compute starting index in output array for each bucket
-        int outIndex[nBuckets];
-        outIndex[0] = 0;
-        for (int i = 1; i < nBuckets; ++i)
-            outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+        // Compute starting index in output array for each bucket of each
+        // chunk
+        int outIndex = 0;
+        for (int bucket = 0; bucket < nBuckets; ++bucket)
+            for (int c = 0; c < nChunks; ++c) {
+                int count = chunkBuckets[c * nBuckets + bucket];
+                chunkBuckets[c * nBuckets + bucket] = outIndex;
+                outIndex += count;
+            }
 
         // Store sorted values in output array
-        for (const MortonPrimitive &mp : in) {
-            int bucket = (mp.mortonCode >> lowBit) & bitMask;
-            out[outIndex[bucket]++] = mp;
-        }
+        ParallelForChunks(0, n, [&](int c, int chunkStart, int chunkEnd) {
+            int *outIndex = &chunkBuckets[c * nBuckets];
+            for (int i = chunkStart; i < chunkEnd; ++i) {
+                int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+                out[outIndex[bucket]++] = in[i];
+            }
+        });
     }
     // Copy final result from _tempVector_, if needed
     if (nPasses & 1) std::swap(*v, tempVector);
 }
 
+// Chooses the children of the wide node for _node_, returning their
+// number. A node takes the children of its binary subtree's top levels,
+// repeatedly opening the interior child with the largest surface area; a
+// leaf becomes a node's only child.
+template <int N>
+static int WideChildren(const BVHBuildNode *node,
+                        const BVHBuildNode *children[N]) {
+    children[0] = node;
+    int nChildren = 1;
+    while (nChildren < N) {
+        int open = -1;
+        Float maxArea = -1;
+        for (int i = 0; i < nChildren; ++i)
+            if (children[i]->nPrimitives == 0 &&
+                children[i]->bounds.SurfaceArea() > maxArea) {
+                open = i;
+                maxArea = children[i]->bounds.SurfaceArea();
+            }
+        if (open == -1) break;
+        const BVHBuildNode *opened = children[open];
+        children[open] = opened->children[0];
+        children[nChildren++] = opened->children[1];
+    }
+    return nChildren;
+}
+
+// Collapses the binary subtree under _node_ into wide nodes appended to
+// _wide_, returning the index of its node
+template <int N>
+static int FlattenWideBVH(const BVHBuildNode *node,
+                          std::vector<WideBVHNode<N>> *wide) {
+    const BVHBuildNode *children[N];
+    int nChildren = WideChildren<N>(node, children);
+    int index = wide->size();
+    wide->push_back(WideBVHNode<N>());
+    ++wideNodes;
+    ++wideNodesTotal;
+    wideChildren += nChildren;
+    for (int i = 0; i < N; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            (*wide)[index].bounds[0][c][i] =
+                i < nChildren ? children[i]->bounds.pMin[c] : Infinity;
+            (*wide)[index].bounds[1][c][i] =
+                i < nChildren ? children[i]->bounds.pMax[c] : -Infinity;
+        }
+        (*wide)[index].offset[i] = 0;
+        (*wide)[index].nPrimitives[i] =
+            i < nChildren ? children[i]->nPrimitives : 0;
+    }
+    for (int i = 0; i < nChildren; ++i) {
+        // Children are flattened after their parent, so _wide_ may grow
+        int offset = children[i]->nPrimitives > 0
+                         ? children[i]->firstPrimOffset
+                         : FlattenWideBVH<N>(children[i], wide);
+        (*wide)[index].offset[i] = offset;
+    }
+    return index;
+}
+
+template <int N>
+static WideBVHNode<N> *BuildWideBVH(const BVHBuildNode *root, int *nNodes) {
+    std::vector<WideBVHNode<N>> wide;
+    FlattenWideBVH<N>(root, &wide);
+    *nNodes = wide.size();
+    WideBVHNode<N> *nodes = AllocAligned<WideBVHNode<N>>(wide.size());
+    std::copy(wide.begin(), wide.end(), nodes);
+    return nodes;
+}
+
+// Returns the smallest power of two that spans [_lo_, _hi_] in 255 steps
+static Float QuantizationScale(Float lo, Float hi) {
+    int exponent;
+    std::frexp((hi - lo) / 255, &exponent);
+    Float scale = std::ldexp(Float(1), exponent);
+    while (lo + 255 * scale < hi) scale *= 2;
+    return scale;
+}
+
+// Returns the largest grid point that is at most _v_, and the smallest
+// one that is at least _v_
+static uint8_t QuantizeLower(Float v, Float origin, Float scale) {
+    int q = Clamp((int)std::floor((v - origin) / scale), 0, 255);
+    while (q > 0 && origin + q * scale > v) --q;
+    return q;
+}
+
+static uint8_t QuantizeUpper(Float v, Float origin, Float scale) {
+    int q = Clamp((int)std::ceil((v - origin) / scale), 0, 255);
+    while (q < 255 && origin + q * scale < v) ++q;
+    return q;
+}
+
+// Collapses the binary tree under _root_ into quantized nodes, stored
+// breadth first so that the interior children of every node are
+// consecutive. The primitives of each node's leaf children are appended
+// to _primOrder_, which gives the primitives' new order by their current
+// index.
+template <int N>
+static QuantizedBVHNode<N> *BuildQuantizedBVH(const BVHBuildNode *root,
+                                              std::vector<int> *primOrder,
+                                              int *nNodes) {
+    std::vector<const BVHBuildNode *> queue = {root};
+    std::vector<QuantizedBVHNode<N>> quantized;
+    for (size_t index = 0; index < queue.size(); ++index) {
+        const BVHBuildNode *children[N];
+        int nChildren = WideChildren<N>(queue[index], children);
+        ++wideNodes;
+        ++wideNodesTotal;
+        wideChildren += nChildren;
+
+        QuantizedBVHNode<N> node;
+        const Bounds3f &b = queue[index]->bounds;
+        for (int c = 0; c < 3; ++c) {
+            node.origin[c] = b.pMin[c];
+            node.scale[c] = QuantizationScale(b.pMin[c], b.pMax[c]);
+        }
+        node.childBase = queue.size();
+        node.primBase = primOrder->size();
+        for (int i = 0; i < N; ++i) {
+            if (i >= nChildren) {
+                for (int c = 0; c < 3; ++c)
+                    node.lower[c][i] = node.upper[c][i] = 0;
+                node.nPrimitives[i] = emptyChild;
+                continue;
+            }
+            const BVHBuildNode *child = children[i];
+            for (int c = 0; c < 3; ++c) {
+                node.lower[c][i] = QuantizeLower(child->bounds.pMin[c],
+                                                 node.origin[c], node.scale[c]);
+                node.upper[c][i] = QuantizeUpper(child->bounds.pMax[c],
+                                                 node.origin[c], node.scale[c]);
+            }
+            CHECK_LT(child->nPrimitives, emptyChild);
+            node.nPrimitives[i] = child->nPrimitives;
+            if (child->nPrimitives == 0)
+                queue.push_back(child);
+            else
+                for (int j = 0; j < child->nPrimitives; ++j)
+                    primOrder->push_back(child->firstPrimOffset + j);
+        }
+        quantized.push_back(node);
+    }
+    *nNodes = quantized.size();
+    QuantizedBVHNode<N> *nodes = AllocAligned<QuantizedBVHNode<N>>(*nNodes);
+    std::copy(quantized.begin(), quantized.end(), nodes);
+    return nodes;
+}
+
+// Returns the full-precision form of a node, decoding it into _decoded_
+// if it is quantized
+template <int N>
+static inline const WideBVHNode<N> &DecodeNode(const WideBVHNode<N> &node,
+                                               WideBVHNode<N> *decoded) {
+    return node;
+}
+
+template <int N>
+static inline const WideBVHNode<N> &DecodeNode(const QuantizedBVHNode<N> &node,
+                                               WideBVHNode<N> *decoded) {
+    int32_t childOffset = node.childBase, primOffset = node.primBase;
+    for (int i = 0; i < N; ++i) {
+        bool empty = node.nPrimitives[i] == emptyChild;
+        for (int c = 0; c < 3; ++c) {
+            decoded->bounds[0][c][i] =
+                empty ? Infinity
+                      : node.origin[c] + node.lower[c][i] * node.scale[c];
+            decoded->bounds[1][c][i] =
+                empty ? -Infinity
+                      : node.origin[c] + node.upper[c][i] * node.scale[c];
+        }
+        if (empty) {
+            decoded->offset[i] = 0;
+            decoded->nPrimitives[i] = 0;
+        } else if (node.nPrimitives[i] == 0) {
+            decoded->offset[i] = childOffset++;
+            decoded->nPrimitives[i] = 0;
+        } else {
+            decoded->offset[i] = primOffset;
+            decoded->nPrimitives[i] = node.nPrimitives[i];
+            primOffset += node.nPrimitives[i];
+        }
+    }
+    return *decoded;
+}
+
+// Intersects a ray with the children of a wide node, returning a bit mask
+// of the children it hits and their entry distances in _tEnter_. Like
+// _Bounds3::IntersectP()_, the far distances are enlarged so that
+// rounding cannot make the test miss.
+template <int N>
+static inline int IntersectChildren(const WideBVHNode<N> &node,
+                                    const Ray &ray, const Vector3f &invDir,
+                                    const int dirIsNeg[3], Float tEnter[N]) {
+    const Float farScale = 1 + 2 * gamma(3);
+    int hits = 0;
+#ifdef PBRT_WIDE_BVH_SSE
+    // Nodes with fewer than four children use the scalar tests
+    if (N % 4 == 0) {
+        for (int base = 0; base < N; base += 4) {
+            __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(ray.tMax);
+            for (int c = 0; c < 3; ++c) {
+                __m128 o = _mm_set1_ps(ray.o[c]), inv = _mm_set1_ps(invDir[c]);
+                __m128 tNear = _mm_mul_ps(
+                    _mm_sub_ps(_mm_load_ps(&node.bounds[dirIsNeg[c]][c][base]), o),
+                    inv);
+                __m128 tFar = _mm_mul_ps(
+                    _mm_mul_ps(_mm_sub_ps(_mm_load_ps(
+                                              &node.bounds[1 - dirIsNeg[c]][c][base]),
+                                          o),
+                               inv),
+                    _mm_set1_ps(farScale));
+                // NaN distances, from rays in a slab's plane, leave the
+                // interval unchanged
+                t0 = _mm_max_ps(tNear, t0);
+                t1 = _mm_min_ps(tFar, t1);
+            }
+            _mm_storeu_ps(&tEnter[base], t0);
+            hits |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << base;
+        }
+        return hits;
+    }
+#endif
+    for (int i = 0; i < N; ++i) {
+        Float t0 = 0, t1 = ray.tMax;
+        for (int c = 0; c < 3; ++c) {
+            Float tNear = (node.bounds[dirIsNeg[c]][c][i] - ray.o[c]) * invDir[c];
+            Float tFar = (node.bounds[1 - dirIsNeg[c]][c][i] - ray.o[c]) *
+                         invDir[c] * farScale;
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+        }
+        tEnter[i] = t0;
+        if (t0 <= t1) hits |= 1 << i;
+    }
+    return hits;
+}
+
+// Entry of the wide BVH traversal stack: a node index, or a leaf's
+// primitives if _nPrimitives_ is positive
+struct WideBVHStackEntry {
+    int32_t offset;
+    int32_t nPrimitives;
+    Float tEnter;
+};
+
+template <int N, bool AnyHit, typename Node>
+static bool TraverseWideBVH(const Node *nodes,
+                            const std::vector<std::shared_ptr<Primitive>> &primitives,
+                            const Ray &ray, SurfaceInteraction *isect) {
+    bool hit = false;
+    int nVisited = 0;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    // Each node pushes at most _N_ - 1 entries more than it pops
+    WideBVHStackEntry stack[64 * (N - 1) + 1];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0};
+    while (stackSize > 0) {
+        const WideBVHStackEntry entry = stack[--stackSize];
+        // Skip subtrees behind the closest intersection found so far
+        if (entry.tEnter > ray.tMax) continue;
+        if (entry.nPrimitives > 0) {
+            for (int i = 0; i < entry.nPrimitives; ++i) {
+                const Primitive &prim = *primitives[entry.offset + i];
+                if (AnyHit) {
+                    if (prim.IntersectP(ray)) {
+                        nodesVisited += nVisited;
+                        ++bvhQueries;
+                        return true;
+                    }
+                } else if (prim.Intersect(ray, isect))
+                    hit = true;
+            }
+            continue;
+        }
+
+        // Push the children the ray hits, farthest first, so that the
+        // nearest is visited next
+        WideBVHNode<N> decoded;
+        const WideBVHNode<N> &node = DecodeNode(nodes[entry.offset], &decoded);
+        ++nVisited;
+        Float tEnter[N];
+        int hits = IntersectChildren<N>(node, ray, invDir, dirIsNeg, tEnter);
+        int first = stackSize;
+        for (int i = 0; i < N; ++i) {
+            if (!(hits & (1 << i))) continue;
+            WideBVHStackEntry child = {node.offset[i], node.nPrimitives[i],
+                                       tEnter[i]};
+            int j = stackSize++;
+            for (; j > first && stack[j - 1].tEnter < child.tEnter; --j)
+                stack[j] = stack[j - 1];
+            stack[j] = child;
+        }
+    }
+    nodesVisited += nVisited;
+    ++bvhQueries;
+    return hit;
+}
+
+template <bool AnyHit>
+static bool TraverseQuantizedBVH(const void *nodes, int width,
+                                 const std::vector<std::shared_ptr<Primitive>> &primitives,
+                                 const Ray &ray, SurfaceInteraction *isect) {
+    if (width == 4)
+        return TraverseWideBVH<4, AnyHit>((const QuantizedBVHNode<4> *)nodes,
+                                          primitives, ray, isect);
+    if (width == 8)
+        return TraverseWideBVH<8, AnyHit>((const QuantizedBVHNode<8> *)nodes,
+                                          primitives, ray, isect);
+    return TraverseWideBVH<2, AnyHit>((const QuantizedBVHNode<2> *)nodes,
+                                      primitives, ray, isect);
+}
+
+// BVH cache files start with a _BVHCacheHeader_, followed by the original
+// index of every primitive in the tree's order (int32) and then, at the
+// next multiple of 64 bytes, the nodes of the tree's layout. Files are
+// named after the key of the tree they hold.
+static const char bvhCacheMagic[8] = {'P', 'B', 'R', 'T', 'B', 'V', 'H', 'C'};
+static const int32_t bvhCacheVersion = 2;
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint64_t key;
+    int32_t version, width, quantized, nPrimitives, nNodes;
+    Float sahCost;
+    Bounds3f bounds;
+};
+
+static size_t BVHCacheNodesOffset(int nPrimitives) {
+    size_t orderEnd = sizeof(BVHCacheHeader) + nPrimitives * sizeof(int32_t);
+    return (orderEnd + 63) & ~size_t(63);
+}
+
+static uint64_t MurmurHash64A(const unsigned char *key, size_t len,
+                              uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const unsigned char *end = key + 8 * (len / 8);
+    while (key != end) {
+        uint64_t k;
+        std::memcpy(&k, key, sizeof(uint64_t));
+        key += 8;
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7) {
+    case 7: h ^= uint64_t(key[6]) << 48;
+    case 6: h ^= uint64_t(key[5]) << 40;
+    case 5: h ^= uint64_t(key[4]) << 32;
+    case 4: h ^= uint64_t(key[3]) << 24;
+    case 3: h ^= uint64_t(key[2]) << 16;
+    case 2: h ^= uint64_t(key[1]) << 8;
+    case 1:
+        h ^= uint64_t(key[0]);
+        h *= m;
+    };
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// Maps a file into memory for reading, returning nullptr if it cannot be
+// opened. Where there is no _mmap()_, the file is read into memory instead.
+static void *MapFile(const std::string &filename, size_t *size) {
+#ifdef PBRT_IS_WINDOWS
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in) return nullptr;
+    *size = in.tellg();
+    in.seekg(0);
+    char *data = AllocAligned<char>(std::max<size_t>(1, *size));
+    if (!in.read(data, *size)) {
+        FreeAligned(data);
+        return nullptr;
+    }
+    return data;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return nullptr;
+    struct stat st;
+    void *data = nullptr;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        data = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = nullptr;
+    }
+    close(fd);
+    return data;
+#endif
+}
+
+static void UnmapFile(void *data, size_t size) {
+#ifdef PBRT_IS_WINDOWS
+    FreeAligned(data);
+#else
+    munmap(data, size);
+#endif
+}
+
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(const std::vector<std::shared_ptr<Primitive>> &p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod, int width,
+                   bool quantized, const std::string &cacheDir)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
+      width(width),
+      quantized(quantized),
       primitives(p) {
     ProfilePhase _(Prof::AccelConstruction);
     if (primitives.empty()) return;
@@ -194,37 +813,280 @@ BVHAccel::BVHAccel(const std::vector<std::shared_ptr<Primitive>> &p,
     for (size_t i = 0; i < primitives.size(); ++i)
         primitiveInfo[i] = {i, primitives[i]->WorldBound()};
 
+    // Look for a cached tree built from the same primitive bounds
+    uint64_t key = 0;
+    if (!cacheDir.empty()) {
+        key = cacheKey(primitiveInfo);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+        cacheFile = cacheDir + "/" + name;
+        ++cacheLookups;
+        if (readCache(cacheFile, key)) {
+            ++cacheHits;
+            return;
+        }
+    }
+
     // Build BVH tree for primitives using _primitiveInfo_
     MemoryArena arena(1024 * 1024);
+    std::unique_ptr<MemoryArena[]> threadArenas;
     int totalNodes = 0;
-    std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
-        root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-    else
+        root = HLBVHBuild(arena, primitiveInfo, &totalNodes);
+    else if (ParallelThreadsStarted() && primitives.size() > minSubtreePrims) {
+        threadArenas.reset(new MemoryArena[MaxThreadIndex()]);
+        root = parallelBuild(arena, threadArenas.get(), primitiveInfo,
+                             &totalNodes);
+    } else
         root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-                              &totalNodes, orderedPrims);
+                              &totalNodes);
+    nNodes = totalNodes;
+    if (quantized) {
+        // Quantized nodes address the primitives of their leaf children as
+        // one range, so order the primitives by node
+        std::vector<int> primOrder;
+        primOrder.reserve(primitives.size());
+        if (width == 4)
+            quantizedNodes = BuildQuantizedBVH<4>(root, &primOrder, &nNodes);
+        else if (width == 8)
+            quantizedNodes = BuildQuantizedBVH<8>(root, &primOrder, &nNodes);
+        else
+            quantizedNodes = BuildQuantizedBVH<2>(root, &primOrder, &nNodes);
+        CHECK_EQ(primitives.size(), primOrder.size());
+        std::vector<BVHPrimitiveInfo> orderedInfo;
+        orderedInfo.reserve(primitives.size());
+        for (int i : primOrder) orderedInfo.push_back(primitiveInfo[i]);
+        primitiveInfo.swap(orderedInfo);
+    }
+    // Leaves refer to primitives in the order of _primitiveInfo_
+    std::vector<std::shared_ptr<Primitive>> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    for (const BVHPrimitiveInfo &pi : primitiveInfo)
+        orderedPrims.push_back(primitives[pi.primitiveNumber]);
     primitives.swap(orderedPrims);
-    LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
-                              "primitives (%.2f MB)", totalNodes,
-                              (int)primitives.size(),
-                              float(totalNodes * sizeof(LinearBVHNode)) /
-                              (1024.f * 1024.f));
-
-    // Compute representation of depth-first traversal of BVH tree
-    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
+    bounds = root->bounds;
+    sahCost = WeightedSurfaceArea(root);
+    if (bounds.SurfaceArea() > 0) sahCost /= bounds.SurfaceArea();
+    ReportValue(sahCosts, sahCost);
+    if (quantized) {
+        size_t nodeBytes = nNodes * nodeSize();
+        LOG(INFO) << StringPrintf("Quantized %d-wide BVH created with %d nodes "
+                                  "for %d primitives (%.2f MB)", width, nNodes,
+                                  (int)primitives.size(),
+                                  float(nodeBytes) / (1024.f * 1024.f));
+        treeBytes += nodeBytes + sizeof(*this) +
+                     primitives.size() * sizeof(primitives[0]);
+        // The full-precision layout has as many wide nodes, or a binary node
+        // for every node of the build tree
+        size_t fullBytes =
+            width == 4 ? nNodes * sizeof(WideBVHNode<4>)
+                       : width == 8 ? nNodes * sizeof(WideBVHNode<8>)
+                                    : totalNodes * sizeof(LinearBVHNode);
+        // Tiny trees can take more space quantized; nothing is saved then
+        if (fullBytes > nodeBytes) quantizedSavings += fullBytes - nodeBytes;
+    } else if (width == 4 || width == 8) {
+        // Collapse the binary tree into wide nodes
+        size_t nodeBytes;
+        if (width == 4) {
+            nodes4 = BuildWideBVH<4>(root, &nNodes);
+            nodeBytes = nNodes * sizeof(WideBVHNode<4>);
+        } else {
+            nodes8 = BuildWideBVH<8>(root, &nNodes);
+            nodeBytes = nNodes * sizeof(WideBVHNode<8>);
+        }
+        LOG(INFO) << StringPrintf("%d-wide BVH created with %d nodes for %d "
+                                  "primitives (%.2f MB)", width, nNodes,
+                                  (int)primitives.size(),
+                                  float(nodeBytes) / (1024.f * 1024.f));
+        treeBytes += nodeBytes + sizeof(*this) +
+                     primitives.size() * sizeof(primitives[0]);
+    } else {
+        LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
+                                  "primitives (%.2f MB)", totalNodes,
+                                  (int)primitives.size(),
+                                  float(totalNodes * sizeof(LinearBVHNode)) /
+                                  (1024.f * 1024.f));
+
+        // Compute representation of depth-first traversal of BVH tree
+        treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
+                     primitives.size() * sizeof(primitives[0]);
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        int offset = 0;
+        std::vector<BVHFlattenTask> flattenTasks;
+        flattenBVHTree(root, &offset, &flattenTasks);
+        // Only trees of a parallel build have subtrees flattened by tasks
+        if (!flattenTasks.empty())
+            ParallelFor([&](int64_t i) {
+                int taskOffset = flattenTasks[i].offset;
+                flattenBVHTree(flattenTasks[i].node, &taskOffset);
+                CHECK_EQ(flattenTasks[i].offset +
+                             flattenTasks[i].node->nSubtreeNodes,
+                         taskOffset);
+            }, flattenTasks.size(), 1);
+        CHECK_EQ(totalNodes, offset);
+    }
+    treeNodeBytes += nNodes * nodeSize();
+    treePrimitives += primitives.size();
+    if (!cacheFile.empty()) writeCache(cacheFile, key, primitiveInfo);
+}
+
+uint64_t BVHAccel::cacheKey(
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo) const {
+    // A tree only depends on the bounds of the primitives, their order and
+    // the build parameters. Hash chunks of bounds in parallel and then the
+    // chunks' hashes with the parameters.
+    int n = primitiveInfo.size();
+    std::vector<uint64_t> hashes(NumChunks(0, n) + 1);
+    ParallelForChunks(0, n, [&](int c, int chunkStart, int chunkEnd) {
+        uint64_t hash = 0;
+        for (int i = chunkStart; i < chunkEnd; ++i)
+            hash = MurmurHash64A(
+                (const unsigned char *)&primitiveInfo[i].bounds,
+                sizeof(Bounds3f), hash);
+        hashes[c] = hash;
+    });
+    int32_t params[7] = {bvhCacheVersion, (int32_t)sizeof(Float),
+                         maxPrimsInNode,  (int32_t)splitMethod,
+                         width,           quantized,
+                         n};
+    hashes.back() =
+        MurmurHash64A((const unsigned char *)params, sizeof(params), 0);
+    return MurmurHash64A((const unsigned char *)hashes.data(),
+                         hashes.size() * sizeof(uint64_t), 0);
+}
+
+size_t BVHAccel::nodeSize() const {
+    if (quantized)
+        return width == 4 ? sizeof(QuantizedBVHNode<4>)
+                          : width == 8 ? sizeof(QuantizedBVHNode<8>)
+                                       : sizeof(QuantizedBVHNode<2>);
+    return width == 4 ? sizeof(WideBVHNode<4>)
+                      : width == 8 ? sizeof(WideBVHNode<8>)
+                                   : sizeof(LinearBVHNode);
+}
+
+bool BVHAccel::readCache(const std::string &filename, uint64_t key) {
+    size_t size;
+    void *data = MapFile(filename, &size);
+    if (!data) return false;
+
+    // Check that the file holds a tree for these primitives
+    const BVHCacheHeader *header = (const BVHCacheHeader *)data;
+    int n = primitives.size();
+    size_t nodesOffset = BVHCacheNodesOffset(n);
+    if (size < sizeof(BVHCacheHeader) ||
+        memcmp(header->magic, bvhCacheMagic, sizeof(bvhCacheMagic)) != 0 ||
+        header->key != key || header->version != bvhCacheVersion ||
+        header->width != width || header->quantized != quantized ||
+        header->nPrimitives != n ||
+        header->nNodes < 1 || size != nodesOffset + header->nNodes * nodeSize()) {
+        Warning("Ignoring BVH cache file \"%s\", which does not hold a tree "
+                "for this geometry.", filename.c_str());
+        UnmapFile(data, size);
+        return false;
+    }
+    const int32_t *order =
+        (const int32_t *)((const char *)data + sizeof(BVHCacheHeader));
+    std::vector<std::shared_ptr<Primitive>> orderedPrims;
+    orderedPrims.reserve(n);
+    std::vector<bool> used(n, false);
+    for (int i = 0; i < n; ++i) {
+        if (order[i] < 0 || order[i] >= n || used[order[i]]) {
+            Warning("Ignoring damaged BVH cache file \"%s\".",
+                    filename.c_str());
+            UnmapFile(data, size);
+            return false;
+        }
+        used[order[i]] = true;
+        orderedPrims.push_back(primitives[order[i]]);
+    }
+
+    // Use the file's nodes in place
+    primitives.swap(orderedPrims);
+    void *nodeData = (char *)data + nodesOffset;
+    if (quantized)
+        quantizedNodes = nodeData;
+    else if (width == 4)
+        nodes4 = (WideBVHNode<4> *)nodeData;
+    else if (width == 8)
+        nodes8 = (WideBVHNode<8> *)nodeData;
+    else
+        nodes = (LinearBVHNode *)nodeData;
+    nNodes = header->nNodes;
+    bounds = header->bounds;
+    sahCost = header->sahCost;
+    ReportValue(sahCosts, sahCost);
+    cacheData = data;
+    cacheSize = size;
+    LOG(INFO) << StringPrintf("BVH with %d nodes for %d primitives loaded "
+                              "from \"%s\"", header->nNodes, n,
+                              filename.c_str());
+    treeBytes += header->nNodes * nodeSize() + sizeof(*this) +
                  primitives.size() * sizeof(primitives[0]);
-    nodes = AllocAligned<LinearBVHNode>(totalNodes);
-    int offset = 0;
-    flattenBVHTree(root, &offset);
-    CHECK_EQ(totalNodes, offset);
+    treeNodeBytes += header->nNodes * nodeSize();
+    treePrimitives += n;
+    return true;
 }
 
-Bounds3f BVHAccel::WorldBound() const {
-    return nodes ? nodes[0].bounds : Bounds3f();
+void BVHAccel::writeCache(
+    const std::string &filename, uint64_t key,
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo) const {
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic));
+    header.key = key;
+    header.version = bvhCacheVersion;
+    header.width = width;
+    header.quantized = quantized;
+    header.nPrimitives = primitiveInfo.size();
+    header.nNodes = nNodes;
+    header.sahCost = sahCost;
+    header.bounds = bounds;
+    std::vector<int32_t> order(primitiveInfo.size());
+    for (size_t i = 0; i < primitiveInfo.size(); ++i)
+        order[i] = primitiveInfo[i].primitiveNumber;
+    size_t orderEnd = sizeof(header) + order.size() * sizeof(int32_t);
+    std::vector<char> padding(BVHCacheNodesOffset(order.size()) - orderEnd, 0);
+    const void *nodeData =
+        quantized ? quantizedNodes
+                  : width == 4 ? (const void *)nodes4
+                               : width == 8 ? (const void *)nodes8
+                                            : (const void *)nodes;
+
+    // Write to a temporary file of this run first, so that other runs
+    // never read a partial tree or write to the same file
+#ifdef PBRT_IS_WINDOWS
+    std::string tempFilename = StringPrintf(
+        "%s.%d.%zx", filename.c_str(), _getpid(),
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+#else
+    std::string tempFilename = filename + ".XXXXXX";
+    int fd = mkstemp(&tempFilename[0]);
+    if (fd == -1) {
+        Warning("Unable to write BVH cache file \"%s\".", filename.c_str());
+        return;
+    }
+    // Make the cache as readable as a file created by _std::ofstream_
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    close(fd);
+#endif
+    std::ofstream out(tempFilename, std::ios::binary);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)order.data(), order.size() * sizeof(int32_t));
+    out.write(padding.data(), padding.size());
+    out.write((const char *)nodeData, nNodes * nodeSize());
+    out.close();
+    if (!out || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        Warning("Unable to write BVH cache file \"%s\".", filename.c_str());
+        std::remove(tempFilename.c_str());
+    }
 }
 
+Bounds3f BVHAccel::WorldBound() const { return bounds; }
+
 struct BucketInfo {
     int count = 0;
     Bounds3f bounds;
@@ -232,42 +1094,37 @@ struct BucketInfo {
 
 BVHBuildNode *BVHAccel::recursiveBuild(
     MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
-    int end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    int end, int *totalNodes, BVHSubtreeTasks *tasks) {
     CHECK_NE(start, end);
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
     (*totalNodes)++;
-    // Compute bounds of all primitives in BVH node
-    Bounds3f bounds;
-    for (int i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    // Compute bounds of all primitives and their centroids in BVH node
     int nPrimitives = end - start;
+    bool parallel = tasks && nPrimitives >= parallelBinPrims;
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(primitiveInfo, start, end, parallel, &bounds,
+                  &centroidBounds);
+    if (tasks && nPrimitives <= tasks->maxPrimitives) {
+        // Leave the subtree to a task of the parallel build
+        node->bounds = bounds;
+        tasks->subtrees.push_back({node, start, end});
+        return node;
+    }
+    // Leaves refer to their range of _primitiveInfo_, which is the order of
+    // the tree's primitives once it is built
     if (nPrimitives == 1) {
         // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
-        for (int i = start; i < end; ++i) {
-            int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
-        }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+        node->InitLeaf(start, nPrimitives, bounds);
         return node;
     } else {
-        // Compute bound of primitive centroids, choose split dimension _dim_
-        Bounds3f centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        // Choose split dimension _dim_
         int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
         int mid = (start + end) / 2;
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
-            for (int i = start; i < end; ++i) {
-                int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
-            }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+            node->InitLeaf(start, nPrimitives, bounds);
             return node;
         } else {
             // Partition primitives based on _splitMethod_
@@ -276,12 +1133,11 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                 // Partition primitives through node's midpoint
                 Float pmid =
                     (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
-                BVHPrimitiveInfo *midPtr = std::partition(
-                    &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+                mid = PartitionPrimitives(
+                    primitiveInfo, start, end, parallel,
                     [dim, pmid](const BVHPrimitiveInfo &pi) {
                         return pi.centroid[dim] < pmid;
                     });
-                mid = midPtr - &primitiveInfo[0];
                 // For lots of prims with large overlapping bounding boxes, this
                 // may fail to partition; in that case don't break and fall
                 // through
@@ -316,19 +1172,46 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                     // Allocate _BucketInfo_ for SAH partition buckets
                     PBRT_CONSTEXPR int nBuckets = 12;
                     BucketInfo buckets[nBuckets];
-
-                    // Initialize _BucketInfo_ for SAH partition buckets
-                    for (int i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
+                    auto bucketIndex = [=](const BVHPrimitiveInfo &pi) {
+                        int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
                         if (b == nBuckets) b = nBuckets - 1;
                         CHECK_GE(b, 0);
                         CHECK_LT(b, nBuckets);
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                    }
+                        return b;
+                    };
+
+                    // Initialize _BucketInfo_ for SAH partition buckets
+                    if (parallel) {
+                        // Bin each chunk's primitives separately and merge
+                        // the chunks' buckets, skipping empty ones: the
+                        // union of two empty bounds is not empty
+                        std::vector<BucketInfo> chunkBuckets(
+                            NumChunks(start, end) * nBuckets);
+                        ParallelForChunks(start, end, [&](int c, int chunkStart,
+                                                          int chunkEnd) {
+                            BucketInfo *b = &chunkBuckets[c * nBuckets];
+                            for (int i = chunkStart; i < chunkEnd; ++i) {
+                                BucketInfo &bucket =
+                                    b[bucketIndex(primitiveInfo[i])];
+                                bucket.count++;
+                                bucket.bounds = Union(bucket.bounds,
+                                                      primitiveInfo[i].bounds);
+                            }
+                        });
+                        for (size_t i = 0; i < chunkBuckets.size(); ++i) {
+                            if (chunkBuckets[i].count == 0) continue;
+                            buckets[i % nBuckets].count += chunkBuckets[i].count;
+                            buckets[i % nBuckets].bounds =
+                                Union(buckets[i % nBuckets].bounds,
+                                      chunkBuckets[i].bounds);
+                        }
+                    } else
+                        for (int i = start; i < end; ++i) {
+                            int b = bucketIndex(primitiveInfo[i]);
+                            buckets[b].count++;
+                            buckets[b].bounds = Union(buckets[b].bounds,
+                                                      primitiveInfo[i].bounds);
+                        }
 
                     // Compute costs for splitting after each bucket
                     Float cost[nBuckets - 1];
@@ -363,25 +1246,14 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                     // bucket
                     Float leafCost = nPrimitives;
                     if (nPrimitives > maxPrimsInNode || minCost < leafCost) {
-                        BVHPrimitiveInfo *pmid = std::partition(
-                            &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+                        mid = PartitionPrimitives(
+                            primitiveInfo, start, end, parallel,
                             [=](const BVHPrimitiveInfo &pi) {
-                                int b = nBuckets *
-                                        centroidBounds.Offset(pi.centroid)[dim];
-                                if (b == nBuckets) b = nBuckets - 1;
-                                CHECK_GE(b, 0);
-                                CHECK_LT(b, nBuckets);
-                                return b <= minCostSplitBucket;
+                                return bucketIndex(pi) <= minCostSplitBucket;
                             });
-                        mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
-                        for (int i = start; i < end; ++i) {
-                            int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
-                        }
-                        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+                        node->InitLeaf(start, nPrimitives, bounds);
                         return node;
                     }
                 }
@@ -390,22 +1262,57 @@ BVHBuildNode *BVHAccel::recursiveBuild(
             }
             node->InitInterior(dim,
                                recursiveBuild(arena, primitiveInfo, start, mid,
-                                              totalNodes, orderedPrims),
+                                              totalNodes, tasks),
                                recursiveBuild(arena, primitiveInfo, mid, end,
-                                              totalNodes, orderedPrims));
+                                              totalNodes, tasks));
         }
     }
     return node;
 }
 
-BVHBuildNode *BVHAccel::HLBVHBuild(
-    MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-    int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) const {
+BVHBuildNode *BVHAccel::parallelBuild(
+    MemoryArena &arena, MemoryArena *threadArenas,
+    std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes) {
+    // Split the upper levels on this thread, binning and partitioning large
+    // nodes' primitives in parallel, until subtrees are small enough to
+    // give every thread several of them
+    BVHSubtreeTasks tasks;
+    tasks.maxPrimitives = std::max<int>(
+        minSubtreePrims, primitiveInfo.size() / (8 * MaxThreadIndex()));
+    BVHBuildNode *root = recursiveBuild(arena, primitiveInfo, 0,
+                                        primitiveInfo.size(), totalNodes,
+                                        &tasks);
+
+    // Build the subtrees in parallel, largest first, each in the arena of
+    // the thread that builds it
+    std::vector<BVHSubtree> &subtrees = tasks.subtrees;
+    std::sort(subtrees.begin(), subtrees.end(),
+              [](const BVHSubtree &a, const BVHSubtree &b) {
+                  return a.end - a.start > b.end - b.start;
+              });
+    std::atomic<int> subtreeNodes(0);
+    ParallelFor([&](int64_t i) {
+        int nSubtreeNodes = 0;
+        *subtrees[i].node =
+            *recursiveBuild(threadArenas[ThreadIndex], primitiveInfo,
+                            subtrees[i].start, subtrees[i].end, &nSubtreeNodes);
+        subtrees[i].node->nSubtreeNodes = nSubtreeNodes;
+        // The subtree's root replaces the node counted for it above
+        subtreeNodes += nSubtreeNodes - 1;
+    }, subtrees.size(), 1);
+    *totalNodes += subtreeNodes;
+    parallelSubtrees += subtrees.size();
+    return root;
+}
+
+BVHBuildNode *BVHAccel::HLBVHBuild(MemoryArena &arena,
+                                   std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                                   int *totalNodes) const {
     // Compute bounding box of all primitive centroids
-    Bounds3f bounds;
-    for (const BVHPrimitiveInfo &pi : primitiveInfo)
-        bounds = Union(bounds, pi.centroid);
+    int n = primitiveInfo.size();
+    Bounds3f primBounds, bounds;
+    ComputeBounds(primitiveInfo, 0, n, n >= parallelBinPrims, &primBounds,
+                  &bounds);
 
     // Compute Morton indices of primitives
     std::vector<MortonPrimitive> mortonPrims(primitiveInfo.size());
@@ -423,41 +1330,64 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
 
     // Create LBVH treelets at bottom of BVH
 
-    // Find intervals of primitives for each treelet
-    std::vector<LBVHTreelet> treeletsToBuild;
-    for (int start = 0, end = 1; end <= (int)mortonPrims.size(); ++end) {
+    // Find intervals of primitives for each treelet, which start where the
+    // high bits of the Morton codes change
 #ifdef PBRT_HAVE_BINARY_CONSTANTS
-      uint32_t mask = 0b00111111111111000000000000000000;
+    const uint32_t mask = 0b00111111111111000000000000000000;
 #else
-      uint32_t mask = 0x3ffc0000;
+    const uint32_t mask = 0x3ffc0000;
 #endif
-      if (end == (int)mortonPrims.size() ||
-            ((mortonPrims[start].mortonCode & mask) !=
-             (mortonPrims[end].mortonCode & mask))) {
-            // Add entry to _treeletsToBuild_ for this treelet
-            int nPrimitives = end - start;
-            int maxBVHNodes = 2 * nPrimitives;
-            BVHBuildNode *nodes = arena.Alloc<BVHBuildNode>(maxBVHNodes, false);
-            treeletsToBuild.push_back({start, nPrimitives, nodes});
-            start = end;
+    std::vector<std::vector<int>> chunkTreeletStarts(NumChunks(0, n));
+    ParallelForChunks(0, n, [&](int c, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; ++i)
+            if (i == 0 || (mortonPrims[i - 1].mortonCode & mask) !=
+                              (mortonPrims[i].mortonCode & mask))
+                chunkTreeletStarts[c].push_back(i);
+    });
+    std::vector<LBVHTreelet> treeletsToBuild;
+    for (const std::vector<int> &starts : chunkTreeletStarts)
+        for (int start : starts) {
+            if (!treeletsToBuild.empty())
+                treeletsToBuild.back().nPrimitives =
+                    start - treeletsToBuild.back().startIndex;
+            treeletsToBuild.push_back({start, 0, nullptr});
         }
+    treeletsToBuild.back().nPrimitives =
+        n - treeletsToBuild.back().startIndex;
+    for (LBVHTreelet &tr : treeletsToBuild) {
+        // Allocate the most nodes the treelet may need
+        int maxBVHNodes = 2 * tr.nPrimitives;
+        tr.buildNodes = arena.Alloc<BVHBuildNode>(maxBVHNodes, false);
     }
 
-    // Create LBVHs for treelets in parallel
-    std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
-    orderedPrims.resize(primitives.size());
+    // Create LBVHs for treelets in parallel, largest first; their leaves
+    // refer to the primitives' positions in _mortonPrims_
+    std::vector<int> treeletOrder(treeletsToBuild.size());
+    for (size_t i = 0; i < treeletOrder.size(); ++i) treeletOrder[i] = i;
+    std::sort(treeletOrder.begin(), treeletOrder.end(), [&](int a, int b) {
+        return treeletsToBuild[a].nPrimitives > treeletsToBuild[b].nPrimitives;
+    });
+    std::atomic<int> atomicTotal(0);
     ParallelFor([&](int i) {
         // Generate _i_th LBVH treelet
         int nodesCreated = 0;
         const int firstBitIndex = 29 - 12;
-        LBVHTreelet &tr = treeletsToBuild[i];
+        LBVHTreelet &tr = treeletsToBuild[treeletOrder[i]];
         tr.buildNodes =
             emitLBVH(tr.buildNodes, primitiveInfo, &mortonPrims[tr.startIndex],
-                     tr.nPrimitives, &nodesCreated, orderedPrims,
-                     &orderedPrimsOffset, firstBitIndex);
+                     tr.nPrimitives, &nodesCreated, tr.startIndex,
+                     firstBitIndex);
+        tr.buildNodes->nSubtreeNodes = nodesCreated;
         atomicTotal += nodesCreated;
     }, treeletsToBuild.size());
     *totalNodes = atomicTotal;
+    // Put _primitiveInfo_ in the order of the leaves
+    std::vector<BVHPrimitiveInfo> sortedInfo(n);
+    ParallelForChunks(0, n, [&](int c, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; ++i)
+            sortedInfo[i] = primitiveInfo[mortonPrims[i].primitiveIndex];
+    });
+    primitiveInfo.swap(sortedInfo);
 
     // Create and return SAH BVH from LBVH treelets
     std::vector<BVHBuildNode *> finishedTreelets;
@@ -472,18 +1402,15 @@ BVHBuildNode *BVHAccel::emitLBVH(
     BVHBuildNode *&buildNodes,
     const std::vector<BVHPrimitiveInfo> &primitiveInfo,
     MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-    std::atomic<int> *orderedPrimsOffset, int bitIndex) const {
+    int firstPrimOffset, int bitIndex) const {
     CHECK_GT(nPrimitives, 0);
     if (bitIndex == -1 || nPrimitives < maxPrimsInNode) {
         // Create and return leaf node of LBVH treelet
         (*totalNodes)++;
         BVHBuildNode *node = buildNodes++;
         Bounds3f bounds;
-        int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
         for (int i = 0; i < nPrimitives; ++i) {
             int primitiveIndex = mortonPrims[i].primitiveIndex;
-            orderedPrims[firstPrimOffset + i] = primitives[primitiveIndex];
             bounds = Union(bounds, primitiveInfo[primitiveIndex].bounds);
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
@@ -494,8 +1421,7 @@ BVHBuildNode *BVHAccel::emitLBVH(
         if ((mortonPrims[0].mortonCode & mask) ==
             (mortonPrims[nPrimitives - 1].mortonCode & mask))
             return emitLBVH(buildNodes, primitiveInfo, mortonPrims, nPrimitives,
-                            totalNodes, orderedPrims, orderedPrimsOffset,
-                            bitIndex - 1);
+                            totalNodes, firstPrimOffset, bitIndex - 1);
 
         // Find LBVH split point for this dimension
         int searchStart = 0, searchEnd = nPrimitives - 1;
@@ -521,11 +1447,10 @@ BVHBuildNode *BVHAccel::emitLBVH(
         BVHBuildNode *node = buildNodes++;
         BVHBuildNode *lbvh[2] = {
             emitLBVH(buildNodes, primitiveInfo, mortonPrims, splitOffset,
-                     totalNodes, orderedPrims, orderedPrimsOffset,
-                     bitIndex - 1),
+                     totalNodes, firstPrimOffset, bitIndex - 1),
             emitLBVH(buildNodes, primitiveInfo, &mortonPrims[splitOffset],
-                     nPrimitives - splitOffset, totalNodes, orderedPrims,
-                     orderedPrimsOffset, bitIndex - 1)};
+                     nPrimitives - splitOffset, totalNodes,
+                     firstPrimOffset + splitOffset, bitIndex - 1)};
         int axis = bitIndex % 3;
         node->InitInterior(axis, lbvh[0], lbvh[1]);
         return node;
@@ -634,7 +1559,14 @@ BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
     return node;
 }
 
-int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
+int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset,
+                             std::vector<BVHFlattenTask> *tasks) {
+    if (tasks && node->nSubtreeNodes > 0) {
+        // Reserve the nodes of a subtree that is flattened by its own task
+        tasks->push_back({node, *offset});
+        *offset += node->nSubtreeNodes;
+        return tasks->back().offset;
+    }
     LinearBVHNode *linearNode = &nodes[*offset];
     linearNode->bounds = node->bounds;
     int myOffset = (*offset)++;
@@ -647,16 +1579,35 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
         // Create interior flattened BVH node
         linearNode->axis = node->splitAxis;
         linearNode->nPrimitives = 0;
-        flattenBVHTree(node->children[0], offset);
+        flattenBVHTree(node->children[0], offset, tasks);
         linearNode->secondChildOffset =
-            flattenBVHTree(node->children[1], offset);
+            flattenBVHTree(node->children[1], offset, tasks);
     }
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+BVHAccel::~BVHAccel() {
+    if (cacheData)
+        UnmapFile(cacheData, cacheSize);
+    else {
+        FreeAligned(nodes);
+        FreeAligned(nodes4);
+        FreeAligned(nodes8);
+        FreeAligned(quantizedNodes);
+    }
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    if (quantizedNodes) {
+        ProfilePhase p(Prof::AccelIntersect);
+        return TraverseQuantizedBVH<false>(quantizedNodes, width, primitives,
+                                           ray, isect);
+    }
+    if (nodes4 || nodes8) {
+        ProfilePhase p(Prof::AccelIntersect);
+        return nodes4 ? TraverseWideBVH<4, false>(nodes4, primitives, ray, isect)
+                      : TraverseWideBVH<8, false>(nodes8, primitives, ray, isect);
+    }
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersect);
     bool hit = false;
@@ -665,8 +1616,10 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     // Follow ray through BVH nodes to find primitive intersections
     int toVisitOffset = 0, currentNodeIndex = 0;
     int nodesToVisit[64];
+    int nVisited = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
+        ++nVisited;
         // Check ray against BVH node
         if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             if (node->nPrimitives > 0) {
@@ -693,24 +1646,40 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
+    nodesVisited += nVisited;
+    ++bvhQueries;
     return hit;
 }
 
 bool BVHAccel::IntersectP(const Ray &ray) const {
+    if (quantizedNodes) {
+        ProfilePhase p(Prof::AccelIntersectP);
+        return TraverseQuantizedBVH<true>(quantizedNodes, width, primitives,
+                                          ray, nullptr);
+    }
+    if (nodes4 || nodes8) {
+        ProfilePhase p(Prof::AccelIntersectP);
+        return nodes4 ? TraverseWideBVH<4, true>(nodes4, primitives, ray, nullptr)
+                      : TraverseWideBVH<8, true>(nodes8, primitives, ray, nullptr);
+    }
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
     int nodesToVisit[64];
     int toVisitOffset = 0, currentNodeIndex = 0;
+    int nVisited = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
+        ++nVisited;
         if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             // Process BVH node _node_ for traversal
             if (node->nPrimitives > 0) {
                 for (int i = 0; i < node->nPrimitives; ++i) {
                     if (primitives[node->primitivesOffset + i]->IntersectP(
                             ray)) {
+                        nodesVisited += nVisited;
+                        ++bvhQueries;
                         return true;
                     }
                 }
@@ -731,6 +1700,8 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
+    nodesVisited += nVisited;
+    ++bvhQueries;
     return false;
 }
 
@@ -753,7 +1724,16 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     }
 
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(prims, maxPrimsInNode, splitMethod);
+    int width = ps.FindOneInt("width", 2);
+    if (width != 2 && width != 4 && width != 8) {
+        Warning("BVH width %d unsupported; it must be 2, 4 or 8. Using 2.",
+                width);
+        width = 2;
+    }
+    bool quantized = ps.FindOneBool("quantized", false);
+    std::string cacheDir = ps.FindOneFilename("cachedir", "");
+    return std::make_shared<BVHAccel>(prims, maxPrimsInNode, splitMethod,
+                                      width, quantized, cacheDir);
 }
 
 }  // namespace pbrt
@@ -50,6 +50,10 @@ struct BVHBuildNode;
 struct BVHPrimitiveInfo;
 struct MortonPrimitive;
 struct LinearBVHNode;
+struct BVHSubtreeTasks;
+struct BVHFlattenTask;
+template <int N>
+struct WideBVHNode;
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
@@ -60,38 +64,71 @@ class BVHAccel : public Aggregate {
     // BVHAccel Public Methods
     BVHAccel(const std::vector<std::shared_ptr<Primitive>> &p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH, int width = 2,
+             bool quantized = false, const std::string &cacheDir = "");
     Bounds3f WorldBound() const;
     ~BVHAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Expected cost of a ray query under the surface area heuristic the
+    // build minimizes, in units of primitive intersection tests
+    Float SAHCost() const { return sahCost; }
+    // File of the tree in the BVH cache, if one was given, and whether the
+    // tree was read from it rather than built
+    const std::string &CacheFile() const { return cacheFile; }
+    bool LoadedFromCache() const { return cacheData != nullptr; }
+    // Memory taken by the tree's nodes
+    size_t NodeBytes() const { return nNodes * nodeSize(); }
 
   private:
     // BVHAccel Private Methods
     BVHBuildNode *recursiveBuild(
         MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int start, int end, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
-    BVHBuildNode *HLBVHBuild(
-        MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims) const;
+        int start, int end, int *totalNodes, BVHSubtreeTasks *tasks = nullptr);
+    BVHBuildNode *parallelBuild(MemoryArena &arena, MemoryArena *threadArenas,
+                                std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                                int *totalNodes);
+    BVHBuildNode *HLBVHBuild(MemoryArena &arena,
+                             std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                             int *totalNodes) const;
     BVHBuildNode *emitLBVH(
         BVHBuildNode *&buildNodes,
         const std::vector<BVHPrimitiveInfo> &primitiveInfo,
         MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-        std::atomic<int> *orderedPrimsOffset, int bitIndex) const;
+        int firstPrimOffset, int bitIndex) const;
     BVHBuildNode *buildUpperSAH(MemoryArena &arena,
                                 std::vector<BVHBuildNode *> &treeletRoots,
                                 int start, int end, int *totalNodes) const;
-    int flattenBVHTree(BVHBuildNode *node, int *offset);
+    int flattenBVHTree(BVHBuildNode *node, int *offset,
+                       std::vector<BVHFlattenTask> *tasks = nullptr);
+    uint64_t cacheKey(const std::vector<BVHPrimitiveInfo> &primitiveInfo) const;
+    size_t nodeSize() const;
+    bool readCache(const std::string &filename, uint64_t key);
+    void writeCache(const std::string &filename, uint64_t key,
+                    const std::vector<BVHPrimitiveInfo> &primitiveInfo) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    // Children per node: 2 for the binary _LinearBVHNode_ layout, 4 or 8
+    // for wide nodes that test all their children's bounds at once
+    const int width;
+    // Whether nodes store their children's bounds in 8 bits, in the
+    // _QuantizedBVHNode_ layout of the tree's width
+    const bool quantized;
     std::vector<std::shared_ptr<Primitive>> primitives;
     LinearBVHNode *nodes = nullptr;
+    WideBVHNode<4> *nodes4 = nullptr;
+    WideBVHNode<8> *nodes8 = nullptr;
+    void *quantizedNodes = nullptr;
+    int nNodes = 0;
+    Bounds3f bounds;
+    Float sahCost = 0;
+    // Memory-mapped cache file that holds the nodes, if they were read from
+    // one
+    std::string cacheFile;
+    void *cacheData = nullptr;
+    size_t cacheSize = 0;
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
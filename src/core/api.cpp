@@ -115,8 +115,12 @@
 
 // Added for CV
 #include "cv/cv_integrator.h"
+#include "cv/cv_bdpt.h"
+#include "cv/cv_sppm.h"
 #include "cv/cv_film.h"
-#include "cv/dualmat.h"
+#include "cv/variantmat.h"
+#include "cv/varianttex.h"
+#include "cv/variantlight.h"
 
 #include <map>
 #include <stdio.h>
@@ -185,6 +189,7 @@ struct RenderOptions {
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>> *currentInstance = nullptr;
     bool haveScatteringMedia = false;
+    int nMaterialVariants = 1;
 };
 
 struct GraphicsState {
@@ -412,6 +417,16 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
 
 STAT_COUNTER("Scene/Materials created", nMaterialsCreated);
 
+// Grows the number of variants control-variate films render to _n_
+static void AddRenderVariants(int n) {
+    if (renderOptions->nMaterialVariants > 1 &&
+        renderOptions->nMaterialVariants != n)
+        Warning("Scene variants have different numbers of variants. Missing "
+                "variants fall back to the first one.");
+    renderOptions->nMaterialVariants =
+        std::max(renderOptions->nMaterialVariants, n);
+}
+
 std::shared_ptr<Material> MakeMaterial(const std::string &name,
                                        const TextureParams &mp) {
     Material *material = nullptr;
@@ -446,23 +461,47 @@ std::shared_ptr<Material> MakeMaterial(const std::string &name,
         }
 
         material = CreateMixMaterial(mp, mat1, mat2);
-    } else if (name == "dual") {
-        std::string m1 = mp.FindString("namedmaterial1", "");
-        std::string m2 = mp.FindString("namedmaterial2", "");
-        std::shared_ptr<Material> mat1 = graphicsState.namedMaterials[m1];
-        std::shared_ptr<Material> mat2 = graphicsState.namedMaterials[m2];
-        if (!mat1) {
-            Error("Named material \"%s\" undefined.  Using \"matte\"",
-                  m1.c_str());
-            mat1 = MakeMaterial("matte", mp);
+    } else if (name == "dual" || name == "variant") {
+        // "dual" is the two-variant form: F and H, in that order
+        std::vector<std::string> names;
+        if (name == "dual") {
+            names.push_back(mp.FindString("namedmaterial1", ""));
+            names.push_back(mp.FindString("namedmaterial2", ""));
+        } else {
+            int nNames;
+            const std::string *n =
+                mp.GetGeomParams().FindString("namedmaterials", &nNames);
+            if (!n)
+                n = mp.GetMaterialParams().FindString("namedmaterials",
+                                                      &nNames);
+            if (n) names.assign(n, n + nNames);
         }
-        if (!mat2) {
-            Error("Named material \"%s\" undefined.  Using \"matte\"",
-                  m2.c_str());
-            mat2 = MakeMaterial("matte", mp);
+        if (names.empty()) {
+            Error("No \"namedmaterials\" given for \"variant\" material.");
+            names.push_back("");
+        }
+        if (names.size() > MaxVariants) {
+            Error("%d material variants given, but at most %d are supported. "
+                  "Ignoring the rest.", (int)names.size(), MaxVariants);
+            names.resize(MaxVariants);
+        }
+        std::vector<std::shared_ptr<Material>> variants;
+        for (const std::string &n : names) {
+            std::shared_ptr<Material> mat = graphicsState.namedMaterials[n];
+            if (!mat) {
+                Error("Named material \"%s\" undefined.  Using \"matte\"",
+                      n.c_str());
+                mat = MakeMaterial("matte", mp);
+            }
+            variants.push_back(mat);
         }
 
-        material = CreateDualMaterial(mat1, mat2);
+        int selected = SelectedVariant(variants.size());
+        if (selected >= 0)
+            variants = {variants[selected]};
+        else
+            AddRenderVariants(variants.size());
+        material = CreateVariantMaterial(variants);
     }
     else if (name == "metal")
         material = CreateMetalMaterial(mp);
@@ -490,6 +529,15 @@ std::shared_ptr<Material> MakeMaterial(const std::string &name,
             "Use \"path\" or \"volpath\".",
             name.c_str(), renderOptions->IntegratorName.c_str());
 
+    // Materials with variant textures render as variant materials of
+    // themselves, each variant evaluating its own textures
+    int nTextureVariants = std::min(mp.NumTextureVariants(), MaxVariants);
+    if (material && nTextureVariants > 1 && !material->HasVariants()) {
+        AddRenderVariants(nTextureVariants);
+        material = CreateVariantMaterial(std::vector<std::shared_ptr<Material>>(
+            nTextureVariants, std::shared_ptr<Material>(material)));
+    }
+
     mp.ReportUnused();
     if (!material) Error("Unable to create material \"%s\"", name.c_str());
     else ++nMaterialsCreated;
@@ -524,6 +572,8 @@ std::shared_ptr<Texture<Float>> MakeFloatTexture(const std::string &name,
         tex = CreateMarbleFloatTexture(tex2world, tp);
     else if (name == "windy")
         tex = CreateWindyFloatTexture(tex2world, tp);
+    else if (name == "dual" || name == "variant")
+        tex = CreateVariantFloatTexture(tex2world, tp);
     else
         Warning("Float texture \"%s\" unknown.", name.c_str());
     tp.ReportUnused();
@@ -558,6 +608,8 @@ std::shared_ptr<Texture<Spectrum>> MakeSpectrumTexture(
         tex = CreateMarbleSpectrumTexture(tex2world, tp);
     else if (name == "windy")
         tex = CreateWindySpectrumTexture(tex2world, tp);
+    else if (name == "dual" || name == "variant")
+        tex = CreateVariantSpectrumTexture(tex2world, tp);
     else
         Warning("Spectrum texture \"%s\" unknown.", name.c_str());
     tp.ReportUnused();
@@ -612,12 +664,74 @@ std::shared_ptr<Medium> MakeMedium(const std::string &name,
     return std::shared_ptr<Medium>(m);
 }
 
+// Number of variants of a "dual" or "variant" light: its emission
+// parameters may be given as lists with one value per variant
+static const char *LightVariantSpectra[] = {"L", "I", "scale"};
+
+static int NumLightVariants(const std::string &name, const ParamSet &paramSet) {
+    if (name == "dual") return 2;
+    int n = 1, count;
+    for (const char *param : LightVariantSpectra)
+        if (paramSet.FindSpectrum(param, &count)) n = std::max(n, count);
+    if (paramSet.FindString("mapname", &count)) n = std::max(n, count);
+    if (n > MaxVariants) {
+        Error("%d light variants given, but at most %d are supported. "
+              "Ignoring the rest.", n, MaxVariants);
+        n = MaxVariants;
+    }
+    return n;
+}
+
+// Parameters of variant _k_ of a "dual" or "variant" light; lists shorter
+// than the variant count fall back to their first value
+static ParamSet LightVariantParams(const ParamSet &paramSet, int k) {
+    ParamSet params = paramSet;
+    int count;
+    for (const char *param : LightVariantSpectra) {
+        const Spectrum *s = paramSet.FindSpectrum(param, &count);
+        if (!s || count == 1) continue;
+        std::unique_ptr<Float[]> rgb(new Float[3]);
+        s[k < count ? k : 0].ToRGB(rgb.get());
+        params.EraseSpectrum(param);
+        params.AddRGBSpectrum(param, std::move(rgb), 3);
+    }
+    const std::string *mapnames = paramSet.FindString("mapname", &count);
+    if (mapnames && count > 1) {
+        std::unique_ptr<std::string[]> mapname(new std::string[1]);
+        mapname[0] = mapnames[k < count ? k : 0];
+        params.EraseString("mapname");
+        params.AddString("mapname", std::move(mapname), 1);
+    }
+    return params;
+}
+
 std::shared_ptr<Light> MakeLight(const std::string &name,
                                  const ParamSet &paramSet,
                                  const Transform &light2world,
                                  const MediumInterface &mediumInterface) {
     std::shared_ptr<Light> light;
-    if (name == "point")
+    if (name == "dual" || name == "variant") {
+        std::string type = paramSet.FindOneString("type", "");
+        if (type.empty() || type == "dual" || type == "variant") {
+            Error("No light \"type\" given for \"%s\" light.", name.c_str());
+            return nullptr;
+        }
+        int nVariants = NumLightVariants(name, paramSet);
+        int selected = SelectedVariant(nVariants);
+        if (selected >= 0)
+            return MakeLight(type, LightVariantParams(paramSet, selected),
+                             light2world, mediumInterface);
+        std::vector<std::shared_ptr<Light>> lights;
+        for (int k = 0; k < nVariants; ++k) {
+            std::shared_ptr<Light> variant =
+                MakeLight(type, LightVariantParams(paramSet, k), light2world,
+                          mediumInterface);
+            if (!variant) return nullptr;
+            lights.push_back(variant);
+        }
+        AddRenderVariants(nVariants);
+        return std::make_shared<VariantLight>(light2world, lights);
+    } else if (name == "point")
         light =
             CreatePointLight(light2world, mediumInterface.outside, paramSet);
     else if (name == "spot")
@@ -644,7 +758,29 @@ std::shared_ptr<AreaLight> MakeAreaLight(const std::string &name,
                                          const ParamSet &paramSet,
                                          const std::shared_ptr<Shape> &shape) {
     std::shared_ptr<AreaLight> area;
-    if (name == "area" || name == "diffuse")
+    if (name == "dual" || name == "variant") {
+        std::string type = paramSet.FindOneString("type", "diffuse");
+        if (type == "dual" || type == "variant") {
+            Error("Area light \"type\" of \"%s\" light cannot have variants.",
+                  name.c_str());
+            return nullptr;
+        }
+        int nVariants = NumLightVariants(name, paramSet);
+        int selected = SelectedVariant(nVariants);
+        if (selected >= 0)
+            return MakeAreaLight(type, light2world, mediumInterface,
+                                 LightVariantParams(paramSet, selected), shape);
+        std::vector<std::shared_ptr<AreaLight>> lights;
+        for (int k = 0; k < nVariants; ++k) {
+            std::shared_ptr<AreaLight> variant =
+                MakeAreaLight(type, light2world, mediumInterface,
+                              LightVariantParams(paramSet, k), shape);
+            if (!variant) return nullptr;
+            lights.push_back(variant);
+        }
+        AddRenderVariants(nVariants);
+        return std::make_shared<VariantAreaLight>(light2world, lights);
+    } else if (name == "area" || name == "diffuse")
         area = CreateDiffuseAreaLight(light2world, mediumInterface.outside,
                                       paramSet, shape);
     else
@@ -748,7 +884,8 @@ Film *MakeFilm(const std::string &name, const ParamSet &paramSet,
         film = CreateFilm(paramSet, std::move(filter));
     }
     else if(name == "cv") {
-        film = CreateCvFilm(paramSet, std::move(filter));
+        film = CreateCvFilm(paramSet, std::move(filter),
+                            renderOptions->nMaterialVariants);
     }
     else {
         Warning("Film \"%s\" unknown.\n", name.c_str());
@@ -1075,6 +1212,17 @@ void pbrtTransformEnd() {
     }
 }
 
+// Textures built from variant textures have the same variants, so that
+// materials using them are recognized as having variants, too
+template <typename T>
+static std::shared_ptr<Texture<T>> WrapTextureVariants(
+    const std::shared_ptr<Texture<T>> &tex, const TextureParams &tp) {
+    int nVariants = std::min(tp.NumTextureVariants(), MaxVariants);
+    if (!tex || nVariants <= tex->NumVariants()) return tex;
+    return std::make_shared<VariantTexture<T>>(
+        std::vector<std::shared_ptr<Texture<T>>>(nVariants, tex));
+}
+
 void pbrtTexture(const std::string &name, const std::string &type,
                  const std::string &texname, const ParamSet &params) {
     VERIFY_WORLD("Texture");
@@ -1088,6 +1236,7 @@ void pbrtTexture(const std::string &name, const std::string &type,
         WARN_IF_ANIMATED_TRANSFORM("Texture");
         std::shared_ptr<Texture<Float>> ft =
             MakeFloatTexture(texname, curTransform[0], tp);
+        ft = WrapTextureVariants(ft, tp);
         if (ft) graphicsState.floatTextures[name] = ft;
     } else if (type == "color" || type == "spectrum") {
         // Create _color_ texture and store in _spectrumTextures_
@@ -1097,6 +1246,7 @@ void pbrtTexture(const std::string &name, const std::string &type,
         WARN_IF_ANIMATED_TRANSFORM("Texture");
         std::shared_ptr<Texture<Spectrum>> st =
             MakeSpectrumTexture(texname, curTransform[0], tp);
+        st = WrapTextureVariants(st, tp);
         if (st) graphicsState.spectrumTextures[name] = st;
     } else
         Error("Texture type \"%s\" unknown.", type.c_str());
@@ -1474,24 +1624,30 @@ Integrator *RenderOptions::MakeIntegrator() const {
     else if (IntegratorName == "path")
         integrator = CreatePathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "cv")
-        integrator = CreateCvPathIntegrator(IntegratorParams, sampler, camera);
+        integrator = CreateCvPathIntegrator(IntegratorParams, sampler, camera,
+                                            primitives);
     else if (IntegratorName == "volpath")
         integrator = CreateVolPathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "bdpt") {
         integrator = CreateBDPTIntegrator(IntegratorParams, sampler, camera);
+    } else if (IntegratorName == "cvbdpt") {
+        integrator = CreateCvBDPTIntegrator(IntegratorParams, sampler, camera);
     } else if (IntegratorName == "mlt") {
         integrator = CreateMLTIntegrator(IntegratorParams, camera);
     } else if (IntegratorName == "ambientocclusion") {
         integrator = CreateAOIntegrator(IntegratorParams, sampler, camera);
     } else if (IntegratorName == "sppm") {
         integrator = CreateSPPMIntegrator(IntegratorParams, camera);
+    } else if (IntegratorName == "cvsppm") {
+        integrator = CreateCvSPPMIntegrator(IntegratorParams, camera);
     } else {
         Error("Integrator \"%s\" unknown.", IntegratorName.c_str());
         return nullptr;
     }
 
     if (renderOptions->haveScatteringMedia && IntegratorName != "volpath" &&
-        IntegratorName != "bdpt" && IntegratorName != "mlt") {
+        IntegratorName != "bdpt" && IntegratorName != "cvbdpt" &&
+        IntegratorName != "mlt") {
         Warning(
             "Scene has scattering media but \"%s\" integrator doesn't support "
             "volume scattering. Consider using \"volpath\", \"bdpt\", or "
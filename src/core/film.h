@@ -62,6 +62,8 @@ class Film {
          std::unique_ptr<Filter> filter, Float diagonal,
          const std::string &filename, Float scale,
          Float maxSampleLuminance = Infinity);
+    // Cameras delete their films through _Film_ pointers
+    virtual ~Film() {}
     Bounds2i GetSampleBounds() const;
     Bounds2f GetPhysicalExtent() const;
     virtual std::unique_ptr<FilmTile> GetFilmTile(const Bounds2i &sampleBounds);
@@ -57,6 +57,7 @@ static bool WriteImagePFM(const std::string &filename, const Float *rgb,
                           int xres, int yres);
 static RGBSpectrum *ReadImagePFM(const std::string &filename, int *xres,
                                  int *yres);
+static RGBSpectrum *ReadBinary(const std::string &name, int *w, int *h);
 
 // ImageIO Function Definitions
 std::unique_ptr<RGBSpectrum[]> ReadImage(const std::string &name,
@@ -73,6 +74,9 @@ std::unique_ptr<RGBSpectrum[]> ReadImage(const std::string &name,
     else if (HasExtension(name, ".pfm"))
         return std::unique_ptr<RGBSpectrum[]>(
             ReadImagePFM(name, &resolution->x, &resolution->y));
+    else if (HasExtension(name, ".bin"))
+        return std::unique_ptr<RGBSpectrum[]>(
+            ReadBinary(name, &resolution->x, &resolution->y));
     Error("Unable to load image stored in format \"%s\" for filename \"%s\".",
           strrchr(name.c_str(), '.') ? (strrchr(name.c_str(), '.') + 1)
                                      : "(unknown)",
@@ -106,6 +110,32 @@ void WriteBinary(const std::string &name, const Float *rgb,
     writer.close();
 }
 
+static RGBSpectrum *ReadBinary(const std::string &name, int *w, int *h) {
+    std::ifstream reader(name.c_str(), std::ios::in | std::ios::binary);
+    if (!reader.read((char *)w, sizeof(int)) ||
+        !reader.read((char *)h, sizeof(int)) || *w <= 0 || *h <= 0) {
+        Error("Unable to read image header from \"%s\"", name.c_str());
+        return nullptr;
+    }
+
+    std::unique_ptr<float[]> buffer(new float[3 * *w]);
+    RGBSpectrum *ret = new RGBSpectrum[*w * *h];
+    for (int y = 0; y < *h; ++y) {
+        if (!reader.read((char *)buffer.get(), sizeof(float) * 3 * *w)) {
+            Error("Premature end of file in \"%s\"", name.c_str());
+            delete[] ret;
+            return nullptr;
+        }
+        for (int x = 0; x < *w; ++x) {
+            Float rgb[3] = {buffer[3 * x], buffer[3 * x + 1], buffer[3 * x + 2]};
+            ret[y * *w + x] = RGBSpectrum::FromRGB(rgb);
+        }
+    }
+    LOG(INFO) << StringPrintf("Read binary image %s (%d x %d)",
+                              name.c_str(), *w, *h);
+    return ret;
+}
+
 void WriteImage(const std::string &name, const Float *rgb,
                 const Bounds2i &outputBounds, const Point2i &totalResolution) {
     Vector2i resolution = outputBounds.Diagonal();
@@ -77,6 +77,8 @@ class Light {
                                Float *pdfDir) const = 0;
     virtual void Pdf_Le(const Ray &ray, const Normal3f &nLight, Float *pdfPos,
                         Float *pdfDir) const = 0;
+    // Only _VariantLight_ and _VariantAreaLight_ override this
+    virtual bool HasVariants() const { return false; }
 
     // Light Public Data
     const int flags;
@@ -55,6 +55,9 @@ class Material {
                                             MemoryArena &arena,
                                             TransportMode mode,
                                             bool allowMultipleLobes) const = 0;
+    // Only _VariantMaterial_ overrides this; control-variate integrators use
+    // it to skip per-variant work on ordinary surfaces
+    virtual bool HasVariants() const { return false; }
     virtual ~Material();
     static void Bump(const std::shared_ptr<Texture<Float>> &d,
                      SurfaceInteraction *si);
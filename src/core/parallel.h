@@ -104,6 +104,9 @@ extern PBRT_THREAD_LOCAL int ThreadIndex;
 void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count);
 int MaxThreadIndex();
 int NumSystemCores();
+// Returns whether _ParallelInit()_ has started worker threads, and thus
+// whether _ParallelFor()_ runs its iterations in parallel
+bool ParallelThreadsStarted();
 
 void ParallelInit();
 void ParallelCleanup();
@@ -723,9 +723,12 @@ std::shared_ptr<Texture<Spectrum>> TextureParams::GetSpectrumTexture(
     std::string name = geomParams.FindTexture(n);
     if (name == "") name = materialParams.FindTexture(n);
     if (name != "") {
-        if (spectrumTextures.find(name) != spectrumTextures.end())
-            return spectrumTextures[name];
-        else
+        auto iter = spectrumTextures.find(name);
+        if (iter != spectrumTextures.end()) {
+            nTextureVariants =
+                std::max(nTextureVariants, iter->second->NumVariants());
+            return iter->second;
+        } else
             Error(
                 "Couldn't find spectrum texture named \"%s\" "
                 "for parameter \"%s\"",
@@ -741,9 +744,12 @@ std::shared_ptr<Texture<Spectrum>> TextureParams::GetSpectrumTextureOrNull(
     std::string name = geomParams.FindTexture(n);
     if (name == "") name = materialParams.FindTexture(n);
     if (name != "") {
-        if (spectrumTextures.find(name) != spectrumTextures.end())
-            return spectrumTextures[name];
-        else {
+        auto iter = spectrumTextures.find(name);
+        if (iter != spectrumTextures.end()) {
+            nTextureVariants =
+                std::max(nTextureVariants, iter->second->NumVariants());
+            return iter->second;
+        } else {
             Error(
                 "Couldn't find spectrum texture named \"%s\" for parameter \"%s\"",
                 name.c_str(), n.c_str());
@@ -761,9 +767,12 @@ std::shared_ptr<Texture<Float>> TextureParams::GetFloatTexture(
     std::string name = geomParams.FindTexture(n);
     if (name == "") name = materialParams.FindTexture(n);
     if (name != "") {
-        if (floatTextures.find(name) != floatTextures.end())
-            return floatTextures[name];
-        else
+        auto iter = floatTextures.find(name);
+        if (iter != floatTextures.end()) {
+            nTextureVariants =
+                std::max(nTextureVariants, iter->second->NumVariants());
+            return iter->second;
+        } else
             Error(
                 "Couldn't find float texture named \"%s\" for parameter \"%s\"",
                 name.c_str(), n.c_str());
@@ -777,9 +786,12 @@ std::shared_ptr<Texture<Float>> TextureParams::GetFloatTextureOrNull(
     std::string name = geomParams.FindTexture(n);
     if (name == "") name = materialParams.FindTexture(n);
     if (name != "") {
-        if (floatTextures.find(name) != floatTextures.end())
-            return floatTextures[name];
-        else {
+        auto iter = floatTextures.find(name);
+        if (iter != floatTextures.end()) {
+            nTextureVariants =
+                std::max(nTextureVariants, iter->second->NumVariants());
+            return iter->second;
+        } else {
             Error(
                 "Couldn't find float texture named \"%s\" for parameter \"%s\"",
                 name.c_str(), n.c_str());
@@ -215,12 +215,15 @@ class TextureParams {
     }
     const ParamSet &GetGeomParams() const { return geomParams; }
     const ParamSet &GetMaterialParams() const { return materialParams; }
+    // Largest variant count of the named textures looked up so far
+    int NumTextureVariants() const { return nTextureVariants; }
 
   private:
     // TextureParams Private Data
     std::map<std::string, std::shared_ptr<Texture<Float>>> &floatTextures;
     std::map<std::string, std::shared_ptr<Texture<Spectrum>>> &spectrumTextures;
     const ParamSet &geomParams, &materialParams;
+    mutable int nTextureVariants = 1;
 };
 
 }  // namespace pbrt
@@ -156,6 +156,13 @@ struct Options {
     bool quiet = false;
     bool cat = false, toPly = false;
     std::string imageFile;
+    bool resume = false;
+    // Variant of materials, textures and lights with variants to render
+    // on its own, or -1 to render them all
+    int variant = -1;
+    // Seed mixed into the samplers' sample values, so that runs with
+    // different seeds take independent samples
+    int seed = 0;
 };
 
 extern Options PbrtOptions;
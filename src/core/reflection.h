@@ -175,7 +175,7 @@ class BSDF {
     Spectrum f(const Vector3f &woW, const Vector3f &wiW,
                BxDFType flags = BSDF_ALL) const;
 
-	Spectrum BSDF::f_pdf(const Vector3f &woW, const Vector3f &wiW, Float *pdf,
+    Spectrum f_pdf(const Vector3f &woW, const Vector3f &wiW, Float *pdf,
 		BxDFType flags) const;
 
     Spectrum rho(int nSamples, const Point2f *samples1, const Point2f *samples2,
@@ -204,7 +204,7 @@ class BSDF {
     static PBRT_CONSTEXPR int MaxBxDFs = 8;
     BxDF *bxdfs[MaxBxDFs];
     friend class MixMaterial;
-    friend class DualMaterial;
+    friend class VariantMaterial;
 };
 
 inline std::ostream &operator<<(std::ostream &os, const BSDF &bsdf) {
@@ -64,6 +64,32 @@ bool Sampler::StartNextSample() {
     return ++currentPixelSampleIndex < samplesPerPixel;
 }
 
+void Sampler::SetRNGDimension(RNG &rng, int dim) const {
+    // Mix the pixel and the sample index into a sequence index with the
+    // finalizer of SplitMix64; every dimension gets two values so that
+    // _Get2D()_ calls do not overlap the next dimension
+    uint64_t v = ((uint64_t)(uint32_t)currentPixel.x << 32 |
+                  (uint32_t)currentPixel.y) ^
+                 ((uint64_t)currentPixelSampleIndex * 0x9e3779b97f4a7c15ull);
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+    rng.SetSequence(SeededSequence(v ^ (v >> 31)));
+    rng.Advance(2 * dim);
+}
+
+uint64_t Sampler::SeededSequence(uint64_t sequence) {
+    return sequence ^ ((uint64_t)(uint32_t)PbrtOptions.seed *
+                       0xd1b54a32d192ed03ull);
+}
+
+Float Sampler::SeededPixelOffset(Float s, int dim) {
+    if (PbrtOptions.seed == 0) return s;
+    // A toroidal shift keeps the pixel's samples stratified
+    RNG rng(SeededSequence(dim));
+    s += rng.UniformFloat();
+    return s < 1 ? s : s - 1;
+}
+
 bool Sampler::SetSampleNumber(int64_t sampleNum) {
     // Reset array offsets for next pixel sample
     array1DOffset = array2DOffset = 0;
@@ -107,21 +133,38 @@ PixelSampler::PixelSampler(int64_t samplesPerPixel, int nSampledDimensions)
 
 bool PixelSampler::StartNextSample() {
     current1DDimension = current2DDimension = 0;
+    fixedDimensions = false;
     return Sampler::StartNextSample();
 }
 
 bool PixelSampler::SetSampleNumber(int64_t sampleNum) {
     current1DDimension = current2DDimension = 0;
+    fixedDimensions = false;
     return Sampler::SetSampleNumber(sampleNum);
 }
 
+void PixelSampler::SetDimension(int dim) {
+    // The 1D and 2D sample vectors are indexed independently, so one index
+    // serves both
+    current1DDimension = current2DDimension = dim;
+    SetRNGDimension(dimensionRng, dim);
+    fixedDimensions = true;
+}
+
+void PixelSampler::RequestSampledDimensions(int n) {
+    while ((int)samples1D.size() < n) {
+        samples1D.push_back(std::vector<Float>(samplesPerPixel));
+        samples2D.push_back(std::vector<Point2f>(samplesPerPixel));
+    }
+}
+
 Float PixelSampler::Get1D() {
     ProfilePhase _(Prof::GetSample);
     CHECK_LT(currentPixelSampleIndex, samplesPerPixel);
     if (current1DDimension < samples1D.size())
         return samples1D[current1DDimension++][currentPixelSampleIndex];
     else
-        return rng.UniformFloat();
+        return (fixedDimensions ? dimensionRng : rng).UniformFloat();
 }
 
 Point2f PixelSampler::Get2D() {
@@ -129,8 +172,8 @@ Point2f PixelSampler::Get2D() {
     CHECK_LT(currentPixelSampleIndex, samplesPerPixel);
     if (current2DDimension < samples2D.size())
         return samples2D[current2DDimension++][currentPixelSampleIndex];
-    else
-        return Point2f(rng.UniformFloat(), rng.UniformFloat());
+    RNG &r = fixedDimensions ? dimensionRng : rng;
+    return Point2f(r.UniformFloat(), r.UniformFloat());
 }
 
 void GlobalSampler::StartPixel(const Point2i &p) {
@@ -177,6 +220,11 @@ bool GlobalSampler::SetSampleNumber(int64_t sampleNum) {
     return Sampler::SetSampleNumber(sampleNum);
 }
 
+void GlobalSampler::SetDimension(int dim) {
+    // Skip over the dimensions reserved for sample arrays
+    dimension = dim < arrayStartDim ? dim : dim + arrayEndDim - arrayStartDim;
+}
+
 Float GlobalSampler::Get1D() {
     ProfilePhase _(Prof::GetSample);
     if (dimension >= arrayStartDim && dimension < arrayEndDim)
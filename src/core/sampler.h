@@ -46,6 +46,10 @@
 
 namespace pbrt {
 
+// Purposes of the sample dimension blocks selected by
+// _Sampler::StartDimensionBlock()_
+enum class SamplePurpose { Camera, Light, BSDF, RussianRoulette };
+
 // Sampler Declarations
 class Sampler {
   public:
@@ -69,11 +73,45 @@ class Sampler {
                           currentPixel.y, currentPixelSampleIndex);
     }
     int64_t CurrentSampleNumber() const { return currentPixelSampleIndex; }
+    // Dimension namespaces: an integrator that starts the block of each
+    // purpose before drawing its samples gets the same sample values for
+    // it no matter how many samples other purposes consumed before, so
+    // that renders of different scenes stay correlated sample by sample.
+    // The camera block holds the five dimensions of _GetCameraSample()_,
+    // and every bounce gets a block of _BounceDimensions_ dimensions: five
+    // for light sampling, two for BSDF sampling and one for Russian
+    // roulette.
+    static PBRT_CONSTEXPR int CameraDimensions = 5, BounceDimensions = 8;
+    void StartDimensionBlock(SamplePurpose purpose, int bounce = 0) {
+        static const int offsets[] = {0, 0, 5, 7};
+        SetDimension(purpose == SamplePurpose::Camera
+                         ? 0
+                         : CameraDimensions + bounce * BounceDimensions +
+                               offsets[(int)purpose]);
+    }
+    // Makes the next sample come from dimension _dim_ of the current pixel
+    // sample; samplers without fixed dimensions ignore it
+    virtual void SetDimension(int dim) {}
+    // Asks for well-distributed samples in the first _n_ dimensions, for
+    // integrators whose dimension blocks reach past the sampler's
+    // default; only samplers that precompute their dimensions use it
+    virtual void RequestSampledDimensions(int n) {}
 
     // Sampler Public Data
     const int64_t samplesPerPixel;
 
   protected:
+    // Sampler Protected Methods
+    // Positions _rng_ at dimension _dim_ of a stream that depends only on
+    // the current pixel sample
+    void SetRNGDimension(RNG &rng, int dim) const;
+    // Returns the _RNG_ sequence index _sequence_ mixed with the run's
+    // seed, _PbrtOptions.seed_; the seed 0 leaves it unchanged
+    static uint64_t SeededSequence(uint64_t sequence);
+    // Shifts the position _s_ within the pixel along dimension _dim_, 0 or
+    // 1, by an offset that depends on the run's seed, wrapping around
+    static Float SeededPixelOffset(Float s, int dim);
+
     // Sampler Protected Data
     Point2i currentPixel;
     int64_t currentPixelSampleIndex;
@@ -94,6 +132,8 @@ class PixelSampler : public Sampler {
     bool SetSampleNumber(int64_t);
     Float Get1D();
     Point2f Get2D();
+    void SetDimension(int dim);
+    void RequestSampledDimensions(int n);
 
   protected:
     // PixelSampler Protected Data
@@ -101,6 +141,12 @@ class PixelSampler : public Sampler {
     std::vector<std::vector<Point2f>> samples2D;
     int current1DDimension = 0, current2DDimension = 0;
     RNG rng;
+
+  private:
+    // Dimensions past the precomputed ones come from _rng_, unless
+    // _SetDimension()_ positioned _dimensionRng_ for them
+    RNG dimensionRng;
+    bool fixedDimensions = false;
 };
 
 class GlobalSampler : public Sampler {
@@ -111,6 +157,7 @@ class GlobalSampler : public Sampler {
     bool SetSampleNumber(int64_t sampleNum);
     Float Get1D();
     Point2f Get2D();
+    void SetDimension(int dim);
     GlobalSampler(int64_t samplesPerPixel) : Sampler(samplesPerPixel) {}
     virtual int64_t GetIndexForSample(int64_t sampleNum) const = 0;
     virtual Float SampleDimension(int64_t index, int dimension) const = 0;
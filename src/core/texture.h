@@ -136,6 +136,9 @@ class Texture {
   public:
     // Texture Interface
     virtual T Evaluate(const SurfaceInteraction &) const = 0;
+    // Only _VariantTexture_ overrides this; materials using textures with
+    // several variants are rendered as variant materials
+    virtual int NumVariants() const { return 1; }
     virtual ~Texture() {}
 };
 
@@ -0,0 +1,479 @@
+// cv/cv_bdpt.cpp*
+#include "cv_bdpt.h"
+#include "cv_film.h"
+#include "variantlight.h"
+#include "lightdistrib.h"
+#include "paramset.h"
+#include "progressreporter.h"
+#include "sampler.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_PERCENT("Integrator/Zero-radiance paths", zeroRadiancePaths, totalPaths);
+STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+
+namespace {
+
+// Variant counterpart of _Vertex::f()_
+Spectrum VariantF(const Vertex &v, const CvVertexVariants &variants, int i,
+                  const Vertex &next, TransportMode mode) {
+    if (v.type != VertexType::Surface || !variants.bsdfs.HasVariants())
+        return v.f(next, mode);
+    const BSDF *bsdf = variants.bsdfs.bsdf[i];
+    if (!bsdf) return Spectrum(0.f);
+    Vector3f wi = next.p() - v.p();
+    if (wi.LengthSquared() == 0) return 0.;
+    wi = Normalize(wi);
+    return bsdf->f(v.si.wo, wi) * CorrectShadingNormal(v.si, v.si.wo, wi, mode);
+}
+
+// Variant counterpart of _RandomWalk()_. Directions are sampled with
+// variant 0's BSDF, and the other variants' throughputs are weighted by
+// their BSDF values over variant 0's PDF. The walk continues as long as
+// any variant carries a contribution.
+int CvRandomWalk(const Scene &scene, RayDifferential ray, Sampler &sampler,
+                 MemoryArena &arena, Spectrum beta, Float pdf, int maxDepth,
+                 TransportMode mode, int nVariants, Vertex *path,
+                 CvVertexVariants *variants, Float *reciprocalPdf) {
+    if (maxDepth == 0) return 0;
+    int bounces = 0;
+    Spectrum betas[MaxVariants];
+    for (int i = 0; i < nVariants; ++i) betas[i] = beta;
+    // Declare variables for forward and reverse probability densities
+    Float pdfFwd = pdf, pdfRev = 0;
+    while (true) {
+        // Attempt to create the next subpath vertex in _path_
+        MediumInteraction mi;
+
+        // Trace a ray and sample the medium, if any
+        SurfaceInteraction isect;
+        bool foundIntersection = scene.Intersect(ray, &isect);
+        bool allBlack = true;
+        if (ray.medium) {
+            Spectrum Tr = ray.medium->Sample(ray, sampler, arena, &mi);
+            for (int i = 0; i < nVariants; ++i) betas[i] *= Tr;
+        }
+        for (int i = 0; i < nVariants; ++i) allBlack &= betas[i].IsBlack();
+        if (allBlack) break;
+        Vertex &vertex = path[bounces], &prev = path[bounces - 1];
+        CvVertexVariants &vertexVariants = variants[bounces];
+        for (int i = 0; i < nVariants; ++i) vertexVariants.beta[i] = betas[i];
+        vertexVariants.bsdfs.nVariants = 0;
+        if (mi.IsValid()) {
+            // Record medium interaction in _path_ and compute forward
+            // density; all variants share the phase function
+            vertex = Vertex::CreateMedium(mi, betas[0], pdfFwd, prev);
+            if (++bounces >= maxDepth) break;
+
+            // Sample direction and compute reverse density at preceding vertex
+            Vector3f wi;
+            pdfFwd = pdfRev = mi.phase->Sample_p(-ray.d, &wi, sampler.Get2D());
+            ray = mi.SpawnRay(wi);
+        } else {
+            // Handle surface interaction for path generation
+            if (!foundIntersection) {
+                // Capture escaped rays when tracing from the camera
+                if (mode == TransportMode::Radiance) {
+                    vertex = Vertex::CreateLight(EndpointInteraction(ray),
+                                                 betas[0], pdfFwd);
+                    ++bounces;
+                }
+                break;
+            }
+
+            // Compute scattering functions of all variants for _mode_ and
+            // skip over medium boundaries
+            ComputeVariantScatteringFunctions(&isect, ray, arena, nVariants,
+                                              &vertexVariants.bsdfs, true,
+                                              mode);
+            if (!isect.bsdf) {
+                ray = isect.SpawnRay(ray.d);
+                continue;
+            }
+
+            // Initialize _vertex_ with surface intersection information
+            vertex = Vertex::CreateSurface(isect, betas[0], pdfFwd, prev);
+            if (++bounces >= maxDepth) break;
+
+            // Sample variant 0's BSDF at current vertex, weight the other
+            // variants for the same direction and compute reverse
+            // probability
+            Vector3f wi, wo = isect.wo;
+            BxDFType type;
+            Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdfFwd,
+                                              BSDF_ALL, &type);
+            if (pdfFwd == 0.f) break;
+            Float weight = AbsDot(wi, isect.shading.n) *
+                           CorrectShadingNormal(isect, wo, wi, mode) / pdfFwd;
+            const VariantBSDF &bsdfs = vertexVariants.bsdfs;
+            allBlack = f.IsBlack();
+            betas[0] *= f * weight;
+            for (int i = 1; i < nVariants; ++i) {
+                // Specular lobes cannot be evaluated for a given direction,
+                // but variants sharing variant 0's BSDF have its value
+                Spectrum fi = (!bsdfs.HasVariants() || bsdfs.bsdf[i] == isect.bsdf)
+                                  ? f
+                                  : bsdfs.bsdf[i] ? bsdfs.bsdf[i]->f(wo, wi)
+                                                  : Spectrum(0.f);
+                allBlack &= fi.IsBlack();
+                betas[i] *= fi * weight;
+            }
+            if (allBlack) break;
+            if (reciprocalPdf) *reciprocalPdf /= pdfFwd;
+            pdfRev = isect.bsdf->Pdf(wi, wo, BSDF_ALL);
+            if (type & BSDF_SPECULAR) {
+                vertex.delta = true;
+                pdfRev = pdfFwd = 0;
+            }
+            ray = isect.SpawnRay(wi);
+        }
+
+        // Compute reverse area density at preceding vertex
+        prev.pdfRev = vertex.ConvertDensity(pdfRev, prev);
+    }
+    return bounces;
+}
+
+// Initializes the variants of a subpath endpoint, which all share _beta_
+void EndpointVariants(CvVertexVariants *variants, int nVariants,
+                      const Spectrum &beta) {
+    for (int i = 0; i < nVariants; ++i) variants->beta[i] = beta;
+    variants->bsdfs.nVariants = 0;
+}
+
+}  // anonymous namespace
+
+int GenerateCvCameraSubpath(const Scene &scene, Sampler &sampler,
+                            MemoryArena &arena, int maxDepth, int nVariants,
+                            const Camera &camera, const Point2f &pFilm,
+                            Vertex *path, CvVertexVariants *variants,
+                            Float *reciprocalPdf) {
+    if (maxDepth == 0) return 0;
+    ProfilePhase _(Prof::BDPTGenerateSubpath);
+    // Sample initial ray for camera subpath
+    CameraSample cameraSample;
+    cameraSample.pFilm = pFilm;
+    cameraSample.time = sampler.Get1D();
+    cameraSample.pLens = sampler.Get2D();
+    RayDifferential ray;
+    Spectrum beta = camera.GenerateRayDifferential(cameraSample, &ray);
+    ray.ScaleDifferentials(1 / std::sqrt(sampler.samplesPerPixel));
+
+    // Generate first vertex on camera subpath and start random walk
+    Float pdfPos, pdfDir;
+    path[0] = Vertex::CreateCamera(&camera, ray, beta);
+    EndpointVariants(&variants[0], nVariants, beta);
+    camera.Pdf_We(ray, &pdfPos, &pdfDir);
+    return CvRandomWalk(scene, ray, sampler, arena, beta, pdfDir, maxDepth - 1,
+                        TransportMode::Radiance, nVariants, path + 1,
+                        variants + 1, reciprocalPdf) +
+           1;
+}
+
+int GenerateCvLightSubpath(
+    const Scene &scene, Sampler &sampler, MemoryArena &arena, int maxDepth,
+    int nVariants, Float time, const Distribution1D &lightDistr,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    Vertex *path, CvVertexVariants *variants) {
+    if (maxDepth == 0) return 0;
+    ProfilePhase _(Prof::BDPTGenerateSubpath);
+    // Sample initial ray for light subpath
+    Float lightPdf;
+    int lightNum = lightDistr.SampleDiscrete(sampler.Get1D(), &lightPdf);
+    const std::shared_ptr<Light> &light = scene.lights[lightNum];
+    RayDifferential ray;
+    Normal3f nLight;
+    Float pdfPos, pdfDir;
+    Spectrum Le = light->Sample_Le(sampler.Get2D(), sampler.Get2D(), time, &ray,
+                                   &nLight, &pdfPos, &pdfDir);
+    if (pdfPos == 0 || pdfDir == 0 || Le.IsBlack()) return 0;
+
+    // Generate first vertex on light subpath and start random walk
+    path[0] =
+        Vertex::CreateLight(light.get(), ray, nLight, Le, pdfPos * lightPdf);
+    EndpointVariants(&variants[0], nVariants, Le);
+    Spectrum beta = Le * AbsDot(nLight, ray.d) / (lightPdf * pdfPos * pdfDir);
+    int nVertices =
+        CvRandomWalk(scene, ray, sampler, arena, beta, pdfDir, maxDepth - 1,
+                     TransportMode::Importance, nVariants, path + 1,
+                     variants + 1, nullptr);
+
+    // Correct subpath sampling densities for infinite area lights
+    if (path[0].IsInfiniteLight()) {
+        // Set spatial density of _path[1]_ for infinite area light
+        if (nVertices > 0) {
+            path[1].pdfFwd = pdfPos;
+            if (path[1].IsOnSurface())
+                path[1].pdfFwd *= AbsDot(ray.d, path[1].ng());
+        }
+
+        // Set spatial density of _path[0]_ for infinite area light
+        path[0].pdfFwd =
+            InfiniteLightDensity(scene, lightDistr, lightToIndex, ray.d);
+    }
+    return nVertices + 1;
+}
+
+void ConnectCvBDPT(
+    const Scene &scene, Vertex *lightVertices,
+    const CvVertexVariants *lightVariants, Vertex *cameraVertices,
+    const CvVertexVariants *cameraVariants, int s, int t, int nVariants,
+    const Distribution1D &lightDistr,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    const Camera &camera, Sampler &sampler, Point2f *pRaster, Spectrum *L) {
+    ProfilePhase _(Prof::BDPTConnectSubpaths);
+    for (int i = 0; i < nVariants; ++i) L[i] = Spectrum(0.f);
+    // Ignore invalid connections related to infinite area lights
+    if (t > 1 && s != 0 && cameraVertices[t - 1].type == VertexType::Light)
+        return;
+    auto allBlack = [&]() {
+        for (int i = 0; i < nVariants; ++i)
+            if (!L[i].IsBlack()) return false;
+        return true;
+    };
+
+    // Perform connection and write every variant's contribution to _L_;
+    // visibility is tested once for all of them
+    Vertex sampled;
+    if (s == 0) {
+        // Interpret the camera subpath as a complete path
+        const Vertex &pt = cameraVertices[t - 1];
+        if (pt.IsLight()) {
+            Spectrum Le = pt.Le(scene, cameraVertices[t - 2]);
+            for (int i = 0; i < nVariants; ++i)
+                L[i] = Le * cameraVariants[t - 1].beta[i];
+        }
+    } else if (t == 1) {
+        // Sample a point on the camera and connect it to the light subpath
+        const Vertex &qs = lightVertices[s - 1];
+        const CvVertexVariants &qsVariants = lightVariants[s - 1];
+        if (qs.IsConnectible()) {
+            VisibilityTester vis;
+            Vector3f wi;
+            Float pdf;
+            Spectrum Wi = camera.Sample_Wi(qs.GetInteraction(), sampler.Get2D(),
+                                           &wi, &pdf, pRaster, &vis);
+            if (pdf > 0 && !Wi.IsBlack()) {
+                // Initialize dynamically sampled vertex and _L_ for $t=1$ case
+                sampled = Vertex::CreateCamera(&camera, vis.P1(), Wi / pdf);
+                Float cosTheta = qs.IsOnSurface() ? AbsDot(wi, qs.ns()) : 1;
+                for (int i = 0; i < nVariants; ++i)
+                    L[i] = qsVariants.beta[i] *
+                           VariantF(qs, qsVariants, i, sampled,
+                                    TransportMode::Importance) *
+                           sampled.beta * cosTheta;
+                if (!allBlack()) {
+                    Spectrum Tr = vis.Tr(scene, sampler);
+                    for (int i = 0; i < nVariants; ++i) L[i] *= Tr;
+                }
+            }
+        }
+    } else if (s == 1) {
+        // Sample a point on a light and connect it to the camera subpath
+        const Vertex &pt = cameraVertices[t - 1];
+        const CvVertexVariants &ptVariants = cameraVariants[t - 1];
+        if (pt.IsConnectible()) {
+            Float lightPdf;
+            VisibilityTester vis;
+            Vector3f wi;
+            Float pdf;
+            int lightNum =
+                lightDistr.SampleDiscrete(sampler.Get1D(), &lightPdf);
+            const std::shared_ptr<Light> &light = scene.lights[lightNum];
+            Spectrum lightWeight = light->Sample_Li(
+                pt.GetInteraction(), sampler.Get2D(), &wi, &pdf, &vis);
+            if (pdf > 0 && !lightWeight.IsBlack()) {
+                EndpointInteraction ei(vis.P1(), light.get());
+                sampled =
+                    Vertex::CreateLight(ei, lightWeight / (pdf * lightPdf), 0);
+                sampled.pdfFwd =
+                    sampled.PdfLightOrigin(scene, pt, lightDistr, lightToIndex);
+                Float cosTheta = pt.IsOnSurface() ? AbsDot(wi, pt.ns()) : 1;
+                for (int i = 0; i < nVariants; ++i)
+                    L[i] = ptVariants.beta[i] *
+                           VariantF(pt, ptVariants, i, sampled,
+                                    TransportMode::Radiance) *
+                           sampled.beta * cosTheta;
+                // Only check visibility if the path would carry radiance.
+                if (!allBlack()) {
+                    Spectrum Tr = vis.Tr(scene, sampler);
+                    for (int i = 0; i < nVariants; ++i) L[i] *= Tr;
+                }
+            }
+        }
+    } else {
+        // Handle all other bidirectional connection cases
+        const Vertex &qs = lightVertices[s - 1], &pt = cameraVertices[t - 1];
+        const CvVertexVariants &qsVariants = lightVariants[s - 1],
+                               &ptVariants = cameraVariants[t - 1];
+        if (qs.IsConnectible() && pt.IsConnectible()) {
+            for (int i = 0; i < nVariants; ++i)
+                L[i] = qsVariants.beta[i] *
+                       VariantF(qs, qsVariants, i, pt,
+                                TransportMode::Importance) *
+                       VariantF(pt, ptVariants, i, qs, TransportMode::Radiance) *
+                       ptVariants.beta[i];
+            if (!allBlack()) {
+                Spectrum g = G(scene, sampler, qs, pt);
+                for (int i = 0; i < nVariants; ++i) L[i] *= g;
+            }
+        }
+    }
+
+    ++totalPaths;
+    ReportValue(pathLength, s + t - 2);
+    if (allBlack()) {
+        ++zeroRadiancePaths;
+        return;
+    }
+
+    // Compute the MIS weight for the connection strategy from variant 0's
+    // densities and apply it to all variants
+    Float misWeight = MISWeight(scene, lightVertices, cameraVertices, sampled,
+                                s, t, lightDistr, lightToIndex);
+    DCHECK(!std::isnan(misWeight));
+    for (int i = 0; i < nVariants; ++i) L[i] *= misWeight;
+}
+
+// CvBDPTIntegrator Method Definitions
+void CvBDPTIntegrator::Render(const Scene &scene) {
+    CvFilm *film = dynamic_cast<CvFilm *>(camera->film);
+    if (!film) {
+        Error("The \"cvbdpt\" integrator needs a \"cv\" film.");
+        return;
+    }
+    const int nVariants = film->nVariants;
+    if (nVariants > 1 && HasLightVariants(scene))
+        Warning("The \"cvbdpt\" integrator only renders the first variant of "
+                "lights with variants; use \"cv\" to compare them.");
+    std::unique_ptr<LightDistribution> lightDistribution =
+        CreateLightSampleDistribution(lightSampleStrategy, scene);
+
+    // Compute a reverse mapping from light pointers to offsets into the
+    // scene lights vector (and, equivalently, offsets into lightDistr)
+    std::unordered_map<const Light *, size_t> lightToIndex;
+    for (size_t i = 0; i < scene.lights.size(); ++i)
+        lightToIndex[scene.lights[i].get()] = i;
+
+    // Partition the image into tiles
+    const Bounds2i sampleBounds = film->GetSampleBounds();
+    const Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int tileSize = 16;
+    const int nXTiles = (sampleExtent.x + tileSize - 1) / tileSize;
+    const int nYTiles = (sampleExtent.y + tileSize - 1) / tileSize;
+    ProgressReporter reporter(nXTiles * nYTiles, "Rendering");
+
+    // Render and write the output image to disk
+    if (scene.lights.size() > 0) {
+        ParallelFor2D([&](const Point2i tile) {
+            // Render a single tile using BDPT for all variants
+            MemoryArena arena;
+            int seed = tile.y * nXTiles + tile.x;
+            std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+            std::unique_ptr<CvFilmTile> filmTile =
+                film->GetCvFilmTile(tileBounds);
+            for (Point2i pPixel : tileBounds) {
+                tileSampler->StartPixel(pPixel);
+                if (!InsideExclusive(pPixel, pixelBounds))
+                    continue;
+                do {
+                    // Generate a single sample using BDPT
+                    Point2f pFilm = (Point2f)pPixel + tileSampler->Get2D();
+
+                    // Trace the camera subpath
+                    Vertex *cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
+                    Vertex *lightVertices = arena.Alloc<Vertex>(maxDepth + 1);
+                    CvVertexVariants *cameraVariants =
+                        arena.Alloc<CvVertexVariants>(maxDepth + 2);
+                    CvVertexVariants *lightVariants =
+                        arena.Alloc<CvVertexVariants>(maxDepth + 1);
+                    Float reciprocalPdf = 1;
+                    int nCamera = GenerateCvCameraSubpath(
+                        scene, *tileSampler, arena, maxDepth + 2, nVariants,
+                        *camera, pFilm, cameraVertices, cameraVariants,
+                        &reciprocalPdf);
+                    // Get a distribution for sampling the light at the
+                    // start of the light subpath; see _BDPTIntegrator_
+                    const Distribution1D *lightDistr =
+                        lightDistribution->Lookup(cameraVertices[0].p());
+                    // Now trace the light subpath
+                    int nLight = GenerateCvLightSubpath(
+                        scene, *tileSampler, arena, maxDepth + 1, nVariants,
+                        cameraVertices[0].time(), *lightDistr, lightToIndex,
+                        lightVertices, lightVariants);
+
+                    // Execute all BDPT connection strategies
+                    Spectrum L[MaxVariants];
+                    for (int t = 1; t <= nCamera; ++t) {
+                        for (int s = 0; s <= nLight; ++s) {
+                            int depth = t + s - 2;
+                            if ((s == 1 && t == 1) || depth < 0 ||
+                                depth > maxDepth)
+                                continue;
+                            // Execute the $(s, t)$ connection strategy and
+                            // update _L_
+                            Point2f pFilmNew = pFilm;
+                            Spectrum Lpath[MaxVariants];
+                            ConnectCvBDPT(scene, lightVertices, lightVariants,
+                                          cameraVertices, cameraVariants, s, t,
+                                          nVariants, *lightDistr, lightToIndex,
+                                          *camera, *tileSampler, &pFilmNew,
+                                          Lpath);
+                            if (t != 1) {
+                                for (int i = 0; i < nVariants; ++i)
+                                    L[i] += Lpath[i];
+                                continue;
+                            }
+                            bool black = true;
+                            for (int i = 0; i < nVariants; ++i)
+                                black &= Lpath[i].IsBlack();
+                            if (!black)
+                                film->AddSplat(pFilmNew,
+                                               CvSample(Lpath, nVariants, 0));
+                        }
+                    }
+                    filmTile->AddSample(
+                        pFilm, CvSample(L, nVariants, reciprocalPdf, nCamera - 1));
+                    arena.Reset();
+                } while (tileSampler->StartNextSample());
+            }
+            film->MergeFilmTile(std::move(filmTile));
+            reporter.Update();
+        }, Point2i(nXTiles, nYTiles));
+        reporter.Done();
+    }
+    film->WriteImage(1.0f / sampler->samplesPerPixel, sampler->samplesPerPixel);
+}
+
+CvBDPTIntegrator *CreateCvBDPTIntegrator(const ParamSet &params,
+                                         std::shared_ptr<Sampler> sampler,
+                                         std::shared_ptr<const Camera> camera) {
+    int maxDepth = params.FindOneInt("maxdepth", 5);
+    int np;
+    const int *pb = params.FindInt("pixelbounds", &np);
+    Bounds2i pixelBounds = camera->film->GetSampleBounds();
+    if (pb) {
+        if (np != 4)
+            Error("Expected four values for \"pixelbounds\" parameter. Got %d.",
+                  np);
+        else {
+            pixelBounds = Intersect(pixelBounds,
+                                    Bounds2i{{pb[0], pb[2]}, {pb[1], pb[3]}});
+            if (pixelBounds.Area() == 0)
+                Error("Degenerate \"pixelbounds\" specified.");
+        }
+    }
+
+    std::string lightStrategy = params.FindOneString("lightsamplestrategy",
+                                                     "power");
+    return new CvBDPTIntegrator(sampler, camera, maxDepth, pixelBounds,
+                                lightStrategy);
+}
+
+}  // namespace pbrt
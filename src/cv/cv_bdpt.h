@@ -0,0 +1,78 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CV_BDPT_H
+#define PBRT_CV_BDPT_H
+
+// cv/cv_bdpt.h*
+#include "integrators/bdpt.h"
+
+#include "cv_pixel.h"
+#include "variantmat.h"
+
+namespace pbrt {
+
+class CvFilm;
+
+// Material variant state of a BDPT subpath vertex. The _Vertex_ itself
+// describes variant 0, which subpaths are sampled with; its PDFs and
+// therefore the MIS weights are shared by all variants, and only the
+// throughputs and BSDFs differ.
+struct CvVertexVariants {
+    Spectrum beta[MaxVariants];
+    // Set for surface vertices whose material has variants
+    VariantBSDF bsdfs;
+};
+
+// CvBDPTIntegrator Declarations
+class CvBDPTIntegrator : public Integrator {
+  public:
+    // CvBDPTIntegrator Public Methods
+    CvBDPTIntegrator(std::shared_ptr<Sampler> sampler,
+                     std::shared_ptr<const Camera> camera, int maxDepth,
+                     const Bounds2i &pixelBounds,
+                     const std::string &lightSampleStrategy = "power")
+        : sampler(sampler),
+          camera(camera),
+          maxDepth(maxDepth),
+          pixelBounds(pixelBounds),
+          lightSampleStrategy(lightSampleStrategy) {}
+    void Render(const Scene &scene);
+
+  private:
+    // CvBDPTIntegrator Private Data
+    std::shared_ptr<Sampler> sampler;
+    std::shared_ptr<const Camera> camera;
+    const int maxDepth;
+    const Bounds2i pixelBounds;
+    const std::string lightSampleStrategy;
+};
+
+int GenerateCvCameraSubpath(const Scene &scene, Sampler &sampler,
+                            MemoryArena &arena, int maxDepth, int nVariants,
+                            const Camera &camera, const Point2f &pFilm,
+                            Vertex *path, CvVertexVariants *variants,
+                            Float *reciprocalPdf);
+int GenerateCvLightSubpath(
+    const Scene &scene, Sampler &sampler, MemoryArena &arena, int maxDepth,
+    int nVariants, Float time, const Distribution1D &lightDistr,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    Vertex *path, CvVertexVariants *variants);
+// Variant counterpart of _ConnectBDPT()_: computes the MIS-weighted
+// contribution of the $(s, t)$ strategy for every variant into _L_
+void ConnectCvBDPT(
+    const Scene &scene, Vertex *lightVertices,
+    const CvVertexVariants *lightVariants, Vertex *cameraVertices,
+    const CvVertexVariants *cameraVariants, int s, int t, int nVariants,
+    const Distribution1D &lightDistr,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    const Camera &camera, Sampler &sampler, Point2f *pRaster, Spectrum *L);
+CvBDPTIntegrator *CreateCvBDPTIntegrator(const ParamSet &params,
+                                         std::shared_ptr<Sampler> sampler,
+                                         std::shared_ptr<const Camera> camera);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CV_BDPT_H
@@ -1,30 +1,492 @@
 #include "cv_film.h"
+#include <cstdio>
+#include <fstream>
+#include <functional>
 #include <memory>
 
+#include "fileutil.h"
 #include "imageio.h"
+#include "parallel.h"
 #include "paramset.h"
+#include "stats.h"
+
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <ImfThreading.h>
+#include <ImfTiledOutputFile.h>
+#include <half.h>
 
 
 namespace pbrt {
 
+STAT_FLOAT_DISTRIBUTION("CV film/Largest relative error of pixel differences",
+                        pixelRelativeError);
+STAT_PERCENT("CV film/Pixels with significant differences",
+             nSignificantPixels, nErrorPixels);
+STAT_FLOAT_DISTRIBUTION("CV film/Estimated seconds to target relative error",
+                        secondsToTargetError);
+
+// Relative errors are taken against the magnitude of the difference plus
+// this floor, so that near-zero differences do not demand samples forever
+static const Float relativeErrorFloor = 1e-3f;
+
+static bool ExrCompression(const std::string &name, Imf::Compression *c) {
+    static const struct {
+        const char *name;
+        Imf::Compression compression;
+    } compressions[] = {
+        {"none", Imf::NO_COMPRESSION}, {"rle", Imf::RLE_COMPRESSION},
+        {"zips", Imf::ZIPS_COMPRESSION}, {"zip", Imf::ZIP_COMPRESSION},
+        {"piz", Imf::PIZ_COMPRESSION}, {"pxr24", Imf::PXR24_COMPRESSION},
+        {"b44", Imf::B44_COMPRESSION}, {"b44a", Imf::B44A_COMPRESSION}};
+    for (const auto &entry : compressions)
+        if (name == entry.name) {
+            *c = entry.compression;
+            return true;
+        }
+    return false;
+}
+
 CvFilm::CvFilm(const Point2i &resolution, const Bounds2f &cropWindow,
                std::unique_ptr<Filter> filter, Float diagonal,
                const std::string &filename, Float scale,
-               Float maxSampleLuminance)
+               Float maxSampleLuminance, const CvChannels &channels,
+               const std::string &referenceFilename, int alphaRadius,
+               bool halfRadiance, const std::string &compression,
+               bool writeAccumulators, Float confidence,
+               Float targetError, const std::string &sampleStream)
     : Film(resolution, cropWindow, std::move(filter),
-           diagonal, filename, scale, maxSampleLuminance) {
-    cvPixels = std::unique_ptr<CvDualPixel[]>(new CvDualPixel[croppedPixelBounds.Area()]);
+           diagonal, filename, scale, maxSampleLuminance),
+      nVariants(channels.nVariants),
+      baseline(channels.baseline),
+      pixels(channels, croppedPixelBounds.Area()),
+      alphaRadius(alphaRadius),
+      halfRadiance(halfRadiance),
+      compression(compression),
+      writeAccumulators(writeAccumulators),
+      confidence(confidence),
+      targetError(targetError) {
+    Vector2i extent = croppedPixelBounds.Diagonal();
+    nMergeBlocks = Point2i((extent.x + mergeBlockSize - 1) / mergeBlockSize,
+                           (extent.y + mergeBlockSize - 1) / mergeBlockSize);
+    mergeLocks.reset(new std::mutex[std::max(1, nMergeBlocks.x * nMergeBlocks.y)]);
+
+    if (!referenceFilename.empty()) {
+        Point2i refResolution;
+        reference = ReadImage(referenceFilename, &refResolution);
+        if (reference && refResolution != Point2i(croppedPixelBounds.Diagonal())) {
+            Error("Reference image \"%s\" is %d x %d, but the film's crop "
+                  "window is %d x %d. Ignoring it.", referenceFilename.c_str(),
+                  refResolution.x, refResolution.y,
+                  croppedPixelBounds.Diagonal().x,
+                  croppedPixelBounds.Diagonal().y);
+            reference.reset();
+        }
+    }
+    if (!sampleStream.empty()) {
+        this->sampleStream.reset(new CvSampleStream(sampleStream, nVariants));
+        if (!this->sampleStream->IsValid()) this->sampleStream.reset();
+    }
 }
 
-CvDualPixel &CvFilm::GetCvPixel(const Point2i &p) {
+int CvFilm::PixelIndex(const Point2i &p) const {
     CHECK(InsideExclusive(p, croppedPixelBounds));
     int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
-    int offset = (p.x - croppedPixelBounds.pMin.x) +
-                 (p.y - croppedPixelBounds.pMin.y) * width;
-    return cvPixels[offset];
+    return (p.x - croppedPixelBounds.pMin.x) +
+           (p.y - croppedPixelBounds.pMin.y) * width;
+}
+
+void CvFilm::DifferenceError(int index, int variant, int nSamples,
+                             RGBSpectrum *mean, RGBSpectrum *stdError) const {
+    *mean = *stdError = RGBSpectrum(0.f);
+    if (pixels.WeightSum(index) == 0 || nSamples == 0) return;
+    Float invWt = (Float)1 / pixels.WeightSum(index);
+    RGBSpectrum D = pixels.Difference(index, variant);
+    RGBSpectrum Dsquare = pixels.DifferenceSquare(index, variant);
+    for (int c = 0; c < 3; ++c) {
+        (*mean)[c] = scale * D[c] * invWt;
+        Float var = std::max<Float>(
+            0, scale * scale * Dsquare[c] * invWt - (*mean)[c] * (*mean)[c]);
+        (*stdError)[c] = std::sqrt(var / nSamples);
+    }
+}
+
+Float CvFilm::DifferenceRelativeError(const Point2i &p, int nSamples) {
+    // Return the largest relative standard error of any channel of any
+    // difference at _p_, treating _nSamples_ as the sample count
+    if (!InsideExclusive(p, croppedPixelBounds) || nSamples == 0 ||
+        !HasSecondMoments())
+        return 0;
+    int index = PixelIndex(p);
+    Float maxError = 0;
+    for (int i = 0; i < nVariants; ++i) {
+        if (i == baseline) continue;
+        RGBSpectrum mean, stdError;
+        DifferenceError(index, i, nSamples, &mean, &stdError);
+        for (int c = 0; c < 3; ++c)
+            maxError = std::max(maxError, stdError[c] / (std::abs(mean[c]) +
+                                                         relativeErrorFloor));
+    }
+    return maxError;
+}
+
+std::vector<CvFilm::DifferenceErrors> CvFilm::ComputeDifferenceErrors(
+    int samplesPerPixel) const {
+    std::vector<DifferenceErrors> errors;
+    if (!HasSecondMoments() || (samplesPerPixel == 0 && pixelSamples.empty()))
+        return errors;
+    // Differences are significant where they exceed the two-sided normal
+    // quantile of _confidence_ times their standard error
+    Float z = std::sqrt((Float)2) * ErfInv(confidence);
+    int nPixels = croppedPixelBounds.Area();
+    int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
+    errors.resize(nVariants);
+    for (int i = 0; i < nVariants; ++i) {
+        if (i == baseline) continue;
+        DifferenceErrors &e = errors[i];
+        e.stdError.reset(new Float[3 * nPixels]);
+        e.relError.reset(new Float[3 * nPixels]);
+        e.significant.reset(new Float[3 * nPixels]);
+        ParallelFor([&](int64_t row) {
+            for (int offset = row * width; offset < (row + 1) * width;
+                 ++offset) {
+                int nSamples = pixelSamples.empty() ? samplesPerPixel
+                                                    : pixelSamples[offset];
+                RGBSpectrum mean, stdError;
+                DifferenceError(offset, i, nSamples, &mean, &stdError);
+                for (int c = 0; c < 3; ++c) {
+                    e.stdError[3 * offset + c] = stdError[c];
+                    e.relError[3 * offset + c] =
+                        stdError[c] / (std::abs(mean[c]) + relativeErrorFloor);
+                    e.significant[3 * offset + c] =
+                        nSamples > 0 && std::abs(mean[c]) > z * stdError[c];
+                }
+            }
+        }, croppedPixelBounds.pMax.y - croppedPixelBounds.pMin.y, 8);
+    }
+    return errors;
+}
+
+void CvFilm::ReportDifferenceErrors(
+    const std::vector<DifferenceErrors> &errors) const {
+    // Summarize on the calling thread, whose statistics are reported
+    // after rendering
+    int nPixels = croppedPixelBounds.Area();
+    double sumRelError = 0;
+    int64_t nSignificant = 0;
+    for (int offset = 0; offset < nPixels; ++offset) {
+        Float relError = 0;
+        bool significant = false;
+        for (int i = 0; i < nVariants; ++i) {
+            if (i == baseline) continue;
+            for (int c = 0; c < 3; ++c) {
+                relError = std::max(relError, errors[i].relError[3 * offset + c]);
+                significant |= errors[i].significant[3 * offset + c] != 0;
+            }
+        }
+        ReportValue(pixelRelativeError, relError);
+        sumRelError += relError;
+        if (significant) ++nSignificant;
+    }
+    nErrorPixels += nPixels;
+    nSignificantPixels += nSignificant;
+    // Standard errors fall with the square root of the sample count, so
+    // reaching _targetError_ takes (error / target)^2 times as long
+    Float meanRelError = nPixels > 0 ? sumRelError / nPixels : 0;
+    if (renderStart != std::chrono::steady_clock::time_point() &&
+        targetError > 0) {
+        Float seconds = std::chrono::duration<Float>(
+                            std::chrono::steady_clock::now() - renderStart)
+                            .count();
+        ReportValue(secondsToTargetError,
+                    seconds * (meanRelError / targetError) *
+                        (meanRelError / targetError));
+    }
+    LOG(INFO) << StringPrintf("Mean relative error of differences %f; "
+                              "significant at %.3f confidence in %" PRId64
+                              " of %" PRId64 " pixels",
+                              meanRelError, confidence, nSignificant,
+                              (int64_t)nPixels);
+}
+
+// Checkpoint files start with a magic number and a format version,
+// followed by the size of _Float_, the cropped pixel bounds, the number
+// of passes, the per-pixel sample counts and the pixel accumulators
+static const char checkpointMagic[8] = {'P', 'B', 'R', 'T', 'C', 'V', 'C', 'K'};
+static const int32_t checkpointVersion = 1;
+
+bool CvFilm::WriteCheckpoint(const std::string &name, int nPasses,
+                             const std::vector<int> &pixelSamples) const {
+    // Write to a temporary file and rename it, so that a job killed while
+    // writing leaves the previous checkpoint intact
+    std::string tmpName = name + ".tmp";
+    {
+        std::ofstream out(tmpName, std::ios::binary);
+        if (!out) {
+            Error("Unable to open checkpoint file \"%s\"", tmpName.c_str());
+            return false;
+        }
+        int32_t header[8] = {checkpointVersion,   (int32_t)sizeof(Float),
+                             croppedPixelBounds.pMin.x, croppedPixelBounds.pMin.y,
+                             croppedPixelBounds.pMax.x, croppedPixelBounds.pMax.y,
+                             nPasses, (int32_t)pixelSamples.size()};
+        out.write(checkpointMagic, sizeof(checkpointMagic));
+        out.write((const char *)header, sizeof(header));
+        out.write((const char *)pixelSamples.data(),
+                  pixelSamples.size() * sizeof(int));
+        pixels.Write(out);
+        if (!out) {
+            Error("Error writing checkpoint file \"%s\"", tmpName.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmpName.c_str(), name.c_str()) != 0) {
+        Error("Unable to rename \"%s\" to \"%s\"", tmpName.c_str(),
+              name.c_str());
+        return false;
+    }
+    LOG(INFO) << "Wrote checkpoint " << name << " after " << nPasses
+              << " passes";
+    return true;
+}
+
+bool CvFilm::ReadCheckpoint(const std::string &name, int *nPasses,
+                            std::vector<int> *pixelSamples) {
+    std::ifstream in(name, std::ios::binary);
+    if (!in) {
+        Warning("Checkpoint file \"%s\" not found. Rendering from scratch.",
+                name.c_str());
+        return false;
+    }
+    char magic[sizeof(checkpointMagic)];
+    int32_t header[8];
+    if (!in.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), checkpointMagic) ||
+        !in.read((char *)header, sizeof(header)) ||
+        header[0] != checkpointVersion || header[1] != (int32_t)sizeof(Float)) {
+        Error("\"%s\" is not a checkpoint of this pbrt build. Rendering from "
+              "scratch.", name.c_str());
+        return false;
+    }
+    if (Bounds2i(Point2i(header[2], header[3]), Point2i(header[4], header[5])) !=
+            croppedPixelBounds ||
+        header[7] != (int32_t)pixelSamples->size()) {
+        Error("Checkpoint \"%s\" was written for a different image. "
+              "Rendering from scratch.", name.c_str());
+        return false;
+    }
+    std::vector<int> samples(header[7]);
+    in.read((char *)samples.data(), samples.size() * sizeof(int));
+    // Read into a scratch buffer so that a truncated or mismatching file
+    // leaves the film untouched
+    CvPixelBuffer restored(pixels.channels, croppedPixelBounds.Area());
+    if (!in || !restored.Read(in)) {
+        Error("Checkpoint \"%s\" is truncated or was written with other "
+              "film channels. Rendering from scratch.", name.c_str());
+        return false;
+    }
+    pixels.AddPixels(0, restored, 0, croppedPixelBounds.Area());
+    *nPasses = header[6];
+    *pixelSamples = std::move(samples);
+    LOG(INFO) << "Resuming from checkpoint " << name << " after "
+              << *nPasses << " passes";
+    return true;
+}
+
+// Accumulator files start with a magic number and a format version,
+// followed by the size of _Float_, the full resolution, the cropped pixel
+// bounds, whether splats follow, the run's seed, the film scale, the
+// per-pixel sample counts (int32), the pixel accumulators and the splats,
+// if any, already scaled
+static const char accumulatorsMagic[8] = {'P', 'B', 'R', 'T', 'C', 'V', 'A', 'C'};
+static const int32_t accumulatorsVersion = 3;
+
+static bool PixelsOverlap(const Bounds2i &a, const Bounds2i &b) {
+    return a.pMin.x < b.pMax.x && b.pMin.x < a.pMax.x &&
+           a.pMin.y < b.pMax.y && b.pMin.y < a.pMax.y;
+}
+
+static bool ReadAccumulatorsHeader(std::istream &in, CvAccumulatorsInfo *info) {
+    char magic[sizeof(accumulatorsMagic)];
+    int32_t header[10], channels[5];
+    if (!in.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), accumulatorsMagic) ||
+        !in.read((char *)header, sizeof(header)) ||
+        header[0] != accumulatorsVersion || header[1] != (int32_t)sizeof(Float) ||
+        !in.read((char *)&info->scale, sizeof(Float)))
+        return false;
+    info->fullResolution = Point2i(header[2], header[3]);
+    info->pixelBounds =
+        Bounds2i(Point2i(header[4], header[5]), Point2i(header[6], header[7]));
+    info->hasSplats = header[8] != 0;
+    info->seed = header[9];
+    // Peek past the sample counts at the channels that the pixel buffer's
+    // header stores
+    std::streampos countsStart = in.tellg();
+    in.seekg(info->pixelBounds.Area() * sizeof(int32_t), std::ios::cur);
+    if (!in.read((char *)channels, sizeof(channels))) return false;
+    in.seekg(countsStart);
+    info->channels.nVariants = channels[0];
+    info->channels.baseline = channels[1];
+    info->channels.secondMoments = channels[2] != 0;
+    info->channels.reciprocalPdf = channels[3] != 0;
+    return channels[4] == info->pixelBounds.Area();
+}
+
+bool ReadCvAccumulatorsInfo(const std::string &name, CvAccumulatorsInfo *info) {
+    std::ifstream in(name, std::ios::binary);
+    if (!in) {
+        Error("Unable to open accumulator file \"%s\"", name.c_str());
+        return false;
+    }
+    if (!ReadAccumulatorsHeader(in, info)) {
+        Error("\"%s\" is not an accumulator file of this pbrt build.",
+              name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CvFilm::WriteAccumulators(const std::string &name, Float splatScale,
+                               int samplesPerPixel) const {
+    std::ofstream out(name, std::ios::binary);
+    if (!out) {
+        Error("Unable to open accumulator file \"%s\"", name.c_str());
+        return false;
+    }
+    int32_t header[10] = {accumulatorsVersion, (int32_t)sizeof(Float),
+                          fullResolution.x, fullResolution.y,
+                          croppedPixelBounds.pMin.x, croppedPixelBounds.pMin.y,
+                          croppedPixelBounds.pMax.x, croppedPixelBounds.pMax.y,
+                          splats ? 1 : 0, PbrtOptions.seed};
+    std::vector<int32_t> counts(croppedPixelBounds.Area(), samplesPerPixel);
+    if (!pixelSamples.empty())
+        std::copy(pixelSamples.begin(), pixelSamples.end(), counts.begin());
+    out.write(accumulatorsMagic, sizeof(accumulatorsMagic));
+    out.write((const char *)header, sizeof(header));
+    out.write((const char *)&scale, sizeof(Float));
+    out.write((const char *)counts.data(), counts.size() * sizeof(int32_t));
+    pixels.Write(out);
+    if (splats) {
+        int nPixels = croppedPixelBounds.Area();
+        std::vector<Float> scaled(3 * nVariants * nPixels);
+        for (int i = 0; i < nVariants; ++i)
+            for (int offset = 0; offset < nPixels; ++offset) {
+                RGBSpectrum s = splatScale * Splat(offset, i);
+                for (int c = 0; c < 3; ++c)
+                    scaled[3 * (i * nPixels + offset) + c] = s[c];
+            }
+        out.write((const char *)scaled.data(), scaled.size() * sizeof(Float));
+    }
+    if (!out) {
+        Error("Error writing accumulator file \"%s\"", name.c_str());
+        return false;
+    }
+    LOG(INFO) << "Wrote accumulators " << name << " with bounds "
+              << croppedPixelBounds;
+    return true;
+}
+
+bool CvFilm::MergeAccumulators(const std::string &name) {
+    std::ifstream in(name, std::ios::binary);
+    CvAccumulatorsInfo info;
+    if (!in || !ReadAccumulatorsHeader(in, &info)) {
+        Error("\"%s\" is not an accumulator file of this pbrt build.",
+              name.c_str());
+        return false;
+    }
+    const Bounds2i &b = info.pixelBounds;
+    if (info.fullResolution != fullResolution ||
+        Intersect(b, croppedPixelBounds) != b) {
+        Error("Accumulators \"%s\" were written for a different image.",
+              name.c_str());
+        return false;
+    }
+    if (info.scale != scale)
+        Warning("Accumulators \"%s\" were written with film \"scale\" %f; "
+                "merging them with scale %f.", name.c_str(), info.scale, scale);
+    // Read into a scratch buffer so that a truncated or mismatching file
+    // leaves the film untouched
+    int nPixels = b.Area();
+    std::vector<int32_t> counts(nPixels);
+    CvPixelBuffer merged(pixels.channels, nPixels);
+    std::vector<Float> mergedSplats(info.hasSplats ? 3 * nVariants * nPixels : 0);
+    if (!in.read((char *)counts.data(), counts.size() * sizeof(int32_t)) ||
+        !merged.Read(in) ||
+        !in.read((char *)mergedSplats.data(), mergedSplats.size() * sizeof(Float))) {
+        Error("Accumulators \"%s\" are truncated or were written with other "
+              "film channels.", name.c_str());
+        return false;
+    }
+
+    // Files of the same run seed take the same samples in the same pixels,
+    // so only those of other seeds may have sampled the same pixels. Files
+    // of renders restricted to some of their pixels, with the integrator's
+    // "pixelbounds", only count the pixels they sampled. Splats are scaled
+    // for their own file's sample count, so they only merge with files of
+    // other pixels.
+    int width = b.pMax.x - b.pMin.x;
+    Bounds2i sampled;
+    for (Point2i p : b)
+        if (counts[(p.y - b.pMin.y) * width + (p.x - b.pMin.x)] > 0)
+            sampled = Union(sampled, Bounds2i(p, p + Vector2i(1, 1)));
+    for (const MergedAccumulators &m : mergedFiles) {
+        if (m.seed == info.seed && PixelsOverlap(sampled, m.sampledBounds)) {
+            Error("Accumulators \"%s\" sample pixels merged before with the "
+                  "same seed %d; render overlapping pixels with different "
+                  "--seed values.", name.c_str(), info.seed);
+            return false;
+        }
+        if ((info.hasSplats || m.hasSplats) && PixelsOverlap(b, m.bounds)) {
+            Error("Accumulators \"%s\" overlap pixels merged before, and "
+                  "splats only merge from renders of disjoint pixels.",
+                  name.c_str());
+            return false;
+        }
+    }
+
+    for (int y = b.pMin.y; y < b.pMax.y; ++y)
+        pixels.AddPixels(PixelIndex(Point2i(b.pMin.x, y)), merged,
+                         (y - b.pMin.y) * width, width);
+
+    // Sample counts add up; splats come from disjoint pixels and are
+    // already scaled
+    int nFilmPixels = croppedPixelBounds.Area();
+    if (pixelSamples.empty()) pixelSamples.resize(nFilmPixels, 0);
+    if (info.hasSplats)
+        std::call_once(splatsAllocated, [&]() {
+            splats.reset(new AtomicFloat[3 * nVariants * nFilmPixels]);
+        });
+    for (Point2i p : b) {
+        int offset = PixelIndex(p);
+        int src = (p.y - b.pMin.y) * width + (p.x - b.pMin.x);
+        pixelSamples[offset] += counts[src];
+        if (!info.hasSplats) continue;
+        for (int i = 0; i < nVariants; ++i)
+            for (int c = 0; c < 3; ++c)
+                splats[3 * (i * nFilmPixels + offset) + c].Add(
+                    mergedSplats[3 * (i * nPixels + src) + c]);
+    }
+    mergedFiles.push_back({b, sampled, info.seed, info.hasSplats});
+    LOG(INFO) << "Merged accumulators " << name << " with bounds " << b;
+    return true;
+}
+
+std::string CvFilm::VariantName(int variant) const {
+    // The two-variant case keeps the F (after) / H (before) naming
+    if (nVariants == 2) return variant == 0 ? "F" : "H";
+    return "V" + std::to_string(variant);
+}
+
+std::string CvFilm::DifferenceName(int variant) const {
+    if (nVariants == 2) return "D";
+    return "D" + std::to_string(variant);
 }
 
 std::unique_ptr<CvFilmTile> CvFilm::GetCvFilmTile(const Bounds2i &sampleBounds) {
+    std::call_once(renderStarted,
+                   [&]() { renderStart = std::chrono::steady_clock::now(); });
     // Bound image pixels that samples in _sampleBounds_ contribute to
     Vector2f halfPixel = Vector2f(0.5f, 0.5f);
     Bounds2f floatBounds = (Bounds2f)sampleBounds;
@@ -32,125 +494,412 @@ std::unique_ptr<CvFilmTile> CvFilm::GetCvFilmTile(const Bounds2i &sampleBounds)
     Point2i p1 = (Point2i)Floor(floatBounds.pMax - halfPixel + filter->radius) +
                  Point2i(1, 1);
     Bounds2i tilePixelBounds = Intersect(Bounds2i(p0, p1), croppedPixelBounds);
-    return std::unique_ptr<CvFilmTile>(new CvFilmTile(
+    std::unique_ptr<CvFilmTile> tile(new CvFilmTile(
         tilePixelBounds, filter->radius, filterTable, filterTableWidth,
-        maxSampleLuminance));
+        maxSampleLuminance, pixels.channels));
+    tile->sampleStream = sampleStream.get();
+    return tile;
 }
 
 void CvFilm::MergeFilmTile(std::unique_ptr<CvFilmTile> tile) {
     ProfilePhase p(Prof::MergeFilmTile);
     VLOG(1) << "Merging film tile " << tile->GetPixelBounds();
-    std::lock_guard<std::mutex> lock(mutex);
-    for (Point2i pixel : tile->GetPixelBounds()) {
-        // Merge _pixel_ into _Film::pixels_
-        const CvDualPixel &tilePixel = tile->GetPixel(pixel);
-        CvDualPixel &mergePixel = GetCvPixel(pixel);
-        mergePixel.AddPixel(tilePixel);
-        mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+    if (tile->sampleStream) tile->sampleStream->Submit(&tile->streamChunk);
+    // Merge the tile one lock block at a time; only one block lock is
+    // ever held, so merges cannot deadlock
+    const Bounds2i &tileBounds = tile->GetPixelBounds();
+    if (tileBounds.pMax.x <= tileBounds.pMin.x ||
+        tileBounds.pMax.y <= tileBounds.pMin.y)
+        return;
+    Vector2i o0 = tileBounds.pMin - croppedPixelBounds.pMin;
+    Vector2i o1 = tileBounds.pMax - croppedPixelBounds.pMin - Vector2i(1, 1);
+    Point2i b0(o0.x / mergeBlockSize, o0.y / mergeBlockSize);
+    Point2i b1(o1.x / mergeBlockSize, o1.y / mergeBlockSize);
+    for (int by = b0.y; by <= b1.y; ++by)
+        for (int bx = b0.x; bx <= b1.x; ++bx) {
+            Point2i pMin = croppedPixelBounds.pMin +
+                           Vector2i(bx, by) * mergeBlockSize;
+            Bounds2i blockBounds =
+                Intersect(tileBounds, Bounds2i(pMin, pMin + Vector2i(mergeBlockSize,
+                                                                     mergeBlockSize)));
+            std::lock_guard<std::mutex> lock(mergeLocks[by * nMergeBlocks.x + bx]);
+            // Merge the block's rows of the tile into _CvFilm::pixels_
+            int n = blockBounds.pMax.x - blockBounds.pMin.x;
+            for (int y = blockBounds.pMin.y; y < blockBounds.pMax.y; ++y) {
+                Point2i p(blockBounds.pMin.x, y);
+                pixels.AddPixels(PixelIndex(p), tile->GetPixels(),
+                                 tile->PixelIndex(p), n);
+            }
+        }
+}
+
+void CvFilm::AddSplat(const Point2f &p, const CvSample &sample) {
+    ProfilePhase pp(Prof::SplatFilm);
+    for (int i = 0; i < nVariants; ++i) {
+        const Spectrum &L = sample.L[i];
+        if (L.HasNaNs() || std::isinf(L.y()) || L.y() < 0) {
+            LOG(ERROR) << StringPrintf("Ignoring splat of variant %d with "
+                                       "NaN, infinite or negative values at "
+                                       "(%f, %f)", i, p.x, p.y);
+            return;
+        }
+    }
+    Point2i pi = (Point2i)p;
+    if (!InsideExclusive(pi, croppedPixelBounds)) return;
+    std::call_once(splatsAllocated, [&]() {
+        splats.reset(new AtomicFloat[3 * nVariants * croppedPixelBounds.Area()]);
+    });
+    int offset = PixelIndex(pi);
+    for (int i = 0; i < nVariants; ++i) {
+        Float rgb[3];
+        sample.L[i].ToRGB(rgb);
+        AtomicFloat *splat =
+            &splats[3 * (i * croppedPixelBounds.Area() + offset)];
+        for (int c = 0; c < 3; ++c) splat[c].Add(rgb[c]);
     }
 }
 
-void CvFilm::WriteImage(Float splatScale, int samplesPerPixel) {
-    
-    // Convert image to RGB and compute final pixel values
-    LOG(INFO) <<
-        "Converting image to RGB and computing final weighted pixel values";
-    std::unique_ptr<Float[]> rgb1(new Float[3 * croppedPixelBounds.Area()]);
-    std::unique_ptr<Float[]> rgb1Squared(new Float[3 * croppedPixelBounds.Area()]);
-    std::unique_ptr<Float[]> rgb2(new Float[3 * croppedPixelBounds.Area()]);
-    std::unique_ptr<Float[]> rgb2Squared(new Float[3 * croppedPixelBounds.Area()]);
-    std::unique_ptr<Float[]> diff(new Float[3 * croppedPixelBounds.Area()]);
-    std::unique_ptr<Float[]> diffSquared(new Float[3 * croppedPixelBounds.Area()]);
-    std::unique_ptr<Float[]> recipPdfs(new Float[3 * croppedPixelBounds.Area()]);
+void CvFilm::SetImage(const CvSample *img) {
+    pixels.Clear();
+    int nPixels = croppedPixelBounds.Area();
+    for (int i = 0; i < nPixels; ++i) {
+        CvSample sample = img[i];
+        sample.reciprocal_pdf = 0;
+        pixels.AddSample(i, sample, 1);
+    }
+}
 
+RGBSpectrum CvFilm::Splat(int offset, int variant) const {
+    if (!splats) return RGBSpectrum(0.f);
+    const AtomicFloat *splat =
+        &splats[3 * (variant * croppedPixelBounds.Area() + offset)];
+    Float rgb[3] = {splat[0], splat[1], splat[2]};
+    return RGBSpectrum::FromRGB(rgb);
+}
+
+RGBSpectrum CvFilm::Alpha(int variant, const Point2i &p) const {
+    // Estimate alpha = Cov(L_i, L_b) / Var(L_b) per channel at _p_,
+    // pooling the moments over the (2 * alphaRadius + 1)^2 neighborhood
+    RGBSpectrum cov(0.f), var(0.f);
+    Bounds2i window =
+        Intersect(Bounds2i(p - Vector2i(alphaRadius, alphaRadius),
+                           p + Vector2i(alphaRadius + 1, alphaRadius + 1)),
+                  croppedPixelBounds);
+    for (Point2i q : window) {
+        int index = PixelIndex(q);
+        Float invWt = (Float)1 / (pixels.WeightSum(index) + Float(1.0e-8f));
+        RGBSpectrum Li = pixels.Radiance(index, variant) * invWt;
+        RGBSpectrum Lb = pixels.Radiance(index, baseline) * invWt;
+        cov += pixels.Cross(index, variant) * invWt - Li * Lb;
+        var += pixels.Square(index, baseline) * invWt - Lb * Lb;
+    }
+    RGBSpectrum alpha;
+    for (int c = 0; c < 3; ++c) alpha[c] = var[c] > 0 ? cov[c] / var[c] : 0;
+    return alpha;
+}
+
+void CvFilm::ComputeAlpha(int variant, Float *alpha) {
     int offset = 0;
-    Float avgRecipPdf = Float(0.f);
     for (Point2i p : croppedPixelBounds) {
-        // Convert pixel XYZ color to RGB
-        CvDualPixel &pixel = GetCvPixel(p);
-
-        // Normalize pixel with weight sum
-        Float filterWeightSum = pixel.filterWeightSum;
-        Float invWt = (Float)1 / (filterWeightSum + Float(1.0e-8f));
-
-        // Add splat value at pixel
-        rgb1[3 * offset] += splatScale * pixel.L1[0] * invWt;
-        rgb1[3 * offset + 1] += splatScale * pixel.L1[1] * invWt;
-        rgb1[3 * offset + 2] += splatScale * pixel.L1[2] * invWt;
-        rgb1Squared[3 * offset] += splatScale * pixel.L1square[0] * invWt;
-        rgb1Squared[3 * offset + 1] += splatScale * pixel.L1square[1] * invWt;
-        rgb1Squared[3 * offset + 2] += splatScale * pixel.L1square[2] * invWt;
-
-        rgb2[3 * offset] += splatScale * pixel.L2[0] * invWt;
-        rgb2[3 * offset + 1] += splatScale * pixel.L2[1] * invWt;
-        rgb2[3 * offset + 2] += splatScale * pixel.L2[2] * invWt;
-        rgb2Squared[3 * offset] += splatScale * pixel.L2square[0] * invWt;
-        rgb2Squared[3 * offset + 1] += splatScale * pixel.L2square[1] * invWt;
-        rgb2Squared[3 * offset + 2] += splatScale * pixel.L2square[2] * invWt;
-        diff[3 * offset] += splatScale * pixel.D[0] * invWt;
-        diff[3 * offset + 1] += splatScale * pixel.D[1] * invWt;
-        diff[3 * offset + 2] += splatScale * pixel.D[2] * invWt;
-        diffSquared[3 * offset] += splatScale * pixel.Dsquare[0] * invWt;
-        diffSquared[3 * offset + 1] += splatScale * pixel.Dsquare[1] * invWt;
-        diffSquared[3 * offset + 2] += splatScale * pixel.Dsquare[2] * invWt;
-
-        recipPdfs[3 * offset] += splatScale * pixel.reciprocal_pdf * invWt;
-        recipPdfs[3 * offset + 1] += splatScale * pixel.reciprocal_pdf * invWt;
-        recipPdfs[3 * offset + 2] += splatScale * pixel.reciprocal_pdf * invWt;
-
-        // Scale pixel value by _scale_
-        rgb1[3 * offset] *= scale;
-        rgb1[3 * offset + 1] *= scale;
-        rgb1[3 * offset + 2] *= scale;
-        rgb2[3 * offset] *= scale;
-        rgb2[3 * offset + 1] *= scale;
-        rgb2[3 * offset + 2] *= scale;
-        diff[3 * offset] *= scale;
-        diff[3 * offset + 1] *= scale;
-        diff[3 * offset + 2] *= scale;
-        
-        rgb1Squared[3 * offset] *= scale * scale;
-        rgb1Squared[3 * offset + 1] *= scale * scale;
-        rgb1Squared[3 * offset + 2] *= scale * scale;
-        rgb2Squared[3 * offset] *= scale * scale;
-        rgb2Squared[3 * offset + 1] *= scale * scale;
-        rgb2Squared[3 * offset + 2] *= scale * scale;
-        diffSquared[3 * offset] *= scale * scale;
-        diffSquared[3 * offset + 1] *= scale * scale;
-        diffSquared[3 * offset + 2] *= scale * scale;
-
-        avgRecipPdf += recipPdfs[3 * offset];
-        
+        Alpha(variant, p).ToRGB(&alpha[3 * offset]);
         ++offset;
     }
-    avgRecipPdf /= offset;
+}
+
+void CvFilm::WriteEXR(Float splatScale,
+                      const std::vector<DifferenceErrors> &errors) {
+    using namespace Imf;
+    using namespace Imath;
+
+    // Describe the file's layers; every layer computes its normalized
+    // value from the accumulators of one pixel
+    struct Layer {
+        std::string name;
+        bool single, half;
+        std::function<RGBSpectrum(int, const Point2i &)> value;
+    };
+    std::vector<Layer> layers;
+    const bool secondMoments = HasSecondMoments();
+    auto weight = [&](int offset) {
+        return 1 / (pixels.WeightSum(offset) + Float(1.0e-8f));
+    };
+    // Filtered mean plus splats of one variant
+    auto radiance = [&](int offset, int variant) {
+        return scale * weight(offset) * pixels.Radiance(offset, variant) +
+               scale * splatScale * Splat(offset, variant);
+    };
+    for (int i = 0; i < nVariants; ++i) {
+        std::string name = VariantName(i);
+        layers.push_back({name, false, halfRadiance,
+                          [=](int o, const Point2i &) {
+                              return radiance(o, i);
+                          }});
+        if (secondMoments)
+            layers.push_back({name + "square", false, false,
+                              [=](int o, const Point2i &) {
+                                  return scale * scale * weight(o) *
+                                         pixels.Square(o, i);
+                              }});
+        if (i == baseline) continue;
+        std::string diffName = DifferenceName(i);
+        layers.push_back({diffName, false, halfRadiance,
+                          [=](int o, const Point2i &) {
+                              return scale * weight(o) * pixels.Difference(o, i) +
+                                     scale * splatScale *
+                                         (Splat(o, i) - Splat(o, baseline));
+                          }});
+        if (!secondMoments) continue;
+        layers.push_back({diffName + "square", false, false,
+                          [=](int o, const Point2i &) {
+                              return scale * scale * weight(o) *
+                                     pixels.DifferenceSquare(o, i);
+                          }});
+        layers.push_back({name + "alpha", false, false,
+                          [=](int, const Point2i &p) { return Alpha(i, p); }});
+        if (!errors.empty()) {
+            auto rgb = [](const Float *v, int o) {
+                return RGBSpectrum::FromRGB(&v[3 * o]);
+            };
+            const DifferenceErrors &e = errors[i];
+            layers.push_back({diffName + "stderr", false, false,
+                              [&e, rgb](int o, const Point2i &) {
+                                  return rgb(e.stdError.get(), o);
+                              }});
+            layers.push_back({diffName + "relerr", false, false,
+                              [&e, rgb](int o, const Point2i &) {
+                                  return rgb(e.relError.get(), o);
+                              }});
+            layers.push_back({diffName + "significant", false, true,
+                              [&e, rgb](int o, const Point2i &) {
+                                  return rgb(e.significant.get(), o);
+                              }});
+        }
+        if (reference)
+            layers.push_back(
+                {name + "cv", false, halfRadiance,
+                 [=](int o, const Point2i &p) {
+                     RGBSpectrum Li = radiance(o, i);
+                     RGBSpectrum Lb = radiance(o, baseline);
+                     return Li - Alpha(i, p) * (Lb - reference[o]);
+                 }});
+    }
+    if (reference && !secondMoments)
+        Warning("Film \"reference\" needs \"secondmoments\"; not writing "
+                "control-variate estimates.");
+    if (pixels.channels.reciprocalPdf)
+        layers.push_back({"rpdf", true, false, [=](int o, const Point2i &) {
+                              return RGBSpectrum(weight(o) *
+                                                 pixels.ReciprocalPdf(o));
+                          }});
 
-    // Write RGB image
+    // OpenEXR uses inclusive pixel bounds.
+    Box2i displayWindow(V2i(0, 0),
+                        V2i(fullResolution.x - 1, fullResolution.y - 1));
+    Box2i dataWindow(
+        V2i(croppedPixelBounds.pMin.x, croppedPixelBounds.pMin.y),
+        V2i(croppedPixelBounds.pMax.x - 1, croppedPixelBounds.pMax.y - 1));
+    Header header(displayWindow, dataWindow);
+    Compression c = ZIP_COMPRESSION;
+    ExrCompression(compression, &c);
+    header.compression() = c;
+    const int tileSize = 64;
+    header.setTileDescription(TileDescription(tileSize, tileSize, ONE_LEVEL));
+    const char *rgbNames[3] = {"R", "G", "B"};
+    for (const Layer &layer : layers)
+        for (int c = 0; c < (layer.single ? 1 : 3); ++c)
+            header.channels().insert(
+                layer.name + "." + (layer.single ? "Y" : rgbNames[c]),
+                Channel(layer.half ? HALF : FLOAT));
+
+    // Fill one row of tiles at a time in parallel and hand it to OpenEXR,
+    // whose thread pool compresses the tiles
+    const int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
+    std::vector<std::vector<char>> band(layers.size());
+    try {
+        setGlobalThreadCount(MaxThreadIndex());
+        TiledOutputFile file(filename.c_str(), header);
+        for (int ty = 0; ty < file.numYTiles(); ++ty) {
+            int y0 = croppedPixelBounds.pMin.y + ty * tileSize;
+            int y1 = std::min(y0 + tileSize, croppedPixelBounds.pMax.y);
+            FrameBuffer frameBuffer;
+            for (size_t l = 0; l < layers.size(); ++l) {
+                const Layer &layer = layers[l];
+                size_t elementSize = layer.half ? sizeof(half) : sizeof(float);
+                size_t pixelSize = (layer.single ? 1 : 3) * elementSize;
+                band[l].resize(pixelSize * width * tileSize);
+                // Offset the base pointer so that the band holds rows
+                // [y0, y1) of the data window
+                char *base = &band[l][0] -
+                             pixelSize * (croppedPixelBounds.pMin.x +
+                                          (ptrdiff_t)y0 * width);
+                for (int c = 0; c < (layer.single ? 1 : 3); ++c)
+                    frameBuffer.insert(
+                        layer.name + "." + (layer.single ? "Y" : rgbNames[c]),
+                        Slice(layer.half ? HALF : FLOAT,
+                              base + c * elementSize, pixelSize,
+                              pixelSize * width));
+            }
+            ParallelFor([&](int64_t row) {
+                int y = y0 + (int)row;
+                for (size_t l = 0; l < layers.size(); ++l) {
+                    const Layer &layer = layers[l];
+                    int nc = layer.single ? 1 : 3;
+                    for (int x = croppedPixelBounds.pMin.x;
+                         x < croppedPixelBounds.pMax.x; ++x) {
+                        Point2i p(x, y);
+                        RGBSpectrum v = layer.value(PixelIndex(p), p);
+                        size_t i = nc * ((size_t)row * width +
+                                         (x - croppedPixelBounds.pMin.x));
+                        for (int c = 0; c < nc; ++c) {
+                            if (layer.half)
+                                ((half *)&band[l][0])[i + c] = half(v[c]);
+                            else
+                                ((float *)&band[l][0])[i + c] = v[c];
+                        }
+                    }
+                }
+            }, y1 - y0, 4);
+            file.setFrameBuffer(frameBuffer);
+            file.writeTiles(0, file.numXTiles() - 1, ty, ty);
+        }
+    } catch (const std::exception &exc) {
+        Error("Error writing \"%s\": %s", filename.c_str(), exc.what());
+    }
+}
+
+void CvFilm::SetPixelSamples(const Bounds2i &sampleBounds,
+                             const std::vector<int> &counts) {
+    CHECK_EQ(sampleBounds.Area(), (int)counts.size());
+    pixelSamples.assign(croppedPixelBounds.Area(), 0);
+    int sampleWidth = sampleBounds.pMax.x - sampleBounds.pMin.x;
+    for (Point2i p : croppedPixelBounds)
+        if (InsideExclusive(p, sampleBounds))
+            pixelSamples[PixelIndex(p)] =
+                counts[(p.y - sampleBounds.pMin.y) * sampleWidth +
+                       (p.x - sampleBounds.pMin.x)];
+}
+
+void CvFilm::WriteImage(Float splatScale, int samplesPerPixel) {
+    if (sampleStream) sampleStream->Flush();
+    if (writeAccumulators) {
+        std::string base = HasExtension(filename, ".exr")
+                               ? filename.substr(0, filename.size() - 4)
+                               : filename;
+        WriteAccumulators(base + ".cvacc", splatScale, samplesPerPixel);
+    }
+    std::vector<DifferenceErrors> errors =
+        ComputeDifferenceErrors(samplesPerPixel);
+    if (!errors.empty()) ReportDifferenceErrors(errors);
+
+    if (HasExtension(filename, ".exr")) {
+        LOG(INFO) << "Writing multi-layer image " << filename
+                  << " with bounds " << croppedPixelBounds;
+        WriteEXR(splatScale, errors);
+        return;
+    }
+
+    // Convert image to RGB and compute final pixel values
+    LOG(INFO) <<
+        "Converting image to RGB and computing final weighted pixel values";
+    std::unique_ptr<Float[]> rgb(new Float[3 * croppedPixelBounds.Area()]());
+
+    // Normalize one accumulated quantity of every pixel into _rgb_ and add
+    // its splats, if it has any
+    int nPixels = croppedPixelBounds.Area();
+    auto normalize = [&](std::function<RGBSpectrum(int)> value,
+                         Float valueScale,
+                         std::function<RGBSpectrum(int)> splat) {
+        for (int offset = 0; offset < nPixels; ++offset) {
+            Float invWt =
+                (Float)1 / (pixels.WeightSum(offset) + Float(1.0e-8f));
+            RGBSpectrum v = invWt * valueScale * value(offset);
+            if (splat) v += valueScale * splatScale * splat(offset);
+            rgb[3 * offset] = v[0];
+            rgb[3 * offset + 1] = v[1];
+            rgb[3 * offset + 2] = v[2];
+        }
+    };
+    const bool secondMoments = HasSecondMoments();
+    if (reference && !secondMoments)
+        Warning("Film \"reference\" needs \"secondmoments\"; not writing "
+                "control-variate estimates.");
+
+    // Write RGB images for every variant and every difference
     LOG(INFO) << "Writing image " << filename << " with bounds " << croppedPixelBounds;
-    pbrt::WriteBinary(filename + "_F.bin", &rgb1[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteBinary(filename + "_H.bin", &rgb2[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteBinary(filename + "_D.bin", &diff[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteBinary(filename + "_Fsquare.bin", &rgb1Squared[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteBinary(filename + "_Hsquare.bin", &rgb2Squared[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteBinary(filename + "_Dsquare.bin", &diffSquared[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteBinary(filename + "_rpdf.bin", &recipPdfs[0], croppedPixelBounds, fullResolution);
+    for (int i = 0; i < nVariants; ++i) {
+        std::string name = filename + "_" + VariantName(i);
+        normalize([&](int p) { return pixels.Radiance(p, i); }, scale,
+                  [&](int p) { return Splat(p, i); });
+        pbrt::WriteBinary(name + ".bin", &rgb[0], croppedPixelBounds, fullResolution);
+        pbrt::WriteImage(name + ".png", &rgb[0], croppedPixelBounds, fullResolution);
+        if (secondMoments) {
+            normalize([&](int p) { return pixels.Square(p, i); },
+                      scale * scale, nullptr);
+            pbrt::WriteBinary(name + "square.bin", &rgb[0], croppedPixelBounds, fullResolution);
+        }
+        if (i == baseline) continue;
 
-    // Divide reciprocal pdfs with ave value
-    offset = 0;
-    for (Point2i p : croppedPixelBounds) {
-        recipPdfs[3 * offset] /= avgRecipPdf;
-        recipPdfs[3 * offset + 1] /= avgRecipPdf;
-        recipPdfs[3 * offset + 2] /= avgRecipPdf;
-        offset++;
+        std::string diffName = filename + "_" + DifferenceName(i);
+        normalize([&](int p) { return pixels.Difference(p, i); }, scale,
+                  [&](int p) { return Splat(p, i) - Splat(p, baseline); });
+        pbrt::WriteBinary(diffName + ".bin", &rgb[0], croppedPixelBounds, fullResolution);
+        if (!secondMoments) continue;
+        normalize([&](int p) { return pixels.DifferenceSquare(p, i); },
+                  scale * scale, nullptr);
+        pbrt::WriteBinary(diffName + "square.bin", &rgb[0], croppedPixelBounds, fullResolution);
+        if (!errors.empty()) {
+            const DifferenceErrors &e = errors[i];
+            pbrt::WriteBinary(diffName + "stderr.bin", e.stdError.get(),
+                              croppedPixelBounds, fullResolution);
+            pbrt::WriteBinary(diffName + "relerr.bin", e.relError.get(),
+                              croppedPixelBounds, fullResolution);
+            pbrt::WriteBinary(diffName + "significant.bin", e.significant.get(),
+                              croppedPixelBounds, fullResolution);
+            pbrt::WriteImage(diffName + "significant.png", e.significant.get(),
+                             croppedPixelBounds, fullResolution);
+        }
+
+        // Write the optimal control-variate coefficient against the
+        // baseline and, given the baseline's expectation, the combined
+        // estimate L_i - alpha * (L_b - E[L_b])
+        std::unique_ptr<Float[]> alpha(new Float[3 * croppedPixelBounds.Area()]);
+        ComputeAlpha(i, alpha.get());
+        pbrt::WriteBinary(name + "alpha.bin", &alpha[0], croppedPixelBounds, fullResolution);
+        if (reference) {
+            for (int offset = 0; offset < nPixels; ++offset) {
+                Float invWt =
+                    (Float)1 / (pixels.WeightSum(offset) + Float(1.0e-8f));
+                RGBSpectrum Li = invWt * scale * pixels.Radiance(offset, i) +
+                                 splatScale * scale * Splat(offset, i);
+                RGBSpectrum Lb =
+                    invWt * scale * pixels.Radiance(offset, baseline) +
+                    splatScale * scale * Splat(offset, baseline);
+                for (int c = 0; c < 3; ++c)
+                    rgb[3 * offset + c] =
+                        Li[c] - alpha[3 * offset + c] *
+                                    (Lb[c] - reference[offset][c]);
+            }
+            pbrt::WriteBinary(name + "cv.bin", &rgb[0], croppedPixelBounds, fullResolution);
+            pbrt::WriteImage(name + "cv.png", &rgb[0], croppedPixelBounds, fullResolution);
+        }
     }
 
-    pbrt::WriteImage(filename + "_F.png", &rgb1[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteImage(filename + "_H.png", &rgb2[0], croppedPixelBounds, fullResolution);
-    pbrt::WriteImage(filename + "_rpdf.png", &recipPdfs[0], croppedPixelBounds, fullResolution);
-    
+    if (!pixels.channels.reciprocalPdf) return;
+    normalize([&](int p) { return RGBSpectrum(pixels.ReciprocalPdf(p)); }, 1,
+              nullptr);
+    pbrt::WriteBinary(filename + "_rpdf.bin", &rgb[0], croppedPixelBounds, fullResolution);
+
+    // Divide reciprocal pdfs with ave value
+    Float avgRecipPdf = Float(0.f);
+    for (int i = 0; i < nPixels; ++i) avgRecipPdf += rgb[3 * i];
+    avgRecipPdf /= nPixels;
+    if (avgRecipPdf > 0)
+        for (int i = 0; i < 3 * nPixels; ++i) rgb[i] /= avgRecipPdf;
+    pbrt::WriteImage(filename + "_rpdf.png", &rgb[0], croppedPixelBounds, fullResolution);
 }
 
-Film *CreateCvFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
+Film *CreateCvFilm(const ParamSet &params, std::unique_ptr<Filter> filter,
+                   int nVariants) {
     // Intentionally use FindOneString() rather than FindOneFilename() here
     // so that the rendered image is left in the working directory, rather
     // than the directory the scene file lives in.
@@ -185,8 +934,54 @@ Film *CreateCvFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
     Float diagonal = params.FindOneFloat("diagonal", 35.);
     Float maxSampleLuminance = params.FindOneFloat("maxsampleluminance",
                                                    Infinity);
+    // By default differences are taken against the last variant, which for
+    // the "dual" material is H
+    int baseline = params.FindOneInt("baseline", nVariants - 1);
+    std::string reference = params.FindOneFilename("reference", "");
+    int alphaRadius = std::max(0, params.FindOneInt("alpharadius", 0));
+    if (baseline < 0 || baseline >= nVariants) {
+        Error("\"baseline\" %d out of range for %d material variants. "
+              "Using %d.", baseline, nVariants, nVariants - 1);
+        baseline = nVariants - 1;
+    }
+    CvChannels channels;
+    channels.nVariants = nVariants;
+    channels.baseline = baseline;
+    channels.secondMoments = params.FindOneBool("secondmoments", true);
+    channels.reciprocalPdf = params.FindOneBool("reciprocalpdf", true);
+    // Options for OpenEXR output, which is used for "filename"s ending in
+    // ".exr"; other names write one binary file per quantity
+    std::string pixelType = params.FindOneString("pixeltype", "float");
+    if (pixelType != "float" && pixelType != "half") {
+        Error("\"pixeltype\" \"%s\" unknown. Using \"float\".",
+              pixelType.c_str());
+        pixelType = "float";
+    }
+    std::string compression = params.FindOneString("compression", "zip");
+    Imf::Compression c;
+    if (!ExrCompression(compression, &c)) {
+        Error("\"compression\" \"%s\" unknown. Using \"zip\".",
+              compression.c_str());
+        compression = "zip";
+    }
+    // Raw accumulators for merging partial renders with "imgtool cvmerge"
+    bool accumulators = params.FindOneBool("accumulators", false);
+    // Error estimates of the differences
+    Float confidence = params.FindOneFloat("confidence", 0.95f);
+    if (confidence <= 0 || confidence >= 1) {
+        Error("\"confidence\" %f must be between 0 and 1. Using 0.95.",
+              confidence);
+        confidence = 0.95f;
+    }
+    Float targetError = params.FindOneFloat("targeterror", 0.01f);
+    // File to stream every camera sample to, for offline analysis; like
+    // "filename", it is relative to the working directory
+    std::string sampleStream = params.FindOneString("samplestream", "");
     return new CvFilm(Point2i(xres, yres), crop, std::move(filter), diagonal,
-                      filename, scale, maxSampleLuminance);    
+                      filename, scale, maxSampleLuminance, channels,
+                      reference, alphaRadius, pixelType == "half",
+                      compression, accumulators, confidence, targetError,
+                      sampleStream);
 }
 
 }  // namespace pbrt
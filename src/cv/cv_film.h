@@ -8,24 +8,149 @@
 
 #include "film.h"
 #include "cv_pixel.h"
+#include "cv_stream.h"
+#include <chrono>
 
 namespace pbrt {
 
+class CvFilmTile;
+
+// Description of a file of raw control-variate film accumulators
+struct CvAccumulatorsInfo {
+    Point2i fullResolution;
+    Bounds2i pixelBounds;
+    CvChannels channels;
+    Float scale;
+    bool hasSplats;
+    // Seed of the run, _PbrtOptions.seed_
+    int seed;
+};
+
+bool ReadCvAccumulatorsInfo(const std::string &name, CvAccumulatorsInfo *info);
+
 class CvFilm : public Film {
 public:
     CvFilm(const Point2i &resolution, const Bounds2f &cropWindow,
            std::unique_ptr<Filter> filter, Float diagonal,
            const std::string &filename, Float scale,
-           Float maxSampleLuminance = Infinity);
+           Float maxSampleLuminance = Infinity,
+           const CvChannels &channels = CvChannels(),
+           const std::string &referenceFilename = "", int alphaRadius = 0,
+           bool halfRadiance = false, const std::string &compression = "zip",
+           bool writeAccumulators = false, Float confidence = 0.95f,
+           Float targetError = 0.01f, const std::string &sampleStream = "");
 
     std::unique_ptr<CvFilmTile> GetCvFilmTile(const Bounds2i &sampleBounds);
     void MergeFilmTile(std::unique_ptr<CvFilmTile> tile);
+    // Adds every variant's radiance to the pixel containing _p_, unfiltered
+    // and scaled by _splatScale_ when the image is written. Splats do not
+    // enter the second moments.
+    void AddSplat(const Point2f &p, const CvSample &sample);
+    // Replaces the image with one final estimate per pixel, stored as a
+    // single sample of weight one, for integrators that do not average
+    // camera samples. _reciprocal_pdf_ is ignored.
+    void SetImage(const CvSample *img);
+    // Writes every variant, difference and moment. With second moments
+    // and known sample counts, those given to _SetPixelSamples()_ or
+    // merged from accumulator files, or else _samplesPerPixel_ in every
+    // pixel, it also writes each difference's per-pixel standard error,
+    // relative error and a mask of the channels where the difference is
+    // significant at the film's "confidence", and reports frame summaries
+    // to the statistics. Splats are not part of the error estimates.
+    // The film's sample stream, if any, is flushed first.
     void WriteImage(Float splatScale = 1, int samplesPerPixel = 0) final override;
-
-    CvDualPixel &GetCvPixel(const Point2i &p);
+    // Sets the camera samples taken in each pixel, for renders whose
+    // pixels got different counts; _counts_ holds those of the pixels of
+    // _sampleBounds_ in scanline order
+    void SetPixelSamples(const Bounds2i &sampleBounds,
+                         const std::vector<int> &counts);
+
+    const CvPixelBuffer &GetPixels() const { return pixels; }
+    int PixelIndex(const Point2i &p) const;
+    bool HasSecondMoments() const { return pixels.channels.secondMoments; }
+    // Save or restore the accumulated image together with the
+    // integrator's progress, _nPasses_ and per-pixel sample counts
+    bool WriteCheckpoint(const std::string &name, int nPasses,
+                         const std::vector<int> &pixelSamples) const;
+    bool ReadCheckpoint(const std::string &name, int *nPasses,
+                        std::vector<int> *pixelSamples);
+    // Raw, unnormalized accumulators and per-pixel sample counts, from
+    // which renders of disjoint parts of the image merge exactly.
+    // _WriteImage()_ writes them to the film's filename with the
+    // extension ".cvacc" if the film's "accumulators" option is set, with
+    // _samplesPerPixel_ as the count of every pixel unless
+    // _SetPixelSamples()_ gave the counts. Merging adds the filtered sums,
+    // counts and splats of every file. Renders of the same pixels take the
+    // same samples, so files whose pixel bounds overlap those of a file
+    // merged before are rejected.
+    bool WriteAccumulators(const std::string &name, Float splatScale,
+                           int samplesPerPixel) const;
+    bool MergeAccumulators(const std::string &name);
+    Float DifferenceRelativeError(const Point2i &p, int nSamples);
+    std::string VariantName(int variant) const;
+    std::string DifferenceName(int variant) const;
+
+    // CvFilm Public Data
+    const int nVariants, baseline;
 
 private:
-    std::unique_ptr<CvDualPixel[]> cvPixels;
+    // Per-pixel RGB error estimates of one difference
+    struct DifferenceErrors {
+        std::unique_ptr<Float[]> stdError, relError, significant;
+    };
+
+    // Mean and standard error of the difference of _variant_ at pixel
+    // _index_, treating _nSamples_ as the sample count
+    void DifferenceError(int index, int variant, int nSamples,
+                         RGBSpectrum *mean, RGBSpectrum *stdError) const;
+    // Error estimates of every difference, indexed by variant and empty
+    // for the baseline; empty if they cannot be computed
+    std::vector<DifferenceErrors> ComputeDifferenceErrors(
+        int samplesPerPixel) const;
+    void ReportDifferenceErrors(const std::vector<DifferenceErrors> &errors) const;
+    RGBSpectrum Alpha(int variant, const Point2i &p) const;
+    RGBSpectrum Splat(int offset, int variant) const;
+    void ComputeAlpha(int variant, Float *alpha);
+    void WriteEXR(Float splatScale, const std::vector<DifferenceErrors> &errors);
+
+    CvPixelBuffer pixels;
+    // Tile merges lock only the square blocks of _pixels_ that they
+    // touch, so tiles whose filter footprints do not overlap merge
+    // concurrently
+    static PBRT_CONSTEXPR int mergeBlockSize = 16;
+    Point2i nMergeBlocks;
+    std::unique_ptr<std::mutex[]> mergeLocks;
+    // Per-variant RGB splats, allocated by the first _AddSplat()_
+    std::unique_ptr<AtomicFloat[]> splats;
+    std::once_flag splatsAllocated;
+    // Camera samples taken in each pixel, if they were set or merged from
+    // accumulators; empty if every pixel got the same count
+    std::vector<int> pixelSamples;
+    // Merged accumulator files: their pixel bounds, the bounds of their
+    // pixels with samples and their run's seed
+    struct MergedAccumulators {
+        Bounds2i bounds, sampledBounds;
+        int seed;
+        bool hasSplats;
+    };
+    std::vector<MergedAccumulators> mergedFiles;
+    // Converged image of the baseline variant used as the control
+    // variate's known expectation, if one was given
+    std::unique_ptr<RGBSpectrum[]> reference;
+    const int alphaRadius;
+    // OpenEXR output: radiance layers may be stored as half, moments are
+    // always float
+    const bool halfRadiance;
+    const std::string compression;
+    const bool writeAccumulators;
+    // Two-sided confidence level of the significance masks and relative
+    // error for the reported time-to-error estimate
+    const Float confidence, targetError;
+    // Set by the first _GetCvFilmTile()_, for timing the render
+    std::once_flag renderStarted;
+    std::chrono::steady_clock::time_point renderStart;
+    // Writes every sample that tiles receive, if "samplestream" is set
+    std::unique_ptr<CvSampleStream> sampleStream;
 };
 
 class CvFilmTile {
@@ -33,19 +158,19 @@ class CvFilmTile {
     // FilmTile Public Methods
     CvFilmTile(const Bounds2i &pixelBounds, const Vector2f &filterRadius,
              const Float *filterTable, int filterTableSize,
-             Float maxSampleLuminance)
-        : pixelBounds(pixelBounds),
-          filterRadius(filterRadius),
+             Float maxSampleLuminance, const CvChannels &channels)
+        : filterRadius(filterRadius),
           invFilterRadius(1 / filterRadius.x, 1 / filterRadius.y),
           filterTable(filterTable),
           filterTableSize(filterTableSize),
-          maxSampleLuminance(maxSampleLuminance) {
-        pixels = std::vector<CvDualPixel>(std::max(0, pixelBounds.Area()));
-    }
+          pixels(channels, pixelBounds.Area()),
+          maxSampleLuminance(maxSampleLuminance),
+          pixelBounds(pixelBounds) {}
 
-    void AddSample(const Point2f &pFilm, CvDualPixel splat,
+    void AddSample(const Point2f &pFilm, const CvSample &splat,
                    Float sampleWeight = 1.) {
         CHECK(sampleWeight == 1.) << "Now the case \"sampleWeight = 1\" is supported!";
+        if (sampleStream) sampleStream->Add(&streamChunk, pFilm, splat);
 
         ProfilePhase _(Prof::AddFilmSample);
         //if (L.y() > maxSampleLuminance)
@@ -80,27 +205,18 @@ class CvFilmTile {
                 Float filterWeight = filterTable[offset];
 
                 // Update pixel values with filtered sample contribution
-                CvDualPixel &pixel = GetPixel(Point2i(x, y));
-                pixel.AddPixel(splat, filterWeight);
+                pixels.AddSample(PixelIndex(Point2i(x, y)), splat,
+                                 filterWeight);
            }
         }
     }
 
-    CvDualPixel &GetPixel(const Point2i &p) {
-        CHECK(InsideExclusive(p, pixelBounds));
-        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-        int offset =
-            (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
-        return pixels[offset];
-    }
-
-    const CvDualPixel &GetPixel(const Point2i &p) const {
+    int PixelIndex(const Point2i &p) const {
         CHECK(InsideExclusive(p, pixelBounds));
         int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-        int offset =
-            (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
-        return pixels[offset];
+        return (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
     }
+    const CvPixelBuffer &GetPixels() const { return pixels; }
 
     Bounds2i GetPixelBounds() const { return pixelBounds; }
 
@@ -109,12 +225,16 @@ class CvFilmTile {
     const Vector2f filterRadius, invFilterRadius;
     const Float *filterTable;
     const int filterTableSize;
-    std::vector<CvDualPixel> pixels;
+    CvPixelBuffer pixels;
     const Float maxSampleLuminance;
     const Bounds2i pixelBounds;
+    // The film's sample stream, or null, and this tile's unwritten samples
+    CvSampleStream *sampleStream = nullptr;
+    std::vector<char> streamChunk;
     friend class CvFilm;
 };
-Film *CreateCvFilm(const ParamSet &paramSet, std::unique_ptr<Filter> filter);
+Film *CreateCvFilm(const ParamSet &paramSet, std::unique_ptr<Filter> filter,
+                   int nVariants);
 
 }  // namespace pbrt
 
@@ -1,15 +1,22 @@
 #include "cv_integrator.h"
 
+#include <atomic>
+#include <chrono>
+
 #include "bssrdf.h"
 #include "camera.h"
 #include "scene.h"
 #include "interaction.h"
 #include "progressreporter.h"
 #include "paramset.h"
+#include "reflection.h"
+#include "sampling.h"
 
 #include "cv_pixel.h"
 #include "cv_film.h"
-#include "dualmat.h"
+#include "cv_record.h"
+#include "variantmat.h"
+#include "variantlight.h"
 
 namespace pbrt {
 
@@ -17,17 +24,199 @@ namespace pbrt {
 	STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
 	STAT_PERCENT("Integrator/Zero-radiance paths", zeroRadiancePaths, totalPaths);
 	STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+	STAT_PERCENT("Integrator/Paths reaching a variant material", variantPaths,
+				 cvPaths);
+	STAT_COUNTER("Integrator/Adaptive CV passes", adaptivePasses);
+	STAT_COUNTER("Integrator/Re-shaded paths", reshadedPaths);
+	STAT_PERCENT("Integrator/Tiles in the region of interest", roiTiles,
+				 probedTiles);
+	STAT_COUNTER("Integrator/Region of interest probe paths", roiProbePaths);
+
+	namespace {
+
+	// Evaluates variant _i_'s BSDF at _isect_; variants whose material did
+	// not produce a BSDF contribute nothing
+	inline Spectrum VariantF(const VariantBSDF &bsdfs, int i,
+							 const SurfaceInteraction &isect,
+							 const Vector3f &wi, BxDFType flags) {
+		return bsdfs.bsdf[i] ? bsdfs.bsdf[i]->f(isect.wo, wi, flags) *
+								   AbsDot(wi, isect.shading.n)
+							 : Spectrum(0.f);
+	}
+
+	// Variant counterpart of _EstimateDirect()_: the light sample, the BSDF
+	// sample (drawn with variant 0), their shadow rays and their MIS weights
+	// are shared by all variants, and only the BSDF values and the emitted
+	// radiance differ. Adds each variant's contribution to _Ld_. If _record_
+	// is given, the samples are stored in it, and shadow rays are traced
+	// even where every variant's BSDF is black so that other materials can
+	// be evaluated later.
+	void EstimateDirectVariants(const SurfaceInteraction &isect,
+								const VariantBSDF &bsdfs, int nVariants,
+								const Point2f &uScattering, const Light &light,
+								const Point2f &uLight, const Scene &scene,
+								Spectrum *Ld, CvPathVertex *record) {
+		BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+		// Variants beyond the BSDF's share variant 0's values
+		int nBsdfs = bsdfs.HasVariants() ? nVariants : 1;
+		// Sample light source with multiple importance sampling
+		Vector3f wi;
+		Float lightPdf = 0, scatteringPdf = 0;
+		VisibilityTester visibility;
+		Spectrum Li[MaxVariants];
+		Li[0] = light.Sample_Li(isect, uLight, &wi, &lightPdf, &visibility);
+		if (lightPdf > 0 && (!Li[0].IsBlack() || light.HasVariants())) {
+			// Evaluate every variant's BSDF for the light sample
+			Spectrum f[MaxVariants];
+			bool allBlack = true;
+			for (int i = 0; i < nVariants; ++i) {
+				f[i] = i < nBsdfs ? VariantF(bsdfs, i, isect, wi, bsdfFlags)
+								  : f[0];
+				allBlack &= f[i].IsBlack();
+			}
+			scatteringPdf = bsdfs.bsdf[0]->Pdf(isect.wo, wi, bsdfFlags);
+
+			// Trace the shared shadow ray
+			if ((!allBlack || record) && visibility.Unoccluded(scene)) {
+				Float weight = IsDeltaLight(light.flags)
+								   ? 1
+								   : PowerHeuristic(1, lightPdf, 1, scatteringPdf);
+				VariantLi(light, isect, uLight, wi, visibility, Li[0],
+						  nVariants, Li);
+				for (int i = 0; i < nVariants; ++i)
+					Ld[i] += f[i] * Li[i] * weight / lightPdf;
+				if (record) {
+					record->wiLight = wi;
+					record->LdLight = Li[0] * weight / lightPdf;
+				}
+			}
+		}
+
+		// Sample variant 0's BSDF with multiple importance sampling
+		if (IsDeltaLight(light.flags)) return;
+		BxDFType sampledType;
+		Spectrum f[MaxVariants];
+		f[0] = bsdfs.bsdf[0]->Sample_f(isect.wo, &wi, uScattering,
+									   &scatteringPdf, bsdfFlags, &sampledType);
+		f[0] *= AbsDot(wi, isect.shading.n);
+		if (scatteringPdf == 0) return;
+		bool allBlack = f[0].IsBlack();
+		for (int i = 1; i < nVariants; ++i) {
+			f[i] = i < nBsdfs ? VariantF(bsdfs, i, isect, wi, bsdfFlags) : f[0];
+			allBlack &= f[i].IsBlack();
+		}
+		if (allBlack && !record) return;
+
+		// Account for light contributions along sampled direction _wi_
+		Float weight = 1;
+		if (!(sampledType & BSDF_SPECULAR)) {
+			lightPdf = light.Pdf_Li(isect, wi);
+			if (lightPdf == 0) return;
+			weight = PowerHeuristic(1, scatteringPdf, 1, lightPdf);
+		}
+		SurfaceInteraction lightIsect;
+		Ray ray = isect.SpawnRay(wi);
+		if (scene.Intersect(ray, &lightIsect)) {
+			if (lightIsect.primitive->GetAreaLight() != &light) return;
+			VariantLe(lightIsect, -wi, nVariants, Li);
+		} else
+			VariantLe(light, ray, nVariants, Li);
+		for (int i = 0; i < nVariants; ++i)
+			Ld[i] += f[i] * Li[i] * weight / scatteringPdf;
+		if (record) {
+			record->wiBsdf = wi;
+			record->LdBsdf = Li[0] * weight / scatteringPdf;
+		}
+	}
+
+	}  // anonymous namespace
+
+	void UniformSampleOneLightVariants(const SurfaceInteraction &isect,
+									   const VariantBSDF &bsdfs, int nVariants,
+									   const Scene &scene, Sampler &sampler,
+									   const Distribution1D *lightDistrib,
+									   Spectrum *Ld, CvPathVertex *record) {
+		ProfilePhase p(Prof::DirectLighting);
+		for (int i = 0; i < nVariants; ++i) Ld[i] = Spectrum(0.f);
+		// Randomly choose a single light to sample, _light_
+		int nLights = int(scene.lights.size());
+		if (nLights == 0) return;
+		int lightNum;
+		Float lightPdf;
+		if (lightDistrib) {
+			lightNum = lightDistrib->SampleDiscrete(sampler.Get1D(), &lightPdf);
+			if (lightPdf == 0) return;
+		} else {
+			lightNum = std::min((int)(sampler.Get1D() * nLights), nLights - 1);
+			lightPdf = Float(1) / nLights;
+		}
+		const std::shared_ptr<Light> &light = scene.lights[lightNum];
+		Point2f uLight = sampler.Get2D();
+		Point2f uScattering = sampler.Get2D();
+		EstimateDirectVariants(isect, bsdfs, nVariants, uScattering, *light,
+							   uLight, scene, Ld, record);
+		for (int i = 0; i < nVariants; ++i) Ld[i] /= lightPdf;
+		if (record) {
+			record->LdLight /= lightPdf;
+			record->LdBsdf /= lightPdf;
+		}
+	}
 
 	namespace {
+
+	// Returns an interaction with the recorded surface geometry of _v_
+	SurfaceInteraction RecordedInteraction(const CvPathVertex &v,
+										   const Primitive *primitive) {
+		SurfaceInteraction isect;
+		isect.p = v.p;
+		isect.n = v.n;
+		isect.uv = v.uv;
+		isect.wo = v.wo;
+		isect.shading.n = v.ns;
+		isect.shading.dpdu = v.dpdus;
+		isect.shading.dpdv = v.dpdvs;
+		isect.shading.dndu = v.dndus;
+		isect.shading.dndv = v.dndvs;
+		isect.dpdu = v.dpdus;
+		isect.dpdv = v.dpdvs;
+		isect.primitive = primitive;
+		return isect;
+	}
+
 	}  // anonymous namespace
 
 	CvPathIntegrator::CvPathIntegrator(int maxDepth,
 									   std::shared_ptr<const Camera> camera,
 									   std::shared_ptr<Sampler> sampler,
 									   const Bounds2i &pixelBounds, Float rrThreshold,
-									   const std::string &lightSampleStrategy)
+									   const std::string &lightSampleStrategy,
+									   Float adaptiveThreshold,
+									   int adaptivePassSamples,
+									   Float adaptiveTime,
+									   Float checkpointInterval,
+									   const std::string &checkpointFile,
+									   const std::string &recordFile,
+									   const std::string &reshadeFile,
+									   const std::vector<std::shared_ptr<Primitive>> &primitives,
+									   int roiProbeSamples, int roiFillSamples)
 		: PathIntegrator(maxDepth, camera, sampler, pixelBounds,
-						 rrThreshold, lightSampleStrategy) {
+						 rrThreshold, lightSampleStrategy),
+		  adaptiveThreshold(adaptiveThreshold),
+		  adaptivePassSamples(adaptivePassSamples),
+		  adaptiveTime(adaptiveTime),
+		  checkpointInterval(checkpointInterval),
+		  checkpointFile(checkpointFile),
+		  recordFile(recordFile),
+		  reshadeFile(reshadeFile),
+		  roiProbeSamples(roiProbeSamples),
+		  roiFillSamples(roiFillSamples) {
+		// Recordings refer to primitives by their index in the scene
+		// description
+		if (!recordFile.empty() || !reshadeFile.empty()) {
+			this->primitives = primitives;
+			for (size_t i = 0; i < primitives.size(); ++i)
+				primitiveIds[primitives[i].get()] = i;
+		}
 	}
 
 	void CvPathIntegrator::Render(const Scene &scene) {
@@ -38,6 +227,35 @@ namespace pbrt {
 		//CHECK(typeid(camera->film) == typeid(CvFilm))
 		//    << "Film type must be \"CvFilm\"";
 		CvFilm *film = reinterpret_cast<CvFilm*>(camera->film);
+		nVariants = film->nVariants;
+		baseline = film->baseline;
+		lightVariants = nVariants > 1 && HasLightVariants(scene);
+		if (lightVariants && (!recordFile.empty() || !reshadeFile.empty()))
+			Warning("Path recordings only hold the first light variant's "
+					"emission; the other light variants are not re-shaded.");
+
+		// Re-shade a recording instead of tracing paths
+		if (!reshadeFile.empty()) {
+			std::unique_ptr<CvPathRecording> recording =
+				CvPathRecording::Open(reshadeFile);
+			if (!recording) return;
+			if (recording->NumPrimitives() != (int)primitives.size()) {
+				Error("Path recording \"%s\" has %d primitives but the scene "
+					  "has %d; re-shading needs the recorded geometry.",
+					  reshadeFile.c_str(), recording->NumPrimitives(),
+					  (int)primitives.size());
+				return;
+			}
+			Reshade(*recording, film);
+			LOG(INFO) << "Re-shading finished";
+			film->WriteImage(1, sampler->samplesPerPixel);
+			return;
+		}
+		std::unique_ptr<CvPathRecorder> recorder;
+		if (!recordFile.empty()) {
+			recorder.reset(new CvPathRecorder(recordFile, primitives.size()));
+			if (!recorder->IsValid()) recorder.reset();
+		}
 
 		// Compute number of tiles, _nTiles_, to use for parallel rendering
 		Bounds2i sampleBounds = film->GetSampleBounds();
@@ -45,8 +263,141 @@ namespace pbrt {
 		const int tileSize = 16;
 		Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
 					   (sampleExtent.y + tileSize - 1) / tileSize);
-		ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
-		{
+
+		// Without adaptive sampling or checkpoints everything is rendered in
+		// a single pass of _samplesPerPixel_ samples. Otherwise every pixel
+		// first gets _adaptivePassSamples_ samples, and further passes of
+		// that many samples go to pixels that still need samples: with
+		// adaptive sampling only those whose difference estimate has not
+		// converged, up to _samplesPerPixel_ in total.
+		bool adaptive = adaptiveThreshold > 0;
+		if (adaptive && !film->HasSecondMoments()) {
+			Error("Adaptive sampling needs the film's \"secondmoments\". "
+				  "Rendering all pixels uniformly.");
+			adaptive = false;
+		}
+		const bool checkpoints = checkpointInterval > 0;
+
+		// With light variants every path can differ between variants, so
+		// all tiles are in the region of interest. Otherwise the probe takes
+		// the last _roiProbeSamples_ sample indices of each pixel and the
+		// passes the ones before, so that the samples that select the
+		// region are not reused to render it.
+		bool roi = roiProbeSamples > 0 && nVariants > 1;
+		if (roi && lightVariants) {
+			Warning("The scene's lights have variants; rendering all tiles "
+					"with the full sample count.");
+			roi = false;
+		}
+		if (roi && roiProbeSamples >= sampler->samplesPerPixel) {
+			Warning("\"roiprobesamples\" leaves no samples per pixel to "
+					"render; rendering all tiles with the full sample count.");
+			roi = false;
+		}
+		const int64_t maxSamples =
+			sampler->samplesPerPixel - (roi ? roiProbeSamples : 0);
+		const int passSamples =
+			(adaptive || checkpoints)
+				? (int)std::min<int64_t>(adaptivePassSamples, maxSamples)
+				: (int)maxSamples;
+		std::string checkpointName =
+			checkpointFile.empty() ? film->filename + ".cvckpt" : checkpointFile;
+		// Samples already taken and samples to take in the current pass,
+		// per pixel of _sampleBounds_
+		std::vector<int> pixelSamples(sampleBounds.Area(), 0);
+		std::vector<int> passCounts(sampleBounds.Area(), passSamples);
+		auto pixelOffset = [&](const Point2i &p) {
+			return (p.y - sampleBounds.pMin.y) * sampleExtent.x +
+				   (p.x - sampleBounds.pMin.x);
+		};
+
+		// Probe the tiles for the region of interest
+		std::vector<char> inRoi(nTiles.x * nTiles.y, 1);
+		if (roi) {
+			ProgressReporter reporter(nTiles.x * nTiles.y, "Probing variants");
+			ParallelFor2D([&](Point2i tile) {
+				MemoryArena arena;
+				int tileIndex = tile.y * nTiles.x + tile.x;
+				std::unique_ptr<Sampler> tileSampler =
+					sampler->Clone(-1 - tileIndex);
+				int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+				int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+				Bounds2i tileBounds(
+					Point2i(x0, y0),
+					Point2i(std::min(x0 + tileSize, sampleBounds.pMax.x),
+							std::min(y0 + tileSize, sampleBounds.pMax.y)));
+				bool reached = false;
+				for (Point2i pixel : tileBounds) {
+					if (reached) break;
+					tileSampler->StartPixel(pixel);
+					if (!InsideExclusive(pixel, pixelBounds)) continue;
+					tileSampler->SetSampleNumber(maxSamples);
+					for (int s = 0; s < roiProbeSamples && !reached; ++s) {
+						tileSampler->StartDimensionBlock(SamplePurpose::Camera);
+						CameraSample cameraSample =
+							tileSampler->GetCameraSample(pixel);
+						RayDifferential ray;
+						if (camera->GenerateRayDifferential(cameraSample, &ray) > 0)
+							reached = ReachesVariant(ray, scene, *tileSampler,
+													 arena);
+						++roiProbePaths;
+						arena.Reset();
+						tileSampler->StartNextSample();
+					}
+				}
+				inRoi[tileIndex] = reached;
+				++probedTiles;
+				if (reached) ++roiTiles;
+				reporter.Update();
+			}, nTiles);
+			reporter.Done();
+		}
+		// Samples per pixel that the pixel's tile gets in total
+		auto pixelMaxSamples = [&](const Point2i &p) -> int64_t {
+			int tx = (p.x - sampleBounds.pMin.x) / tileSize;
+			int ty = (p.y - sampleBounds.pMin.y) / tileSize;
+			return inRoi[ty * nTiles.x + tx]
+					   ? maxSamples
+					   : std::min<int64_t>(roiFillSamples, maxSamples);
+		};
+
+		// Select the pixels that get another pass, returning their count
+		auto selectPixels = [&]() {
+			std::atomic<int> nActive(0);
+			ParallelFor([&](int64_t y) {
+				for (int x = sampleBounds.pMin.x; x < sampleBounds.pMax.x; ++x) {
+					Point2i p(x, sampleBounds.pMin.y + (int)y);
+					int offset = pixelOffset(p);
+					int nTaken = pixelSamples[offset];
+					int64_t nMax = pixelMaxSamples(p);
+					bool refine =
+						InsideExclusive(p, pixelBounds) && nTaken < nMax &&
+						(!adaptive || nTaken == 0 ||
+						 film->DifferenceRelativeError(p, nTaken) >
+							 adaptiveThreshold);
+					passCounts[offset] =
+						refine ? (int)std::min<int64_t>(passSamples, nMax - nTaken)
+							   : 0;
+					if (refine) ++nActive;
+				}
+			}, sampleExtent.y, 16);
+			return nActive.load();
+		};
+
+		int pass = 0, nActive = sampleBounds.Area();
+		if ((PbrtOptions.resume &&
+			 film->ReadCheckpoint(checkpointName, &pass, &pixelSamples)) ||
+			roi)
+			nActive = selectPixels();
+		auto startTime = std::chrono::steady_clock::now();
+		auto lastCheckpoint = startTime;
+
+		for (; nActive > 0; ++pass) {
+			ProgressReporter reporter(
+				nTiles.x * nTiles.y,
+				passSamples < maxSamples
+					? StringPrintf("Rendering (pass %d)", pass + 1)
+					: std::string("Rendering"));
 			ParallelFor2D([&](Point2i tile) {
 				// Render section of image corresponding to _tile_
 
@@ -54,9 +405,8 @@ namespace pbrt {
 				MemoryArena arena;
 
 				// Get sampler instance for tile
-				int seed = tile.y * nTiles.x + tile.x;
-				std::unique_ptr<Sampler> tileSampler1 = sampler->Clone(seed);
-				std::unique_ptr<Sampler> tileSampler2 = sampler->Clone(seed);
+				int seed = (pass * nTiles.y + tile.y) * nTiles.x + tile.x;
+				std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
 
 				// Compute sample bounds for tile
 				int x0 = sampleBounds.pMin.x + tile.x * tileSize;
@@ -68,13 +418,19 @@ namespace pbrt {
 
 				// Get _FilmTile_ for tile
 				std::unique_ptr<CvFilmTile> filmTile = film->GetCvFilmTile(tileBounds);
+				// Paths recorded in this tile
+				std::vector<char> recordBlock;
+				std::vector<CvPathVertex> path;
+				int nRecorded = 0;
 
 				// Loop over pixels in tile to render them
 				for (Point2i pixel : tileBounds) {
+					int offset = pixelOffset(pixel);
+					int nSamples = passCounts[offset];
+					if (nSamples == 0) continue;
 					{
 						ProfilePhase pp(Prof::StartPixel);
-						tileSampler1->StartPixel(pixel);
-						tileSampler2->StartPixel(pixel);
+						tileSampler->StartPixel(pixel);
 					}
 
 					// Do this check after the StartPixel() call; this keeps
@@ -84,22 +440,36 @@ namespace pbrt {
 					if (!InsideExclusive(pixel, pixelBounds))
 						continue;
 
-					do {
-						// Initialize _CameraSample_ for current sample
-						CameraSample cameraSample = tileSampler1->GetCameraSample(pixel);
+					// Continue the pixel's sample sequence where the
+					// previous pass left off
+					tileSampler->SetSampleNumber(pixelSamples[offset]);
+					for (int s = 0; s < nSamples; ++s) {
+						// Initialize _CameraSample_ for current sample. Every
+						// purpose draws from its own dimension block, so that
+						// renders of other scene variants stay correlated with
+						// this one sample by sample.
+						tileSampler->StartDimensionBlock(SamplePurpose::Camera);
+						CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
 
 						// Generate camera ray for current sample
 						RayDifferential ray;
 						Float rayWeight =
 							camera->GenerateRayDifferential(cameraSample, &ray);
 						ray.ScaleDifferentials(
-							1 / std::sqrt((Float)tileSampler1->samplesPerPixel));
+							1 / std::sqrt((Float)tileSampler->samplesPerPixel));
 						++nCameraRays;
 
 						// Evaluate radiance along camera ray
-						CvDualPixel pixel;
+						CvSample sample;
 						if (rayWeight > 0) {
-							pixel = LiControlVariate(ray, scene, *tileSampler1, arena);
+							sample = LiControlVariate(ray, scene, *tileSampler, arena,
+													  0, recorder ? &path : nullptr);
+						}
+						if (recorder) {
+							CvPathRecorder::AddPath(&recordBlock, cameraSample.pFilm,
+													rayWeight, path);
+							path.clear();
+							++nRecorded;
 						}
 
 						// TODO: Here should be reverted?
@@ -107,33 +477,73 @@ namespace pbrt {
 						//    ray << " -> L = " << L;
 
 						// Add camera ray's contribution to image
-						filmTile->AddSample(cameraSample.pFilm, pixel, rayWeight);
+						filmTile->AddSample(cameraSample.pFilm, sample, rayWeight);
 
 						// Free _MemoryArena_ memory from computing image sample
 						// value
 						arena.Reset();
-					} while (tileSampler1->StartNextSample() && tileSampler2->StartNextSample());
+						tileSampler->StartNextSample();
+					}
+					pixelSamples[offset] += nSamples;
 				}
+				if (recorder) recorder->WriteBlock(tileBounds, nRecorded, recordBlock);
 				LOG(INFO) << "Finished image tile " << tileBounds;
 				// Merge image tile into _Film_
 				film->MergeFilmTile(std::move(filmTile));
 				reporter.Update();
 			}, nTiles);
 			reporter.Done();
+			nActive = selectPixels();
+
+			auto now = std::chrono::steady_clock::now();
+			Float elapsed =
+				std::chrono::duration<Float>(now - startTime).count();
+			if (checkpoints &&
+				(nActive == 0 ||
+				 std::chrono::duration<Float>(now - lastCheckpoint).count() >=
+					 checkpointInterval)) {
+				// The final checkpoint lets a later run with more samples
+				// per pixel continue from this one
+				film->WriteCheckpoint(checkpointName, pass + 1, pixelSamples);
+				lastCheckpoint = now;
+			}
+			if (!adaptive) continue;
+			++adaptivePasses;
+			LOG(INFO) << "Adaptive pass " << pass + 1 << " done after "
+					  << elapsed << "s; " << nActive << " pixels above "
+					  << "relative error " << adaptiveThreshold;
+			if (nActive > 0 && adaptiveTime > 0 && elapsed >= adaptiveTime) {
+				Warning("Adaptive sampling time budget of %fs exhausted with %d "
+						"pixels above the error threshold.", adaptiveTime,
+						nActive);
+				break;
+			}
 		}
 		LOG(INFO) << "Rendering finished";
-		film->WriteImage(1,sampler->samplesPerPixel);    
+		// Adaptive sampling and the region of interest leave pixels with
+		// fewer samples than _samplesPerPixel_
+		film->SetPixelSamples(sampleBounds, pixelSamples);
+		film->WriteImage(1, sampler->samplesPerPixel);
 	}
 
-	CvDualPixel CvPathIntegrator::LiControlVariate(const RayDifferential &r,
-												   const Scene &scene, Sampler &sampler,
-												   MemoryArena &arena, int depth) const {
+	CvSample CvPathIntegrator::LiControlVariate(const RayDifferential &r,
+											   const Scene &scene, Sampler &sampler,
+											   MemoryArena &arena, int depth,
+											   std::vector<CvPathVertex> *path) const {
 		ProfilePhase p(Prof::SamplerIntegratorLi);
-		Spectrum L1(0.f), L2(0.f);
-		std::vector <Spectrum> betas(2 , 1.f);
-		std::vector<Float> reciprocal_pdfs(2 , 1.f);
+		// Every variant is importance sampled with variant 0's BSDF and
+		// shares its light samples, so the variants share one path PDF and
+		// only their throughputs differ
+		Spectrum L[MaxVariants], betas[MaxVariants];
+		for (int i = 0; i < nVariants; ++i) betas[i] = Spectrum(1.f);
+		Float reciprocal_pdf = 1.f;
 		RayDifferential ray(r);
 		bool specularBounce = false;
+		// Only variant 0 is tracked until the path reaches a
+		// _VariantMaterial_; until then all variants are identical unless
+		// the lights have variants
+		bool hitVariant = false;
+		int nTracked = lightVariants ? nVariants : 1;
 		int bounces;
 		// Added after book publication: etaScale tracks the accumulated effect
 		// of radiance scaling due to rays passing through refractive
@@ -143,80 +553,142 @@ namespace pbrt {
 		// avoid terminating refracted rays that are about to be refracted back
 		// out of a medium and thus have their beta value increased.
 		Float etaScale = 1;
+		// When recording, emission found at surfaces without a BSDF is
+		// carried over to the next recorded vertex, as the throughput
+		// does not change in between
+		Spectrum pendingLe(0.f);
 
 		for (bounces = 0;; ++bounces) {
 			SurfaceInteraction isect;
 			bool foundIntersection = scene.Intersect(ray, &isect); 
-      
-			if (foundIntersection) {
-				Spectrum Le = isect.Le(-ray.d);
-				if (!Le.IsBlack()) {
-					L1 += betas[0] * Le;
-					L2 += betas[1] * Le;
-					break;
-				}
-			} else {
-				for (const auto &light : scene.infiniteLights) {
-					Spectrum Le = light->Le(ray);
-					L1 += betas[0] * Le;
-					L2 += betas[1] * Le;
+
+			// Possibly add emitted light at intersection; other emission is
+			// accounted for by direct lighting
+			if (bounces == 0 || specularBounce) {
+				Spectrum Le[MaxVariants];
+				if (foundIntersection) {
+					VariantLe(isect, -ray.d, nTracked, Le);
+					for (int i = 0; i < nTracked; ++i) L[i] += betas[i] * Le[i];
+					pendingLe += Le[0];
+				} else {
+					for (const auto &light : scene.infiniteLights) {
+						VariantLe(*light, ray, nTracked, Le);
+						for (int i = 0; i < nTracked; ++i)
+							L[i] += betas[i] * Le[i];
+						pendingLe += Le[0];
+					}
 				}
 			}
 
 			// Terminate path if ray escaped or _maxDepth_ was reached
-			if (!foundIntersection || bounces >= maxDepth) break;
+			if (!foundIntersection || bounces >= maxDepth) {
+				if (path) {
+					CvPathVertex vertex = CvPathVertex();
+					vertex.primitive = -1;
+					vertex.Le = pendingLe;
+					path->push_back(vertex);
+				}
+				break;
+			}
 
-			// Compute scattering functions and skip over medium boundaries
-			isect.ComputeScatteringFunctions(ray, arena, true);
-			if (!isect.bsdf) {
+			// Record the vertex's geometry before materials modify the
+			// shading frame; sampling below fills in the rest
+			CvPathVertex recorded = CvPathVertex(), *vertex = nullptr;
+			if (path) {
+				auto id = primitiveIds.find(isect.primitive);
+				recorded.primitive = id != primitiveIds.end() ? id->second : -1;
+				recorded.p = isect.p;
+				recorded.n = isect.n;
+				recorded.uv = isect.uv;
+				recorded.wo = isect.wo;
+				recorded.ns = isect.shading.n;
+				recorded.dpdus = isect.shading.dpdu;
+				recorded.dpdvs = isect.shading.dpdv;
+				recorded.dndus = isect.shading.dndu;
+				recorded.dndvs = isect.shading.dndv;
+				recorded.rrWeight = 1;
+			}
+
+			// Compute scattering functions of all variants with a single
+			// material evaluation and skip over medium boundaries
+			VariantBSDF bsdfs;
+			ComputeVariantScatteringFunctions(&isect, ray, arena, nVariants,
+											  &bsdfs, true);
+			if (!bsdfs.bsdf[0]) {
 				VLOG(2) << "Skipping intersection due to null bsdf";
 				ray = isect.SpawnRay(ray.d);
 				bounces--;
 				continue;
 			}
+			if (path) {
+				path->push_back(recorded);
+				vertex = &path->back();
+				vertex->Le = pendingLe;
+				pendingLe = Spectrum(0.f);
+			}
+			if (bsdfs.HasVariants() && !hitVariant) {
+				for (int i = nTracked; i < nVariants; ++i) {
+					L[i] = L[0];
+					betas[i] = betas[0];
+				}
+				nTracked = nVariants;
+				hitVariant = true;
+			}
+			int nEval = bsdfs.HasVariants() ? nVariants : 1;
 
 			const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
 
+			// Sample illumination from lights once for all variants.
+			// (But skip this for perfectly specular BSDFs.)
+			if (bsdfs.bsdf[0]->NumComponents(
+					BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) > 0) {
+				++totalPaths;
+				Spectrum Ld[MaxVariants];
+				int nLd = lightVariants ? nVariants : nEval;
+				sampler.StartDimensionBlock(SamplePurpose::Light, bounces);
+				UniformSampleOneLightVariants(isect, bsdfs, nLd, scene,
+											  sampler, distrib, Ld, vertex);
+				if (Ld[0].IsBlack()) ++zeroRadiancePaths;
+				for (int i = 0; i < nTracked; ++i)
+					L[i] += betas[i] * Ld[i < nLd ? i : 0];
+			}
+
+			// Sample a new path direction with variant 0 (F) and evaluate
+			// the other variants for the same direction
 			Vector3f wo = -ray.d;
 			Vector3f wi;
-			std::vector<Float> pdfs(2 , 1.f);
+			Float pdf;
 			BxDFType flag = BxDFType(0);
-			std::vector<Spectrum> fs(2);
-
-			//sample a new path direction
-			//Compute for two material 0:after(F) 1:befpre(H)
-			// Compute scattering functions and skip over medium boundaries
-			DualMaterial::SetMaterialId(0);
-			isect.ComputeScatteringFunctions(ray, arena, true);
-
-			if (!isect.bsdf) {
-				VLOG(2) << "Skipping intersection due to null bsdf";
-				ray = isect.SpawnRay(ray.d);
-				bounces--;
-				continue;
-			}
-
-			fs[0] = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdfs[0],
-										 BSDF_ALL, &flag);
-
-			DualMaterial::SetMaterialId(1);
-			isect.ComputeScatteringFunctions(ray, arena, true);
-			fs[1] = isect.bsdf->f_pdf(wo, wi, &pdfs[1], BSDF_ALL);
-
-			DualMaterial::SetMaterialId(0);
-			isect.ComputeScatteringFunctions(ray, arena, true);
-
-			VLOG(2) << "Sampled BSDF, f1 = " << fs[0] << ", pdf = " << pdfs[0];
-			VLOG(2) << "Sampled BSDF, f2 = " << fs[1] << ", pdf = " << pdfs[1];
-			if (fs[0].IsBlack() || fs[1].IsBlack() || pdfs[0] == 0.f || pdfs[1] == 0.f) {
-				break;
+			sampler.StartDimensionBlock(SamplePurpose::BSDF, bounces);
+			Point2f u = sampler.Get2D();
+			Spectrum f = bsdfs.bsdf[0]->Sample_f(wo, &wi, u, &pdf, BSDF_ALL,
+												 &flag);
+			VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
+			if (pdf == 0.f) break;
+			if (vertex) {
+				vertex->sampledType = flag;
+				vertex->wi = wi;
+				vertex->pdf = pdf;
+				vertex->u = u;
 			}
 
 			Float G = AbsDot(wi, isect.shading.n);
-			betas[0] *= fs[0] * G ;
-			betas[1] *= fs[1] * G ;
-			reciprocal_pdfs[0] /= pdfs[0];
-			reciprocal_pdfs[1] /= pdfs[1];
+			bool allBlack = f.IsBlack();
+			if (nEval > 1) {
+				for (int i = 1; i < nVariants; ++i) {
+					Spectrum fi = VariantF(bsdfs, i, isect, wi, BSDF_ALL);
+					VLOG(2) << "Variant " << i << " BSDF, f = " << fi;
+					allBlack &= fi.IsBlack();
+					betas[i] *= fi / pdf;
+				}
+				betas[0] *= f * G / pdf;
+			} else {
+				for (int i = 0; i < nTracked; ++i) betas[i] *= f * G / pdf;
+			}
+			// Recorded paths continue so that other materials can be
+			// evaluated along them later
+			if (allBlack && !path) break;
+			reciprocal_pdf /= pdf;
 
 			specularBounce = (flag & BSDF_SPECULAR) != 0;
 			if ((flag & BSDF_SPECULAR) && (flag & BSDF_TRANSMISSION)) {
@@ -232,30 +704,185 @@ namespace pbrt {
 			  Error("Participating media is not currently supported!!");
 		  }
 
-		  // Possibly terminate the path with Russian roulette.
+		  // Possibly terminate the path with Russian roulette, based on the
+		  // largest throughput of all tracked variants.
 		  // Factor out radiance scaling due to refraction in rrBeta.
-		  const Spectrum rrBeta = betas[0] * etaScale * reciprocal_pdfs[0];
-
-		  if (rrBeta.MaxComponentValue() < rrThreshold + 1.f && bounces >  3) {
-			  Float q = std::max((Float).05, 1.f - rrBeta.MaxComponentValue());
+		  Float rrMax = 0;
+		  for (int i = 0; i < nTracked; ++i)
+			  rrMax = std::max(rrMax, (betas[i] * etaScale).MaxComponentValue());
+		  if (rrMax < rrThreshold && bounces > 3) {
+			  Float q = std::max((Float).05, 1 - rrMax);
+			  sampler.StartDimensionBlock(SamplePurpose::RussianRoulette,
+										  bounces);
 			  if (sampler.Get1D() < q) {
-				  reciprocal_pdfs[0] /=  q;
-				  reciprocal_pdfs[1] /=  q;
+				  reciprocal_pdf /= q;
+				  if (vertex) vertex->rrWeight = 1 / q;
 				  break;
 			  }
-			  reciprocal_pdfs[0] /= 1 - q;
-			  reciprocal_pdfs[1] /= 1 - q;
+			  reciprocal_pdf /= 1 - q;
+			  for (int i = 0; i < nTracked; ++i) betas[i] /= 1 - q;
+			  if (vertex) vertex->rrWeight = 1 / (1 - q);
 			  DCHECK(!std::isinf(betas[0].y()));
 		  }
 		}
 		ReportValue(pathLength, bounces);
-		return CvDualPixel(L1, L2, reciprocal_pdfs[0]);
+		++cvPaths;
+		if (hitVariant) ++variantPaths;
+		for (int i = nTracked; i < nVariants; ++i) L[i] = L[0];
+		return CvSample(L, nVariants, reciprocal_pdf, bounces);
+	}
+
+	CvSample CvPathIntegrator::ReshadePath(const CvPathVertex *vertices,
+										   int nVertices,
+										   MemoryArena &arena) const {
+		ProfilePhase p(Prof::SamplerIntegratorLi);
+		// Follow the recorded path with this scene's materials. The
+		// recorded directions keep the PDFs they were sampled with, so the
+		// new materials are evaluated as in _LiControlVariate()_ for
+		// variants other than 0, and all variants are tracked throughout.
+		Spectrum L[MaxVariants], betas[MaxVariants];
+		for (int i = 0; i < nVariants; ++i) betas[i] = Spectrum(1.f);
+		Float reciprocal_pdf = 1.f;
+		const BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+		for (int k = 0; k < nVertices; ++k) {
+			const CvPathVertex &v = vertices[k];
+			for (int i = 0; i < nVariants; ++i) L[i] += betas[i] * v.Le;
+			if (v.primitive < 0 || v.primitive >= (int)primitives.size())
+				break;
+
+			SurfaceInteraction isect =
+				RecordedInteraction(v, primitives[v.primitive].get());
+			VariantBSDF bsdfs;
+			ComputeVariantScatteringFunctions(&isect, RayDifferential(), arena,
+											  nVariants, &bsdfs, true);
+			// A surface that no longer scatters absorbs the path
+			if (!bsdfs.bsdf[0]) break;
+			int nEval = bsdfs.HasVariants() ? nVariants : 1;
+
+			// Re-weight the recorded light samples
+			if (!v.LdLight.IsBlack() || !v.LdBsdf.IsBlack()) {
+				Spectrum f0Light = VariantF(bsdfs, 0, isect, v.wiLight, bsdfFlags);
+				Spectrum f0Bsdf = VariantF(bsdfs, 0, isect, v.wiBsdf, bsdfFlags);
+				for (int i = 0; i < nVariants; ++i) {
+					Spectrum fLight = i < nEval && i > 0 ?
+						VariantF(bsdfs, i, isect, v.wiLight, bsdfFlags) : f0Light;
+					Spectrum fBsdf = i < nEval && i > 0 ?
+						VariantF(bsdfs, i, isect, v.wiBsdf, bsdfFlags) : f0Bsdf;
+					L[i] += betas[i] * (fLight * v.LdLight + fBsdf * v.LdBsdf);
+				}
+			}
+			if (v.sampledType == 0) break;
+
+			// Re-weight the recorded continuation. Specular lobes can only
+			// be evaluated by sampling them, so variant 0 replays its BSDF
+			// sample and must reproduce the recorded direction.
+			Spectrum f0;
+			Float pdf0 = v.pdf;
+			if (v.sampledType & BSDF_SPECULAR) {
+				Vector3f wi;
+				BxDFType type;
+				f0 = bsdfs.bsdf[0]->Sample_f(isect.wo, &wi, v.u, &pdf0,
+											 BSDF_ALL, &type);
+				if (pdf0 == 0 || !(type & BSDF_SPECULAR) ||
+					Dot(wi, v.wi) < 1 - 1e-4f)
+					f0 = Spectrum(0.f);
+				else
+					f0 *= AbsDot(wi, isect.shading.n) * v.pdf / pdf0;
+			} else
+				f0 = VariantF(bsdfs, 0, isect, v.wi, BSDF_ALL);
+			for (int i = 0; i < nVariants; ++i) {
+				Spectrum f = i < nEval && i > 0 ?
+					VariantF(bsdfs, i, isect, v.wi, BSDF_ALL) : f0;
+				betas[i] *= f * v.rrWeight / v.pdf;
+			}
+			reciprocal_pdf *= v.rrWeight / v.pdf;
+		}
+		++reshadedPaths;
+		return CvSample(L, nVariants, reciprocal_pdf,
+						std::max(0, nVertices - 1));
+	}
+
+	bool CvPathIntegrator::ReachesVariant(const RayDifferential &r,
+										  const Scene &scene, Sampler &sampler,
+										  MemoryArena &arena) const {
+		ProfilePhase p(Prof::SamplerIntegratorLi);
+		RayDifferential ray(r);
+		// Materials are evaluated at the first _maxDepth_ vertices only
+		for (int bounces = 0; bounces < maxDepth; ++bounces) {
+			SurfaceInteraction isect;
+			if (!scene.Intersect(ray, &isect)) return false;
+			VariantBSDF bsdfs;
+			ComputeVariantScatteringFunctions(&isect, ray, arena, nVariants,
+											  &bsdfs, true);
+			if (!bsdfs.bsdf[0]) {
+				ray = isect.SpawnRay(ray.d);
+				bounces--;
+				continue;
+			}
+			if (bsdfs.HasVariants()) return true;
+
+			// Continue with variant 0's BSDF sample, drawn from the same
+			// dimensions as in _LiControlVariate()_
+			Vector3f wi;
+			Float pdf;
+			sampler.StartDimensionBlock(SamplePurpose::BSDF, bounces);
+			Spectrum f = bsdfs.bsdf[0]->Sample_f(-ray.d, &wi, sampler.Get2D(),
+												 &pdf, BSDF_ALL);
+			if (pdf == 0.f || f.IsBlack()) break;
+			ray = isect.SpawnRay(wi);
+		}
+		return false;
+	}
+
+	void CvPathIntegrator::Reshade(const CvPathRecording &recording,
+								   CvFilm *film) {
+		const std::vector<CvPathRecording::Block> &blocks = recording.Blocks();
+		ProgressReporter reporter(blocks.size(), "Re-shading");
+		// Count the recorded samples of every pixel, which the recording
+		// render may have sampled adaptively
+		Bounds2i sampleBounds = film->GetSampleBounds();
+		int sampleWidth = sampleBounds.pMax.x - sampleBounds.pMin.x;
+		std::unique_ptr<std::atomic<int>[]> counts(
+			new std::atomic<int>[sampleBounds.Area()]);
+		for (int i = 0; i < sampleBounds.Area(); ++i) counts[i] = 0;
+		ParallelFor([&](int64_t b) {
+			const CvPathRecording::Block &block = blocks[b];
+			MemoryArena arena;
+			std::unique_ptr<CvFilmTile> filmTile =
+				film->GetCvFilmTile(block.sampleBounds);
+			const char *data = block.data;
+			for (int n = 0; n < block.nPaths; ++n) {
+				CvPathHeader header;
+				memcpy(&header, data, sizeof(header));
+				data += sizeof(header);
+				CvSample sample = ReshadePath(
+					(const CvPathVertex *)data, header.nVertices, arena);
+				data += header.nVertices * sizeof(CvPathVertex);
+				filmTile->AddSample(header.pFilm, sample, header.rayWeight);
+				Point2i pixel = (Point2i)Floor(header.pFilm);
+				if (InsideExclusive(pixel, sampleBounds))
+					++counts[(pixel.y - sampleBounds.pMin.y) * sampleWidth +
+							 (pixel.x - sampleBounds.pMin.x)];
+				arena.Reset();
+			}
+			film->MergeFilmTile(std::move(filmTile));
+			reporter.Update();
+		}, blocks.size());
+		reporter.Done();
+		film->SetPixelSamples(
+			sampleBounds,
+			std::vector<int>(counts.get(), counts.get() + sampleBounds.Area()));
 	}
 
 	Integrator *CreateCvPathIntegrator(const ParamSet &params,
 									   std::shared_ptr<Sampler> sampler,
-									   std::shared_ptr<const Camera> camera) {
+									   std::shared_ptr<const Camera> camera,
+									   const std::vector<std::shared_ptr<Primitive>> &primitives) {
 		int maxDepth = params.FindOneInt("maxdepth", 5);
+		// Let pixel samplers precompute every dimension block of the path
+		// rather than fall back to random samples past their default
+		sampler->RequestSampledDimensions(Sampler::CameraDimensions +
+										  maxDepth * Sampler::BounceDimensions);
 		int np;
 		const int *pb = params.FindInt("pixelbounds", &np);
 		Bounds2i pixelBounds = camera->film->GetSampleBounds();
@@ -272,7 +899,37 @@ namespace pbrt {
 		}
 		Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
 		std::string lightStrategy = params.FindOneString("lightsamplestrategy", "spatial");
+		Float adaptiveThreshold = params.FindOneFloat("adaptivethreshold", 0.);
+		int adaptivePassSamples = params.FindOneInt("adaptivepasssamples", 16);
+		Float adaptiveTime = params.FindOneFloat("adaptivetime", 0.);
+		Float checkpointInterval = params.FindOneFloat("checkpointinterval", 0.);
+		std::string checkpointFile = params.FindOneString("checkpointfile", "");
+		std::string recordFile = params.FindOneString("recordpaths", "");
+		std::string reshadeFile = params.FindOneFilename("reshade", "");
+		if (!recordFile.empty() && !reshadeFile.empty()) {
+			Error("\"recordpaths\" and \"reshade\" are mutually exclusive. "
+				  "Ignoring \"recordpaths\".");
+			recordFile = "";
+		}
+		if (adaptivePassSamples < 1) {
+			Error("\"adaptivepasssamples\" must be positive. Using 16.");
+			adaptivePassSamples = 16;
+		}
+		// Region of interest: probe paths per pixel, and the samples per
+		// pixel of tiles where no probe reaches a variant material
+		int roiProbeSamples = params.FindOneInt("roiprobesamples", 0);
+		int roiFillSamples = params.FindOneInt(
+			"roifillsamples",
+			(int)std::max<int64_t>(1, sampler->samplesPerPixel / 16));
+		if (roiFillSamples < 1) {
+			Error("\"roifillsamples\" must be positive. Using 1.");
+			roiFillSamples = 1;
+		}
 		return new CvPathIntegrator(maxDepth, camera, sampler, pixelBounds,
-									rrThreshold, lightStrategy);
+									rrThreshold, lightStrategy,
+									adaptiveThreshold, adaptivePassSamples,
+									adaptiveTime, checkpointInterval,
+									checkpointFile, recordFile, reshadeFile,
+									primitives, roiProbeSamples, roiFillSamples);
 	}
 }  // namespace pbrt
@@ -14,9 +14,13 @@
 #include "lightdistrib.h"
 
 #include "cv_pixel.h"
+#include "cv_record.h"
+#include <unordered_map>
 
 namespace pbrt {
 
+class CvFilm;
+
 // PathIntegrator Declarations
 class CvPathIntegrator : public PathIntegrator {
 public:
@@ -25,18 +29,84 @@ public:
                      std::shared_ptr<const Camera> camera,
                      std::shared_ptr<Sampler> sampler,
                      const Bounds2i &pixelBounds, Float rrThreshold,
-                     const std::string &lightSampleStrategy);
+                     const std::string &lightSampleStrategy,
+                     Float adaptiveThreshold = 0, int adaptivePassSamples = 16,
+                     Float adaptiveTime = 0, Float checkpointInterval = 0,
+                     const std::string &checkpointFile = "",
+                     const std::string &recordFile = "",
+                     const std::string &reshadeFile = "",
+                     const std::vector<std::shared_ptr<Primitive>> &primitives = {},
+                     int roiProbeSamples = 0, int roiFillSamples = 1);
 
     void Render(const Scene &scene) final override;
 
-    CvDualPixel LiControlVariate(const RayDifferential &ray,
-                                 const Scene &scene, Sampler &sampler,
-								 MemoryArena &arena,int depth = 0) const;
+    // Traces a path for all material variants; if _path_ is given, the
+    // path's vertices are appended to it for re-shading
+    CvSample LiControlVariate(const RayDifferential &ray,
+                             const Scene &scene, Sampler &sampler,
+                             MemoryArena &arena, int depth = 0,
+                             std::vector<CvPathVertex> *path = nullptr) const;
+    // Evaluates this scene's materials along a recorded path
+    CvSample ReshadePath(const CvPathVertex *vertices, int nVertices,
+                         MemoryArena &arena) const;
+    // Follows a path like _LiControlVariate()_, without light sampling or
+    // Russian roulette, and returns whether it reaches a surface whose
+    // material has variants within the maximum depth
+    bool ReachesVariant(const RayDifferential &ray, const Scene &scene,
+                        Sampler &sampler, MemoryArena &arena) const;
+
+private:
+    // Material variant count and difference baseline, taken from the film
+    int nVariants = 1, baseline = 0;
+    // Whether any light has variants; all variants are then tracked from
+    // the camera on
+    bool lightVariants = false;
+    // Adaptive sampling is enabled by a positive relative error threshold
+    const Float adaptiveThreshold;
+    const int adaptivePassSamples;
+    const Float adaptiveTime;
+    // Seconds between checkpoints of the film and the sampling progress,
+    // given by "float checkpointinterval"; zero, the default, disables
+    // them. With checkpoints, the image renders in passes of
+    // _adaptivePassSamples_ and a checkpoint is written to
+    // "string checkpointfile", by default the film's filename with a
+    // .cvckpt suffix, which pbrt --resume continues from. Tile samplers
+    // are reseeded every pass, so pixel samplers like "stratified" get a
+    // new stratification in each pass; a resumed render takes the same
+    // samples as an uninterrupted one only with the "random" sampler and
+    // global samplers.
+    const Float checkpointInterval;
+    const std::string checkpointFile;
+    // Path recording and re-shading; primitives are identified by their
+    // index in the scene description
+    const std::string recordFile, reshadeFile;
+    std::vector<std::shared_ptr<Primitive>> primitives;
+    std::unordered_map<const Primitive *, int> primitiveIds;
+    // Region of interest rendering, enabled by a positive number of probe
+    // paths per pixel: only tiles where a probe reaches a variant material
+    // get all samples, the others _roiFillSamples_ per pixel. The probe
+    // paths are part of the sampler's samples per pixel.
+    const int roiProbeSamples, roiFillSamples;
+
+    void Reshade(const CvPathRecording &recording, CvFilm *film);
 };
 
+// Variant counterpart of _UniformSampleOneLight()_; consumes the same
+// sample dimensions and returns direct lighting for _nVariants_ variants
+// in _Ld_. The light and BSDF samples are shared by the variants and drawn
+// with variant 0's BSDF and light; variants beyond _bsdfs_' count use
+// variant 0's BSDF. If _record_ is given, the samples are stored in it.
+void UniformSampleOneLightVariants(const SurfaceInteraction &isect,
+                                   const VariantBSDF &bsdfs, int nVariants,
+                                   const Scene &scene, Sampler &sampler,
+                                   const Distribution1D *lightDistrib,
+                                   Spectrum *Ld,
+                                   CvPathVertex *record = nullptr);
+
 Integrator *CreateCvPathIntegrator(const ParamSet &params,
                                    std::shared_ptr<Sampler> sampler,
-                                   std::shared_ptr<const Camera> camera);
+                                   std::shared_ptr<const Camera> camera,
+                                   const std::vector<std::shared_ptr<Primitive>> &primitives);
 
 }  // namespace pbrt
 
@@ -1,61 +1,93 @@
 #include "cv_pixel.h"
+#include <iostream>
 
 namespace pbrt {
 
-CvDualPixel::CvDualPixel() {
-    SetZero();
+CvSample::CvSample(const Spectrum *L_, int nVariants, Float reciprocal_pdf,
+                   int pathLength)
+    : reciprocal_pdf(reciprocal_pdf), pathLength(pathLength) {
+    CHECK_LE(nVariants, MaxVariants);
+    for (int i = 0; i < nVariants; ++i) L[i] = L_[i];
 }
 
-CvDualPixel::CvDualPixel(const Spectrum &L1_, const Spectrum &L2_, Float recip_pdf)
-    : CvDualPixel() {
-    L1 = L1_ * recip_pdf;
-    L2 = L2_ * recip_pdf;
-    L1square =  L1_ * L1_ * recip_pdf* recip_pdf;
-    L2square =  L2_ * L2_ * recip_pdf* recip_pdf;
-    reciprocal_pdf = recip_pdf;
-    Spectrum d = L1_ - L2_;
-    D = d * recip_pdf;
-    Dsquare = d * d * recip_pdf * recip_pdf;
-    filterWeightSum = 0.f;
+CvPixelBuffer::CvPixelBuffer(const CvChannels &channels, int nPixels)
+    : channels(channels), nPixels(std::max(0, nPixels)) {
+    CHECK(channels.nVariants >= 1 && channels.nVariants <= MaxVariants);
+    CHECK(channels.baseline >= 0 && channels.baseline < channels.nVariants);
+    spectra.resize(3 * channels.NumSpectra() * this->nPixels, 0.f);
+    weightSums.resize(this->nPixels, 0.f);
+    if (channels.reciprocalPdf) reciprocalPdfs.resize(this->nPixels, 0.f);
 }
 
-CvDualPixel::CvDualPixel(const CvDualPixel &p)
-    : CvDualPixel() {
-    this->operator=(p);
+void CvPixelBuffer::AddSample(int pixel, const CvSample &sample,
+                              Float weight) {
+    const int nVariants = channels.nVariants;
+    Float rgb[MaxVariants][3];
+    for (int i = 0; i < nVariants; ++i) {
+        sample.L[i].ToRGB(rgb[i]);
+        Float *L = &spectra[3 * (channels.RadianceChannel(i) * nPixels + pixel)];
+        for (int c = 0; c < 3; ++c) L[c] += weight * rgb[i][c];
+    }
+    if (channels.secondMoments) {
+        const Float *Lb = rgb[channels.baseline];
+        for (int i = 0; i < nVariants; ++i) {
+            Float *Lsq = &spectra[3 * (channels.SquareChannel(i) * nPixels + pixel)];
+            for (int c = 0; c < 3; ++c) Lsq[c] += weight * (rgb[i][c] * rgb[i][c]);
+            if (i == channels.baseline) continue;
+            Float *Lx = &spectra[3 * (channels.CrossChannel(i) * nPixels + pixel)];
+            for (int c = 0; c < 3; ++c) Lx[c] += weight * (rgb[i][c] * Lb[c]);
+        }
+    }
+    weightSums[pixel] += weight;
+    if (channels.reciprocalPdf)
+        reciprocalPdfs[pixel] += weight * sample.reciprocal_pdf;
 }
 
-CvDualPixel &CvDualPixel::operator=(const CvDualPixel &p) {
-    this->L1 = p.L1;
-    this->L2 = p.L2;
-    this->D = p.D;
-    this->L1square = p.L1square;
-    this->L2square = p.L2square;
-    this->Dsquare = p.Dsquare;
-    this->reciprocal_pdf = p.reciprocal_pdf;
-    this->filterWeightSum = p.filterWeightSum;
-    return *this;
+void CvPixelBuffer::Clear() {
+    std::fill(spectra.begin(), spectra.end(), 0.f);
+    std::fill(weightSums.begin(), weightSums.end(), 0.f);
+    std::fill(reciprocalPdfs.begin(), reciprocalPdfs.end(), 0.f);
 }
 
-void CvDualPixel::SetZero() {
-    L1 = Spectrum(0.f);
-    L2 = Spectrum(0.f);
-    D = Spectrum(0.f);
-    L1square = Spectrum(0.f);
-    L2square = Spectrum(0.f);
-    Dsquare = Spectrum(0.f);
-    reciprocal_pdf = Float(0.f);
-    filterWeightSum = Float(0.f);
+void CvPixelBuffer::AddPixels(int pixel, const CvPixelBuffer &src,
+                              int srcPixel, int n) {
+    CHECK_EQ(channels.NumSpectra(), src.channels.NumSpectra());
+    CHECK_EQ(channels.reciprocalPdf, src.channels.reciprocalPdf);
+    for (int ch = 0; ch < channels.NumSpectra(); ++ch) {
+        Float *d = &spectra[3 * (ch * nPixels + pixel)];
+        const Float *s = &src.spectra[3 * (ch * src.nPixels + srcPixel)];
+        for (int i = 0; i < 3 * n; ++i) d[i] += s[i];
+    }
+    for (int i = 0; i < n; ++i)
+        weightSums[pixel + i] += src.weightSums[srcPixel + i];
+    if (channels.reciprocalPdf)
+        for (int i = 0; i < n; ++i)
+            reciprocalPdfs[pixel + i] += src.reciprocalPdfs[srcPixel + i];
 }
 
-void CvDualPixel::AddPixel(const CvDualPixel &p, Float filterWeight) {
-    L1 += filterWeight * p.L1;
-    L2 += filterWeight * p.L2;
-    D += filterWeight * p.D;
-    L1square += filterWeight * p.L1square;
-    L2square += filterWeight * p.L2square;
-    Dsquare += filterWeight * p.Dsquare;
-    reciprocal_pdf += filterWeight * p.reciprocal_pdf;
-    filterWeightSum += filterWeight;
+void CvPixelBuffer::Write(std::ostream &out) const {
+    int32_t header[5] = {channels.nVariants, channels.baseline,
+                         channels.secondMoments, channels.reciprocalPdf,
+                         nPixels};
+    out.write((const char *)header, sizeof(header));
+    out.write((const char *)spectra.data(), spectra.size() * sizeof(Float));
+    out.write((const char *)weightSums.data(), weightSums.size() * sizeof(Float));
+    out.write((const char *)reciprocalPdfs.data(),
+              reciprocalPdfs.size() * sizeof(Float));
+}
+
+bool CvPixelBuffer::Read(std::istream &in) {
+    int32_t header[5];
+    if (!in.read((char *)header, sizeof(header))) return false;
+    if (header[0] != channels.nVariants || header[1] != channels.baseline ||
+        header[2] != (int32_t)channels.secondMoments ||
+        header[3] != (int32_t)channels.reciprocalPdf || header[4] != nPixels)
+        return false;
+    in.read((char *)spectra.data(), spectra.size() * sizeof(Float));
+    in.read((char *)weightSums.data(), weightSums.size() * sizeof(Float));
+    in.read((char *)reciprocalPdfs.data(),
+            reciprocalPdfs.size() * sizeof(Float));
+    return (bool)in;
 }
 
 }  // namespace pbrt
@@ -7,34 +7,100 @@
 #define PBRT_CV_PIXEL_H
 
 #include "spectrum.h"
+#include "variantmat.h"
 
 namespace pbrt {
 
-class CvDualPixel {
-public:
-    CvDualPixel();
-    CvDualPixel(const Spectrum &L1, const Spectrum &L2, Float reciprocal_pdf);
-    CvDualPixel(const CvDualPixel &p);
-    /*CvDualPixel operator+(const CvDualPixel &p){
-        return CvDualPixel(L1 + p.L1, L2 + p.L2, reciprocal_pdf + p.reciprocal_pdf);
+// Radiance estimates of every material variant for one camera sample;
+// _reciprocal_pdf_ is that sample's path PDF and _pathLength_ its number
+// of bounces, kept for diagnostics
+struct CvSample {
+    CvSample() : reciprocal_pdf(0), pathLength(0) {}
+    CvSample(const Spectrum *L, int nVariants, Float reciprocal_pdf,
+             int pathLength = 0);
+
+    Spectrum L[MaxVariants];
+    Float reciprocal_pdf;
+    int pathLength;
+};
+
+// Which per-pixel accumulators a control-variate film keeps. Per-variant
+// radiance and the filter weight sum are always kept. Differences against
+// the baseline and their second moments are not stored: they follow from
+// the radiance sums, the squares and the cross moments with the baseline.
+struct CvChannels {
+    int nVariants = 2, baseline = 1;
+    // Per-variant squares and cross moments with the baseline, needed for
+    // variances, alpha and adaptive sampling
+    bool secondMoments = true;
+    bool reciprocalPdf = true;
+
+    // Number of RGB channels
+    int NumSpectra() const {
+        return secondMoments ? 3 * nVariants - 1 : nVariants;
     }
-    CvDualPixel operator/(const float p) {
-        return CvDualPixel(L1 / p, L2 / p, reciprocal_pdf / p);
-    }*/
-    CvDualPixel &operator=(const CvDualPixel &p);
+    int RadianceChannel(int variant) const { return variant; }
+    int SquareChannel(int variant) const { return nVariants + variant; }
+    int CrossChannel(int variant) const {
+        // The baseline's cross moment with itself is its square
+        if (variant == baseline) return SquareChannel(variant);
+        return 2 * nVariants + (variant < baseline ? variant : variant - 1);
+    }
+};
 
-    void SetZero();
-    void AddPixel(const CvDualPixel &p, Float filterWeight = 1.);
+// Control-variate accumulators for a rectangle of pixels, stored channel
+// by channel so that merges stream through contiguous arrays. Pixels are
+// indexed in scanline order.
+class CvPixelBuffer {
+  public:
+    CvPixelBuffer(const CvChannels &channels, int nPixels);
 
-private:
-    Spectrum L1, L2, D, L1square, L2square, Dsquare;
-    Float reciprocal_pdf;
-    Float filterWeightSum;
+    void AddSample(int pixel, const CvSample &sample, Float weight);
+    void Clear();
+    // Adds pixels [srcPixel, srcPixel + n) of _src_ to [pixel, pixel + n)
+    void AddPixels(int pixel, const CvPixelBuffer &src, int srcPixel, int n);
+    // Raw accumulators for checkpoints; Read() fails unless the stream
+    // holds a buffer with the same channels and pixel count
+    void Write(std::ostream &out) const;
+    bool Read(std::istream &in);
+
+    // Accumulated (unnormalized) quantities
+    Float WeightSum(int pixel) const { return weightSums[pixel]; }
+    Float ReciprocalPdf(int pixel) const {
+        return channels.reciprocalPdf ? reciprocalPdfs[pixel] : 0;
+    }
+    RGBSpectrum Radiance(int pixel, int variant) const {
+        return Get(channels.RadianceChannel(variant), pixel);
+    }
+    RGBSpectrum Square(int pixel, int variant) const {
+        return Get(channels.SquareChannel(variant), pixel);
+    }
+    RGBSpectrum Cross(int pixel, int variant) const {
+        return Get(channels.CrossChannel(variant), pixel);
+    }
+    RGBSpectrum Difference(int pixel, int variant) const {
+        return Radiance(pixel, variant) - Radiance(pixel, channels.baseline);
+    }
+    RGBSpectrum DifferenceSquare(int pixel, int variant) const {
+        // (L_i - L_b)^2 = L_i^2 - 2 L_i L_b + L_b^2, clamped against
+        // cancellation
+        RGBSpectrum d = Square(pixel, variant) - 2 * Cross(pixel, variant) +
+                        Square(pixel, channels.baseline);
+        return d.Clamp();
+    }
+
+    const CvChannels channels;
+
+  private:
+    RGBSpectrum Get(int channel, int pixel) const {
+        DCHECK_LT(channel, channels.NumSpectra());
+        return RGBSpectrum::FromRGB(&spectra[3 * (channel * nPixels + pixel)]);
+    }
 
-    friend class CvFilm;
-    friend class CvFilmTile;
+    int nPixels;
+    std::vector<Float> spectra, weightSums, reciprocalPdfs;
 };
 
 }  // namespace pbrt
 
-#endif  //
+#endif  // PBRT_CV_PIXEL_H
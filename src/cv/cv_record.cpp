@@ -0,0 +1,142 @@
+#include "cv_record.h"
+
+#include <cstring>
+#ifndef PBRT_IS_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Recorded CV paths", recordedBytes);
+
+// Recordings start with a magic number and a format version, followed by
+// the sizes of _Float_ and _Spectrum_ and the number of primitives of the
+// recorded scene. Each block then has a header of its sample bounds, its
+// number of paths and its size in bytes.
+static const char recordingMagic[8] = {'P', 'B', 'R', 'T', 'C', 'V', 'P', 'R'};
+static const int32_t recordingVersion = 1;
+
+CvPathRecorder::CvPathRecorder(const std::string &filename, int nPrimitives)
+    : filename(filename), out(filename, std::ios::binary) {
+    if (!out) {
+        Error("Unable to open path recording file \"%s\"", filename.c_str());
+        return;
+    }
+    int32_t header[4] = {recordingVersion, (int32_t)sizeof(Float),
+                         (int32_t)sizeof(Spectrum), nPrimitives};
+    out.write(recordingMagic, sizeof(recordingMagic));
+    out.write((const char *)header, sizeof(header));
+}
+
+void CvPathRecorder::AddPath(std::vector<char> *block, const Point2f &pFilm,
+                             Float rayWeight,
+                             const std::vector<CvPathVertex> &vertices) {
+    CvPathHeader header{pFilm, rayWeight, (int32_t)vertices.size()};
+    size_t offset = block->size();
+    size_t vertexBytes = vertices.size() * sizeof(CvPathVertex);
+    block->resize(offset + sizeof(header) + vertexBytes);
+    memcpy(&(*block)[offset], &header, sizeof(header));
+    if (vertexBytes > 0)
+        memcpy(&(*block)[offset + sizeof(header)], vertices.data(),
+               vertexBytes);
+}
+
+void CvPathRecorder::WriteBlock(const Bounds2i &sampleBounds, int nPaths,
+                                const std::vector<char> &block) {
+    int32_t header[6] = {sampleBounds.pMin.x, sampleBounds.pMin.y,
+                         sampleBounds.pMax.x, sampleBounds.pMax.y, nPaths, 0};
+    int64_t size = block.size();
+    std::lock_guard<std::mutex> lock(mutex);
+    out.write((const char *)header, sizeof(header));
+    out.write((const char *)&size, sizeof(size));
+    out.write(block.data(), block.size());
+    if (!out) Error("Error writing path recording \"%s\"", filename.c_str());
+    recordedBytes += sizeof(header) + sizeof(size) + size;
+}
+
+CvPathRecording::~CvPathRecording() {
+#ifndef PBRT_IS_WINDOWS
+    if (mapped) {
+        munmap((void *)data, size);
+        return;
+    }
+#endif
+    delete[] data;
+}
+
+std::unique_ptr<CvPathRecording> CvPathRecording::Open(
+    const std::string &filename) {
+    std::unique_ptr<CvPathRecording> rec(new CvPathRecording);
+#ifndef PBRT_IS_WINDOWS
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            rec->data = (const char *)ptr;
+            rec->size = st.st_size;
+            rec->mapped = true;
+        }
+    }
+    if (fd >= 0) close(fd);
+#endif
+    if (!rec->data) {
+        // Fall back to reading the whole file
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (!in) {
+            Error("Unable to open path recording \"%s\"", filename.c_str());
+            return nullptr;
+        }
+        rec->size = in.tellg();
+        char *buf = new char[rec->size];
+        in.seekg(0);
+        in.read(buf, rec->size);
+        rec->data = buf;
+    }
+
+    // Check the file header and index the blocks
+    int32_t header[4];
+    size_t offset = sizeof(recordingMagic) + sizeof(header);
+    if (rec->size < offset ||
+        memcmp(rec->data, recordingMagic, sizeof(recordingMagic)) != 0) {
+        Error("\"%s\" is not a path recording", filename.c_str());
+        return nullptr;
+    }
+    memcpy(header, rec->data + sizeof(recordingMagic), sizeof(header));
+    if (header[0] != recordingVersion || header[1] != (int32_t)sizeof(Float) ||
+        header[2] != (int32_t)sizeof(Spectrum)) {
+        Error("Path recording \"%s\" was written by an incompatible pbrt build",
+              filename.c_str());
+        return nullptr;
+    }
+    rec->nPrimitives = header[3];
+    while (offset < rec->size) {
+        int32_t blockHeader[6];
+        int64_t blockSize;
+        if (offset + sizeof(blockHeader) + sizeof(blockSize) > rec->size)
+            break;
+        memcpy(blockHeader, rec->data + offset, sizeof(blockHeader));
+        memcpy(&blockSize, rec->data + offset + sizeof(blockHeader),
+               sizeof(blockSize));
+        offset += sizeof(blockHeader) + sizeof(blockSize);
+        if (offset + blockSize > rec->size) break;
+        Block block;
+        block.sampleBounds = Bounds2i(Point2i(blockHeader[0], blockHeader[1]),
+                                      Point2i(blockHeader[2], blockHeader[3]));
+        block.nPaths = blockHeader[4];
+        block.data = rec->data + offset;
+        rec->blocks.push_back(block);
+        offset += blockSize;
+    }
+    if (offset != rec->size)
+        Warning("Path recording \"%s\" is truncated; using its first %d "
+                "blocks.", filename.c_str(), (int)rec->blocks.size());
+    return rec;
+}
+
+}  // namespace pbrt
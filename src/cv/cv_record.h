@@ -0,0 +1,105 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CV_RECORD_H
+#define PBRT_CV_RECORD_H
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "spectrum.h"
+#include <fstream>
+#include <mutex>
+
+namespace pbrt {
+
+// One scattering vertex of a path recorded by _CvPathIntegrator_. It holds
+// what is needed to evaluate a different material at the vertex and to
+// re-weight the recorded light and continuation samples, so that paths can
+// be re-shaded without tracing rays.
+struct CvPathVertex {
+    // Index of the intersected primitive in scene description order; -1
+    // if there is no surface to shade (the ray escaped or the maximum depth
+    // was reached) and only _Le_ applies
+    int32_t primitive;
+    // _BxDFType_ sampled to continue the path; 0 if the path ends here
+    int32_t sampledType;
+    // Emitted radiance added at this vertex
+    Spectrum Le;
+    // Surface geometry used by materials and textures
+    Point3f p;
+    Normal3f n;
+    Point2f uv;
+    Vector3f wo;
+    Normal3f ns;
+    Vector3f dpdus, dpdvs;
+    Normal3f dndus, dndvs;
+    // Direct lighting: for the light sample and the BSDF sample, the
+    // direction and the incident radiance times its MIS weight over its
+    // PDFs, black if the sample was occluded or not taken
+    Vector3f wiLight, wiBsdf;
+    Spectrum LdLight, LdBsdf;
+    // Path continuation: direction, PDF and sample values of the recorded
+    // BSDF sample, and the Russian roulette weight applied afterwards
+    Vector3f wi;
+    Float pdf;
+    Point2f u;
+    Float rrWeight;
+};
+
+// Camera sample heading each recorded path in a block
+struct CvPathHeader {
+    Point2f pFilm;
+    Float rayWeight;
+    int32_t nVertices;
+};
+
+// Appends blocks of recorded paths, one per rendered image tile, to a file
+class CvPathRecorder {
+  public:
+    CvPathRecorder(const std::string &filename, int nPrimitives);
+    bool IsValid() const { return (bool)out; }
+
+    // Appends a path to a tile's _block_
+    static void AddPath(std::vector<char> *block, const Point2f &pFilm,
+                        Float rayWeight,
+                        const std::vector<CvPathVertex> &vertices);
+    void WriteBlock(const Bounds2i &sampleBounds, int nPaths,
+                    const std::vector<char> &block);
+
+  private:
+    const std::string filename;
+    std::mutex mutex;
+    std::ofstream out;
+};
+
+// Read-only view of a recording. The file is memory-mapped where the
+// platform supports it.
+class CvPathRecording {
+  public:
+    struct Block {
+        Bounds2i sampleBounds;
+        int nPaths;
+        const char *data;
+    };
+
+    ~CvPathRecording();
+    static std::unique_ptr<CvPathRecording> Open(const std::string &filename);
+
+    int NumPrimitives() const { return nPrimitives; }
+    const std::vector<Block> &Blocks() const { return blocks; }
+
+  private:
+    CvPathRecording() = default;
+
+    const char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    int nPrimitives = 0;
+    std::vector<Block> blocks;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_CV_RECORD_H
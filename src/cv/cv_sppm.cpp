@@ -0,0 +1,542 @@
+// cv/cv_sppm.cpp*
+#include "cv_sppm.h"
+#include "parallel.h"
+#include "scene.h"
+#include "spectrum.h"
+#include "paramset.h"
+#include "progressreporter.h"
+#include "interaction.h"
+#include "sampling.h"
+#include "samplers/halton.h"
+#include "stats.h"
+
+#include "cv_film.h"
+#include "cv_integrator.h"
+#include "variantmat.h"
+#include "variantlight.h"
+
+namespace pbrt {
+
+STAT_RATIO(
+    "Stochastic Progressive Photon Mapping/Visible points checked per photon "
+    "intersection",
+    visiblePointsChecked, totalPhotonSurfaceInteractions);
+STAT_COUNTER("Stochastic Progressive Photon Mapping/Photon paths followed",
+             photonPaths);
+STAT_MEMORY_COUNTER("Memory/CV SPPM Pixels", pixelMemoryBytes);
+
+namespace {
+
+// SPPM state of a pixel that all material variants share: the visible
+// point's location, the search radius and the photon counts. Paths and
+// photons are traced once for all variants, so these do not depend on
+// the variant.
+struct CvSPPMPixel {
+    CvSPPMPixel() : M(0) {}
+
+    Float radius = 0;
+    Point3f p;
+    Vector3f wo;
+    std::atomic<int> M;
+    Float N = 0;
+};
+
+// SPPM state of a pixel for one material variant: its direct lighting,
+// the visible point's throughput and BSDF, and the photon flux
+struct CvSPPMChannel {
+    Spectrum Ld;
+    const BSDF *bsdf = nullptr;
+    Spectrum beta;
+    AtomicFloat Phi[Spectrum::nSamples];
+    Spectrum tau;
+};
+
+struct CvSPPMPixelListNode {
+    int pixel;
+    CvSPPMPixelListNode *next;
+};
+
+bool ToGrid(const Point3f &p, const Bounds3f &bounds, const int gridRes[3],
+            Point3i *pi) {
+    bool inBounds = true;
+    Vector3f pg = bounds.Offset(p);
+    for (int i = 0; i < 3; ++i) {
+        (*pi)[i] = (int)(gridRes[i] * pg[i]);
+        inBounds &= ((*pi)[i] >= 0 && (*pi)[i] < gridRes[i]);
+        (*pi)[i] = Clamp((*pi)[i], 0, gridRes[i] - 1);
+    }
+    return inBounds;
+}
+
+inline unsigned int hash(const Point3i &p, int hashSize) {
+    return (unsigned int)((p.x * 73856093) ^ (p.y * 19349663) ^
+                          (p.z * 83492791)) %
+           hashSize;
+}
+
+// Returns variant _i_'s BSDF value for a direction sampled from variant
+// 0's BSDF with value _f0_. Specular lobes cannot be evaluated for a given
+// direction, but variants sharing variant 0's BSDF have its value.
+inline Spectrum VariantValue(const VariantBSDF &bsdfs, int i,
+                             const Spectrum &f0, const Vector3f &wo,
+                             const Vector3f &wi) {
+    if (!bsdfs.HasVariants() || bsdfs.bsdf[i] == bsdfs.bsdf[0]) return f0;
+    return bsdfs.bsdf[i] ? bsdfs.bsdf[i]->f(wo, wi) : Spectrum(0.f);
+}
+
+inline Float MaxLuminance(const Spectrum *betas, int nVariants) {
+    Float y = 0;
+    for (int i = 0; i < nVariants; ++i) y = std::max(y, betas[i].y());
+    return y;
+}
+
+}  // anonymous namespace
+
+// CvSPPMIntegrator Method Definitions
+void CvSPPMIntegrator::Render(const Scene &scene) {
+    ProfilePhase p(Prof::IntegratorRender);
+    CvFilm *film = dynamic_cast<CvFilm *>(camera->film);
+    if (!film) {
+        Error("The \"cvsppm\" integrator needs a \"cv\" film.");
+        return;
+    }
+    const int nVariants = film->nVariants;
+    if (nVariants > 1 && HasLightVariants(scene))
+        Warning("The \"cvsppm\" integrator only renders the first variant of "
+                "lights with variants; use \"cv\" to compare them.");
+    // Initialize _pixelBounds_, the shared _pixels_ and the per-variant
+    // _channels_ of every pixel
+    Bounds2i pixelBounds = film->croppedPixelBounds;
+    int nPixels = pixelBounds.Area();
+    std::unique_ptr<CvSPPMPixel[]> pixels(new CvSPPMPixel[nPixels]);
+    std::unique_ptr<CvSPPMChannel[]> channels(
+        new CvSPPMChannel[nPixels * nVariants]);
+    for (int i = 0; i < nPixels; ++i) pixels[i].radius = initialSearchRadius;
+    const Float invSqrtSPP = 1.f / std::sqrt(nIterations);
+    pixelMemoryBytes =
+        nPixels * (sizeof(CvSPPMPixel) + nVariants * sizeof(CvSPPMChannel));
+    auto hasVisiblePoint = [&](int pixel) {
+        for (int i = 0; i < nVariants; ++i)
+            if (!channels[pixel * nVariants + i].beta.IsBlack()) return true;
+        return false;
+    };
+    // Compute _lightDistr_ for sampling lights proportional to power
+    std::unique_ptr<Distribution1D> lightDistr =
+        ComputeLightPowerDistribution(scene);
+
+    // Perform _nIterations_ of SPPM integration
+    HaltonSampler sampler(nIterations, pixelBounds);
+
+    // Compute number of tiles to use for SPPM camera pass
+    Vector2i pixelExtent = pixelBounds.Diagonal();
+    const int tileSize = 16;
+    Point2i nTiles((pixelExtent.x + tileSize - 1) / tileSize,
+                   (pixelExtent.y + tileSize - 1) / tileSize);
+    ProgressReporter progress(2 * nIterations, "Rendering");
+    for (int iter = 0; iter < nIterations; ++iter) {
+        // Generate SPPM visible points
+        std::vector<MemoryArena> perThreadArenas(MaxThreadIndex());
+        {
+            ProfilePhase _(Prof::SPPMCameraPass);
+            ParallelFor2D([&](Point2i tile) {
+                MemoryArena &arena = perThreadArenas[ThreadIndex];
+                // Follow camera paths for _tile_ in image for SPPM
+                int tileIndex = tile.y * nTiles.x + tile.x;
+                std::unique_ptr<Sampler> tileSampler = sampler.Clone(tileIndex);
+
+                // Compute _tileBounds_ for SPPM tile
+                int x0 = pixelBounds.pMin.x + tile.x * tileSize;
+                int x1 = std::min(x0 + tileSize, pixelBounds.pMax.x);
+                int y0 = pixelBounds.pMin.y + tile.y * tileSize;
+                int y1 = std::min(y0 + tileSize, pixelBounds.pMax.y);
+                Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+                for (Point2i pPixel : tileBounds) {
+                    // Prepare _tileSampler_ for _pPixel_
+                    tileSampler->StartPixel(pPixel);
+                    tileSampler->SetSampleNumber(iter);
+
+                    // Generate camera ray for pixel for SPPM
+                    CameraSample cameraSample =
+                        tileSampler->GetCameraSample(pPixel);
+                    RayDifferential ray;
+                    Spectrum beta =
+                        camera->GenerateRayDifferential(cameraSample, &ray);
+                    ray.ScaleDifferentials(invSqrtSPP);
+
+                    // Follow camera ray path until a visible point is
+                    // created; the path is sampled with variant 0 and every
+                    // variant carries its own throughput
+                    Point2i pPixelO = Point2i(pPixel - pixelBounds.pMin);
+                    int pixelOffset =
+                        pPixelO.x +
+                        pPixelO.y * (pixelBounds.pMax.x - pixelBounds.pMin.x);
+                    CvSPPMPixel &pixel = pixels[pixelOffset];
+                    CvSPPMChannel *pixelChannels =
+                        &channels[pixelOffset * nVariants];
+                    Spectrum betas[MaxVariants];
+                    for (int i = 0; i < nVariants; ++i) betas[i] = beta;
+                    bool specularBounce = false;
+                    for (int depth = 0; depth < maxDepth; ++depth) {
+                        SurfaceInteraction isect;
+                        ++totalPhotonSurfaceInteractions;
+                        if (!scene.Intersect(ray, &isect)) {
+                            // Accumulate light contributions for ray with no
+                            // intersection
+                            for (const auto &light : scene.lights) {
+                                Spectrum Le = light->Le(ray);
+                                for (int i = 0; i < nVariants; ++i)
+                                    pixelChannels[i].Ld += betas[i] * Le;
+                            }
+                            break;
+                        }
+                        // Compute the BSDFs of all variants at SPPM camera
+                        // ray intersection
+                        VariantBSDF bsdfs;
+                        ComputeVariantScatteringFunctions(&isect, ray, arena,
+                                                          nVariants, &bsdfs,
+                                                          true);
+                        if (!isect.bsdf) {
+                            ray = isect.SpawnRay(ray.d);
+                            --depth;
+                            continue;
+                        }
+                        const BSDF &bsdf = *isect.bsdf;
+
+                        // Accumulate direct illumination at SPPM camera ray
+                        // intersection
+                        Vector3f wo = -ray.d;
+                        if (depth == 0 || specularBounce) {
+                            Spectrum Le = isect.Le(wo);
+                            for (int i = 0; i < nVariants; ++i)
+                                pixelChannels[i].Ld += betas[i] * Le;
+                        }
+                        int nEval = bsdfs.HasVariants() ? nVariants : 1;
+                        Spectrum Ld[MaxVariants];
+                        UniformSampleOneLightVariants(isect, bsdfs, nEval,
+                                                      scene, *tileSampler,
+                                                      nullptr, Ld);
+                        for (int i = 0; i < nVariants; ++i)
+                            pixelChannels[i].Ld +=
+                                betas[i] * Ld[i < nEval ? i : 0];
+
+                        // Possibly create visible point and end camera path
+                        bool isDiffuse = bsdf.NumComponents(BxDFType(
+                                             BSDF_DIFFUSE | BSDF_REFLECTION |
+                                             BSDF_TRANSMISSION)) > 0;
+                        bool isGlossy = bsdf.NumComponents(BxDFType(
+                                            BSDF_GLOSSY | BSDF_REFLECTION |
+                                            BSDF_TRANSMISSION)) > 0;
+                        if (isDiffuse || (isGlossy && depth == maxDepth - 1)) {
+                            pixel.p = isect.p;
+                            pixel.wo = wo;
+                            for (int i = 0; i < nVariants; ++i) {
+                                pixelChannels[i].beta = betas[i];
+                                pixelChannels[i].bsdf =
+                                    bsdfs.HasVariants() ? bsdfs.bsdf[i] : &bsdf;
+                            }
+                            break;
+                        }
+
+                        // Spawn ray from SPPM camera path vertex
+                        if (depth < maxDepth - 1) {
+                            Float pdf;
+                            Vector3f wi;
+                            BxDFType type;
+                            Spectrum f =
+                                bsdf.Sample_f(wo, &wi, tileSampler->Get2D(),
+                                              &pdf, BSDF_ALL, &type);
+                            if (pdf == 0.) break;
+                            Float cosTheta = AbsDot(wi, isect.shading.n);
+                            bool allBlack = true;
+                            for (int i = 0; i < nVariants; ++i) {
+                                Spectrum fi = VariantValue(bsdfs, i, f, wo, wi);
+                                allBlack &= fi.IsBlack();
+                                betas[i] *= fi * cosTheta / pdf;
+                            }
+                            if (allBlack) break;
+                            specularBounce = (type & BSDF_SPECULAR) != 0;
+                            // Russian roulette on the largest throughput of
+                            // all variants
+                            Float y = MaxLuminance(betas, nVariants);
+                            if (y < 0.25) {
+                                Float continueProb = std::min((Float)1, y);
+                                if (tileSampler->Get1D() > continueProb) break;
+                                for (int i = 0; i < nVariants; ++i)
+                                    betas[i] /= continueProb;
+                            }
+                            ray = (RayDifferential)isect.SpawnRay(wi);
+                        }
+                    }
+                }
+            }, nTiles);
+        }
+        progress.Update();
+
+        // Create grid of all SPPM visible points
+        int gridRes[3];
+        Bounds3f gridBounds;
+        // Allocate grid for SPPM visible points
+        const int hashSize = nPixels;
+        std::vector<std::atomic<CvSPPMPixelListNode *>> grid(hashSize);
+        {
+            ProfilePhase _(Prof::SPPMGridConstruction);
+
+            // Compute grid bounds for SPPM visible points
+            Float maxRadius = 0.;
+            for (int i = 0; i < nPixels; ++i) {
+                const CvSPPMPixel &pixel = pixels[i];
+                if (!hasVisiblePoint(i)) continue;
+                Bounds3f vpBound = Expand(Bounds3f(pixel.p), pixel.radius);
+                gridBounds = Union(gridBounds, vpBound);
+                maxRadius = std::max(maxRadius, pixel.radius);
+            }
+
+            // Compute resolution of SPPM grid in each dimension
+            Vector3f diag = gridBounds.Diagonal();
+            Float maxDiag = MaxComponent(diag);
+            int baseGridRes = (int)(maxDiag / maxRadius);
+            CHECK_GT(baseGridRes, 0);
+            for (int i = 0; i < 3; ++i)
+                gridRes[i] = std::max((int)(baseGridRes * diag[i] / maxDiag), 1);
+
+            // Add visible points to SPPM grid
+            ParallelFor([&](int pixelIndex) {
+                MemoryArena &arena = perThreadArenas[ThreadIndex];
+                const CvSPPMPixel &pixel = pixels[pixelIndex];
+                if (hasVisiblePoint(pixelIndex)) {
+                    // Add pixel's visible point to applicable grid cells
+                    Float radius = pixel.radius;
+                    Point3i pMin, pMax;
+                    ToGrid(pixel.p - Vector3f(radius, radius, radius),
+                           gridBounds, gridRes, &pMin);
+                    ToGrid(pixel.p + Vector3f(radius, radius, radius),
+                           gridBounds, gridRes, &pMax);
+                    for (int z = pMin.z; z <= pMax.z; ++z)
+                        for (int y = pMin.y; y <= pMax.y; ++y)
+                            for (int x = pMin.x; x <= pMax.x; ++x) {
+                                // Add visible point to grid cell $(x, y, z)$
+                                int h = hash(Point3i(x, y, z), hashSize);
+                                CvSPPMPixelListNode *node =
+                                    arena.Alloc<CvSPPMPixelListNode>();
+                                node->pixel = pixelIndex;
+
+                                // Atomically add _node_ to the start of
+                                // _grid[h]_'s linked list
+                                node->next = grid[h];
+                                while (grid[h].compare_exchange_weak(
+                                           node->next, node) == false)
+                                    ;
+                            }
+                }
+            }, nPixels, 4096);
+        }
+
+        // Trace photons and accumulate contributions
+        {
+            ProfilePhase _(Prof::SPPMPhotonPass);
+            std::vector<MemoryArena> photonShootArenas(MaxThreadIndex());
+            ParallelFor([&](int photonIndex) {
+                MemoryArena &arena = photonShootArenas[ThreadIndex];
+                // Follow photon path for _photonIndex_
+                uint64_t haltonIndex =
+                    (uint64_t)iter * (uint64_t)photonsPerIteration +
+                    photonIndex;
+                int haltonDim = 0;
+
+                // Choose light to shoot photon from
+                Float lightPdf;
+                Float lightSample = RadicalInverse(haltonDim++, haltonIndex);
+                int lightNum =
+                    lightDistr->SampleDiscrete(lightSample, &lightPdf);
+                const std::shared_ptr<Light> &light = scene.lights[lightNum];
+
+                // Compute sample values for photon ray leaving light source
+                Point2f uLight0(RadicalInverse(haltonDim, haltonIndex),
+                                RadicalInverse(haltonDim + 1, haltonIndex));
+                Point2f uLight1(RadicalInverse(haltonDim + 2, haltonIndex),
+                                RadicalInverse(haltonDim + 3, haltonIndex));
+                Float uLightTime =
+                    Lerp(RadicalInverse(haltonDim + 4, haltonIndex),
+                         camera->shutterOpen, camera->shutterClose);
+                haltonDim += 5;
+
+                // Generate _photonRay_ from light source and initialize the
+                // photon throughput of every variant
+                RayDifferential photonRay;
+                Normal3f nLight;
+                Float pdfPos, pdfDir;
+                Spectrum Le =
+                    light->Sample_Le(uLight0, uLight1, uLightTime, &photonRay,
+                                     &nLight, &pdfPos, &pdfDir);
+                if (pdfPos == 0 || pdfDir == 0 || Le.IsBlack()) return;
+                Spectrum beta = (AbsDot(nLight, photonRay.d) * Le) /
+                                (lightPdf * pdfPos * pdfDir);
+                if (beta.IsBlack()) return;
+                Spectrum betas[MaxVariants];
+                for (int i = 0; i < nVariants; ++i) betas[i] = beta;
+
+                // Follow photon path through scene and record intersections
+                SurfaceInteraction isect;
+                for (int depth = 0; depth < maxDepth; ++depth) {
+                    if (!scene.Intersect(photonRay, &isect)) break;
+                    ++totalPhotonSurfaceInteractions;
+                    if (depth > 0) {
+                        // Add photon contribution to nearby visible points
+                        Point3i photonGridIndex;
+                        if (ToGrid(isect.p, gridBounds, gridRes,
+                                   &photonGridIndex)) {
+                            int h = hash(photonGridIndex, hashSize);
+                            // Add photon contribution to visible points in
+                            // _grid[h]_
+                            for (CvSPPMPixelListNode *node =
+                                     grid[h].load(std::memory_order_relaxed);
+                                 node != nullptr; node = node->next) {
+                                ++visiblePointsChecked;
+                                CvSPPMPixel &pixel = pixels[node->pixel];
+                                Float radius = pixel.radius;
+                                if (DistanceSquared(pixel.p, isect.p) >
+                                    radius * radius)
+                                    continue;
+                                // Update every variant's $\Phi$ and the
+                                // shared $M$ for nearby photon
+                                Vector3f wi = -photonRay.d;
+                                CvSPPMChannel *pixelChannels =
+                                    &channels[node->pixel * nVariants];
+                                for (int i = 0; i < nVariants; ++i) {
+                                    CvSPPMChannel &c = pixelChannels[i];
+                                    if (!c.bsdf || betas[i].IsBlack()) continue;
+                                    Spectrum Phi =
+                                        betas[i] * c.bsdf->f(pixel.wo, wi);
+                                    for (int j = 0; j < Spectrum::nSamples; ++j)
+                                        c.Phi[j].Add(Phi[j]);
+                                }
+                                ++pixel.M;
+                            }
+                        }
+                    }
+                    // Sample new photon ray direction
+
+                    // Compute the BSDFs of all variants at photon
+                    // intersection point
+                    VariantBSDF bsdfs;
+                    ComputeVariantScatteringFunctions(
+                        &isect, photonRay, arena, nVariants, &bsdfs, true,
+                        TransportMode::Importance);
+                    if (!isect.bsdf) {
+                        --depth;
+                        photonRay = isect.SpawnRay(photonRay.d);
+                        continue;
+                    }
+                    const BSDF &photonBSDF = *isect.bsdf;
+
+                    // Sample variant 0's BSDF _fr_ and direction _wi_ for
+                    // reflected photon
+                    Vector3f wi, wo = -photonRay.d;
+                    Float pdf;
+                    BxDFType flags;
+
+                    // Generate _bsdfSample_ for outgoing photon sample
+                    Point2f bsdfSample(
+                        RadicalInverse(haltonDim, haltonIndex),
+                        RadicalInverse(haltonDim + 1, haltonIndex));
+                    haltonDim += 2;
+                    Spectrum fr = photonBSDF.Sample_f(wo, &wi, bsdfSample, &pdf,
+                                                      BSDF_ALL, &flags);
+                    if (pdf == 0.f) break;
+                    Float cosTheta = AbsDot(wi, isect.shading.n);
+                    Spectrum bnew[MaxVariants];
+                    bool allBlack = true;
+                    for (int i = 0; i < nVariants; ++i) {
+                        bnew[i] = betas[i] *
+                                  VariantValue(bsdfs, i, fr, wo, wi) *
+                                  cosTheta / pdf;
+                        allBlack &= bnew[i].IsBlack();
+                    }
+                    if (allBlack) break;
+
+                    // Possibly terminate photon path with Russian roulette,
+                    // based on the largest throughput of all variants
+                    Float q = std::max((Float)0,
+                                       1 - MaxLuminance(bnew, nVariants) /
+                                               MaxLuminance(betas, nVariants));
+                    if (RadicalInverse(haltonDim++, haltonIndex) < q) break;
+                    for (int i = 0; i < nVariants; ++i)
+                        betas[i] = bnew[i] / (1 - q);
+                    photonRay = (RayDifferential)isect.SpawnRay(wi);
+                }
+                arena.Reset();
+            }, photonsPerIteration, 8192);
+            progress.Update();
+            photonPaths += photonsPerIteration;
+        }
+
+        // Update pixel values from this pass's photons
+        {
+            ProfilePhase _(Prof::SPPMStatsUpdate);
+            ParallelFor([&](int i) {
+                CvSPPMPixel &p = pixels[i];
+                CvSPPMChannel *pixelChannels = &channels[i * nVariants];
+                if (p.M > 0) {
+                    // Update pixel photon count, search radius, and every
+                    // variant's $\tau$ from photons
+                    Float gamma = (Float)2 / (Float)3;
+                    Float Nnew = p.N + gamma * p.M;
+                    Float Rnew = p.radius * std::sqrt(Nnew / (p.N + p.M));
+                    for (int v = 0; v < nVariants; ++v) {
+                        CvSPPMChannel &c = pixelChannels[v];
+                        Spectrum Phi;
+                        for (int j = 0; j < Spectrum::nSamples; ++j)
+                            Phi[j] = c.Phi[j];
+                        c.tau = (c.tau + c.beta * Phi) * (Rnew * Rnew) /
+                                (p.radius * p.radius);
+                        for (int j = 0; j < Spectrum::nSamples; ++j)
+                            c.Phi[j] = (Float)0;
+                    }
+                    p.N = Nnew;
+                    p.radius = Rnew;
+                    p.M = 0;
+                }
+                // Reset the visible point of every variant
+                for (int v = 0; v < nVariants; ++v) {
+                    pixelChannels[v].beta = 0.;
+                    pixelChannels[v].bsdf = nullptr;
+                }
+            }, nPixels, 4096);
+        }
+
+        // Periodically store SPPM image in film and write image
+        if (iter + 1 == nIterations || ((iter + 1) % writeFrequency) == 0) {
+            uint64_t Np = (uint64_t)(iter + 1) * (uint64_t)photonsPerIteration;
+            std::unique_ptr<CvSample[]> image(new CvSample[nPixels]);
+            for (int offset = 0; offset < nPixels; ++offset) {
+                // Compute every variant's radiance for SPPM pixel
+                const CvSPPMPixel &pixel = pixels[offset];
+                for (int v = 0; v < nVariants; ++v) {
+                    const CvSPPMChannel &c = channels[offset * nVariants + v];
+                    image[offset].L[v] =
+                        c.Ld / (iter + 1) +
+                        c.tau / (Np * Pi * pixel.radius * pixel.radius);
+                }
+            }
+            film->SetImage(image.get());
+            film->WriteImage();
+        }
+    }
+    progress.Done();
+}
+
+Integrator *CreateCvSPPMIntegrator(const ParamSet &params,
+                                   std::shared_ptr<const Camera> camera) {
+    int nIterations =
+        params.FindOneInt("iterations",
+                          params.FindOneInt("numiterations", 64));
+    int maxDepth = params.FindOneInt("maxdepth", 5);
+    int photonsPerIter = params.FindOneInt("photonsperiteration", -1);
+    int writeFreq = params.FindOneInt("imagewritefrequency", 1 << 31);
+    Float radius = params.FindOneFloat("radius", 1.f);
+    if (PbrtOptions.quickRender) nIterations = std::max(1, nIterations / 16);
+    return new CvSPPMIntegrator(camera, nIterations, photonsPerIter, maxDepth,
+                                radius, writeFreq);
+}
+
+}  // namespace pbrt
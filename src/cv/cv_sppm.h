@@ -0,0 +1,49 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CV_SPPM_H
+#define PBRT_CV_SPPM_H
+
+// cv/cv_sppm.h*
+#include "pbrt.h"
+#include "integrator.h"
+#include "camera.h"
+#include "film.h"
+
+namespace pbrt {
+
+// CvSPPMIntegrator Declarations
+class CvSPPMIntegrator : public Integrator {
+  public:
+    // CvSPPMIntegrator Public Methods
+    CvSPPMIntegrator(std::shared_ptr<const Camera> &camera, int nIterations,
+                     int photonsPerIteration, int maxDepth,
+                     Float initialSearchRadius, int writeFrequency)
+        : camera(camera),
+          initialSearchRadius(initialSearchRadius),
+          nIterations(nIterations),
+          maxDepth(maxDepth),
+          photonsPerIteration(photonsPerIteration > 0
+                                  ? photonsPerIteration
+                                  : camera->film->croppedPixelBounds.Area()),
+          writeFrequency(writeFrequency) {}
+    void Render(const Scene &scene);
+
+  private:
+    // CvSPPMIntegrator Private Data
+    std::shared_ptr<const Camera> camera;
+    const Float initialSearchRadius;
+    const int nIterations;
+    const int maxDepth;
+    const int photonsPerIteration;
+    const int writeFrequency;
+};
+
+Integrator *CreateCvSPPMIntegrator(const ParamSet &params,
+                                   std::shared_ptr<const Camera> camera);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CV_SPPM_H
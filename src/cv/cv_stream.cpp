@@ -0,0 +1,219 @@
+#include "cv_stream.h"
+
+#include <cstring>
+#include <zlib.h>
+
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_COUNTER("CV film/Streamed samples", streamedSamples);
+STAT_PERCENT("CV film/Sample stream chunks that waited for the writer",
+             nWaitingChunks, nSubmittedChunks);
+
+// Sample streams start with a magic number, a format version, the number
+// of variants and the size of a sample record. Each chunk then has a
+// header of its number of samples and its raw and compressed sizes,
+// followed by its records compressed as one zlib stream. A record holds
+// the pixel (two int32), pFilm (two float32), the reciprocal path PDF
+// (float32), the path length (int32) and the RGB radiance of every
+// variant (float32), whatever the build's _Float_.
+static const char streamMagic[8] = {'P', 'B', 'R', 'T', 'C', 'V', 'S', 'S'};
+static const int32_t streamVersion = 1;
+
+static size_t RecordSize(int nVariants) {
+    return 6 * sizeof(int32_t) + 3 * nVariants * sizeof(float);
+}
+
+CvSampleStream::CvSampleStream(const std::string &filename, int nVariants,
+                               int chunkSamples, int maxQueuedChunks)
+    : filename(filename),
+      nVariants(nVariants),
+      recordSize(RecordSize(nVariants)),
+      chunkBytes(std::max(1, chunkSamples) * recordSize),
+      maxQueuedChunks(std::max(1, maxQueuedChunks)),
+      out(filename, std::ios::binary),
+      valid((bool)out) {
+    if (!valid) {
+        Error("Unable to open sample stream file \"%s\"", filename.c_str());
+        return;
+    }
+    int32_t header[3] = {streamVersion, nVariants, (int32_t)recordSize};
+    out.write(streamMagic, sizeof(streamMagic));
+    out.write((const char *)header, sizeof(header));
+    writer = std::thread([this]() { WriteChunks(); });
+}
+
+CvSampleStream::~CvSampleStream() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    queueChanged.notify_all();
+    if (writer.joinable()) writer.join();
+}
+
+void CvSampleStream::EncodeSample(char *record, const Point2f &pFilm,
+                                  const CvSample &sample) const {
+    int32_t ints[2] = {(int32_t)std::floor(pFilm.x),
+                       (int32_t)std::floor(pFilm.y)};
+    float floats[3 + 3 * MaxVariants] = {(float)pFilm.x, (float)pFilm.y,
+                                         (float)sample.reciprocal_pdf};
+    int32_t pathLength = sample.pathLength;
+    for (int i = 0; i < nVariants; ++i) {
+        Float rgb[3];
+        sample.L[i].ToRGB(rgb);
+        for (int c = 0; c < 3; ++c) floats[3 + 3 * i + c] = rgb[c];
+    }
+    memcpy(record, ints, sizeof(ints));
+    memcpy(record + 2 * sizeof(int32_t), floats, 3 * sizeof(float));
+    memcpy(record + 5 * sizeof(int32_t), &pathLength, sizeof(pathLength));
+    memcpy(record + 6 * sizeof(int32_t), floats + 3,
+           3 * nVariants * sizeof(float));
+}
+
+void CvSampleStream::Submit(std::vector<char> *chunk) {
+    if (chunk->empty()) return;
+    if (!valid) {
+        chunk->clear();
+        return;
+    }
+    std::vector<char> full;
+    full.swap(*chunk);
+    chunk->reserve(chunkBytes);
+    streamedSamples += full.size() / recordSize;
+    ++nSubmittedChunks;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if ((int)queue.size() >= maxQueuedChunks) {
+            ++nWaitingChunks;
+            queueChanged.wait(lock, [&]() {
+                return (int)queue.size() < maxQueuedChunks;
+            });
+        }
+        queue.push_back(std::move(full));
+        ++pendingChunks;
+    }
+    queueChanged.notify_all();
+}
+
+void CvSampleStream::Flush() {
+    if (!valid) return;
+    std::unique_lock<std::mutex> lock(mutex);
+    queueChanged.wait(lock, [&]() { return pendingChunks == 0; });
+    // The writer does not touch the file while no chunks are pending
+    out.flush();
+}
+
+void CvSampleStream::WriteChunks() {
+    std::vector<Bytef> compressed;
+    bool failed = false;
+    while (true) {
+        std::vector<char> chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queueChanged.wait(lock,
+                              [&]() { return !queue.empty() || closing; });
+            if (queue.empty()) break;
+            chunk = std::move(queue.front());
+            queue.pop_front();
+        }
+        // Let a waiting tile queue its chunk while this one is compressed
+        queueChanged.notify_all();
+
+        uLongf size = compressBound(chunk.size());
+        compressed.resize(size);
+        int status = compress2(compressed.data(), &size,
+                               (const Bytef *)chunk.data(), chunk.size(),
+                               Z_BEST_SPEED);
+        if (status == Z_OK) {
+            int32_t header[3] = {(int32_t)(chunk.size() / recordSize),
+                                 (int32_t)chunk.size(), (int32_t)size};
+            out.write((const char *)header, sizeof(header));
+            out.write((const char *)compressed.data(), size);
+        }
+        if ((status != Z_OK || !out) && !failed) {
+            Error("Error writing sample stream \"%s\"", filename.c_str());
+            failed = true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --pendingChunks;
+        }
+        queueChanged.notify_all();
+    }
+    out.flush();
+}
+
+bool ReadCvSampleStream(const std::string &filename, int *nVariants,
+                        std::vector<CvStreamedSample> *samples) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        Error("Unable to open sample stream \"%s\"", filename.c_str());
+        return false;
+    }
+    char magic[sizeof(streamMagic)];
+    int32_t header[3];
+    in.read(magic, sizeof(magic));
+    in.read((char *)header, sizeof(header));
+    if (!in || memcmp(magic, streamMagic, sizeof(magic)) != 0) {
+        Error("\"%s\" is not a sample stream", filename.c_str());
+        return false;
+    }
+    if (header[0] != streamVersion || header[1] < 1 ||
+        header[1] > MaxVariants || header[2] != (int32_t)RecordSize(header[1])) {
+        Error("Sample stream \"%s\" has an unsupported format",
+              filename.c_str());
+        return false;
+    }
+    *nVariants = header[1];
+    const size_t recordSize = header[2];
+
+    samples->clear();
+    std::vector<char> compressed, chunk;
+    int32_t chunkHeader[3];
+    while (in.read((char *)chunkHeader, sizeof(chunkHeader))) {
+        uLongf size = chunkHeader[1];
+        if (chunkHeader[0] < 0 || size != chunkHeader[0] * recordSize ||
+            chunkHeader[2] < 0) {
+            Error("Sample stream \"%s\" is damaged", filename.c_str());
+            return false;
+        }
+        compressed.resize(chunkHeader[2]);
+        chunk.resize(size);
+        if (!in.read(compressed.data(), compressed.size())) {
+            Warning("Sample stream \"%s\" is truncated; using its first %d "
+                    "samples.", filename.c_str(), (int)samples->size());
+            return true;
+        }
+        if (uncompress((Bytef *)chunk.data(), &size,
+                       (const Bytef *)compressed.data(),
+                       compressed.size()) != Z_OK ||
+            size != chunk.size()) {
+            Error("Sample stream \"%s\" is damaged", filename.c_str());
+            return false;
+        }
+        for (size_t offset = 0; offset < chunk.size(); offset += recordSize) {
+            const char *record = &chunk[offset];
+            int32_t ints[6];
+            float rgb[3 * MaxVariants];
+            memcpy(ints, record, sizeof(ints));
+            memcpy(rgb, record + sizeof(ints), 3 * *nVariants * sizeof(float));
+            CvStreamedSample s;
+            s.pixel = Point2i(ints[0], ints[1]);
+            float floats[3];
+            memcpy(floats, &ints[2], sizeof(floats));
+            s.pFilm = Point2f(floats[0], floats[1]);
+            s.reciprocalPdf = floats[2];
+            s.pathLength = ints[5];
+            for (int i = 0; i < *nVariants; ++i) {
+                Float c[3] = {rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]};
+                s.L[i] = RGBSpectrum::FromRGB(c);
+            }
+            samples->push_back(s);
+        }
+    }
+    return true;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,88 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CV_STREAM_H
+#define PBRT_CV_STREAM_H
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "cv_pixel.h"
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+namespace pbrt {
+
+// One camera sample read back from a sample stream
+struct CvStreamedSample {
+    // Pixel containing the sample and its film position
+    Point2i pixel;
+    Point2f pFilm;
+    // RGB radiance of every variant
+    RGBSpectrum L[MaxVariants];
+    Float reciprocalPdf;
+    int pathLength;
+};
+
+// Streams every camera sample a control-variate film receives to a file
+// of zlib-compressed chunks. Film tiles append samples to their own
+// chunks without locking; full chunks are queued for a writer thread that
+// compresses and writes them. The queue is bounded, so that renders wait
+// for the disk rather than buffer an unbounded number of samples.
+class CvSampleStream {
+  public:
+    CvSampleStream(const std::string &filename, int nVariants,
+                   int chunkSamples = 16384, int maxQueuedChunks = 8);
+    // Writes the remaining queued chunks and closes the file
+    ~CvSampleStream();
+    bool IsValid() const { return valid; }
+
+    // Appends a sample to a tile's _chunk_, handing the chunk to the
+    // writer once it is full
+    void Add(std::vector<char> *chunk, const Point2f &pFilm,
+             const CvSample &sample) {
+        size_t offset = chunk->size();
+        chunk->resize(offset + recordSize);
+        EncodeSample(&(*chunk)[offset], pFilm, sample);
+        if (chunk->size() >= chunkBytes) Submit(chunk);
+    }
+    // Queues the samples of _chunk_ for writing, waiting while the queue
+    // is full, and leaves _chunk_ empty
+    void Submit(std::vector<char> *chunk);
+    // Waits until every submitted chunk has been written
+    void Flush();
+
+  private:
+    void EncodeSample(char *record, const Point2f &pFilm,
+                      const CvSample &sample) const;
+    void WriteChunks();
+
+    const std::string filename;
+    const int nVariants;
+    const size_t recordSize, chunkBytes;
+    const int maxQueuedChunks;
+    std::ofstream out;
+    bool valid;
+    std::mutex mutex;
+    std::condition_variable queueChanged;
+    // Chunks waiting for the writer, and their count including the one
+    // being written
+    std::deque<std::vector<char>> queue;
+    int pendingChunks = 0;
+    bool closing = false;
+    std::thread writer;
+};
+
+// Reads all samples of a stream in the order they were written; samples
+// of different tiles may interleave. Returns false if the file is not a
+// sample stream or is damaged.
+bool ReadCvSampleStream(const std::string &filename, int *nVariants,
+                        std::vector<CvStreamedSample> *samples);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CV_STREAM_H
@@ -0,0 +1,98 @@
+// cv/variantlight.cpp*
+#include "variantlight.h"
+#include "interaction.h"
+#include "primitive.h"
+#include "scene.h"
+
+namespace pbrt {
+
+namespace {
+
+template <typename L>
+Spectrum AveragePower(const std::vector<std::shared_ptr<L>> &lights) {
+    Spectrum phi(0.f);
+    for (const auto &light : lights) phi += light->Power();
+    return phi / lights.size();
+}
+
+}  // anonymous namespace
+
+// VariantLight Method Definitions
+Spectrum VariantLight::Power() const { return AveragePower(lights); }
+
+void VariantLight::Preprocess(const Scene &scene) {
+    for (const auto &light : lights) light->Preprocess(scene);
+}
+
+Spectrum VariantLight::VariantLi(int variant, const Interaction &ref,
+                                 const Point2f &u, const Vector3f &wi) const {
+    const Light &light = *lights[variant < NumVariants() ? variant : 0];
+    // Infinite lights are looked up along the sampled direction, since
+    // their sampling distributions follow their own emission
+    if (flags & (int)LightFlags::Infinite)
+        return light.Le(RayDifferential(ref.p, wi));
+    // Delta lights sample the same direction, with a PDF of one, for
+    // every variant
+    Vector3f wiVariant;
+    Float pdf;
+    VisibilityTester vis;
+    return light.Sample_Li(ref, u, &wiVariant, &pdf, &vis);
+}
+
+// VariantAreaLight Method Definitions
+Spectrum VariantAreaLight::Power() const { return AveragePower(lights); }
+
+void VariantAreaLight::Preprocess(const Scene &scene) {
+    for (const auto &light : lights) light->Preprocess(scene);
+}
+
+void VariantLe(const SurfaceInteraction &isect, const Vector3f &w,
+               int nVariants, Spectrum *Le) {
+    const AreaLight *area = isect.primitive->GetAreaLight();
+    if (area && area->HasVariants()) {
+        const VariantAreaLight *variants =
+            static_cast<const VariantAreaLight *>(area);
+        for (int i = 0; i < nVariants; ++i)
+            Le[i] = variants->VariantL(i, isect, w);
+    } else {
+        Le[0] = isect.Le(w);
+        for (int i = 1; i < nVariants; ++i) Le[i] = Le[0];
+    }
+}
+
+void VariantLe(const Light &light, const RayDifferential &ray, int nVariants,
+               Spectrum *Le) {
+    if (light.HasVariants()) {
+        const VariantLight &variants = static_cast<const VariantLight &>(light);
+        for (int i = 0; i < nVariants; ++i) Le[i] = variants.VariantLe(i, ray);
+    } else {
+        Le[0] = light.Le(ray);
+        for (int i = 1; i < nVariants; ++i) Le[i] = Le[0];
+    }
+}
+
+void VariantLi(const Light &light, const Interaction &ref, const Point2f &u,
+               const Vector3f &wi, const VisibilityTester &vis,
+               const Spectrum &Li, int nVariants, Spectrum *Lis) {
+    Lis[0] = Li;
+    if (!light.HasVariants()) {
+        for (int i = 1; i < nVariants; ++i) Lis[i] = Li;
+    } else if (light.flags & (int)LightFlags::Area) {
+        const VariantAreaLight &variants =
+            static_cast<const VariantAreaLight &>(light);
+        for (int i = 1; i < nVariants; ++i)
+            Lis[i] = variants.VariantL(i, vis.P1(), -wi);
+    } else {
+        const VariantLight &variants = static_cast<const VariantLight &>(light);
+        for (int i = 1; i < nVariants; ++i)
+            Lis[i] = variants.VariantLi(i, ref, u, wi);
+    }
+}
+
+bool HasLightVariants(const Scene &scene) {
+    for (const auto &light : scene.lights)
+        if (light->HasVariants()) return true;
+    return false;
+}
+
+}  // namespace pbrt
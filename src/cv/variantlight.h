@@ -0,0 +1,127 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CV_VARIANTLIGHT_H
+#define PBRT_CV_VARIANTLIGHT_H
+
+// cv/variantlight.h*
+#include "pbrt.h"
+#include "light.h"
+
+namespace pbrt {
+
+// Variant lights behave like their first light for sampling, so that
+// every variant shares the paths and light samples drawn for variant 0;
+// the other lights are only evaluated along them. They therefore need the
+// same geometry, and variant 0 must emit wherever the others do. Only
+// _Power()_ covers all variants, so that light selection does not starve
+// variants that are brighter than the first.
+
+// VariantLight Declarations
+class VariantLight : public Light {
+  public:
+    // VariantLight Public Methods
+    VariantLight(const Transform &LightToWorld,
+                 const std::vector<std::shared_ptr<Light>> &lights)
+        : Light(lights[0]->flags, LightToWorld, lights[0]->mediumInterface,
+                lights[0]->nSamples),
+          lights(lights) {}
+    Spectrum Sample_Li(const Interaction &ref, const Point2f &u, Vector3f *wi,
+                       Float *pdf, VisibilityTester *vis) const {
+        return lights[0]->Sample_Li(ref, u, wi, pdf, vis);
+    }
+    Spectrum Power() const;
+    void Preprocess(const Scene &scene);
+    Spectrum Le(const RayDifferential &r) const { return lights[0]->Le(r); }
+    Float Pdf_Li(const Interaction &ref, const Vector3f &wi) const {
+        return lights[0]->Pdf_Li(ref, wi);
+    }
+    Spectrum Sample_Le(const Point2f &u1, const Point2f &u2, Float time,
+                       Ray *ray, Normal3f *nLight, Float *pdfPos,
+                       Float *pdfDir) const {
+        return lights[0]->Sample_Le(u1, u2, time, ray, nLight, pdfPos, pdfDir);
+    }
+    void Pdf_Le(const Ray &ray, const Normal3f &nLight, Float *pdfPos,
+                Float *pdfDir) const {
+        lights[0]->Pdf_Le(ray, nLight, pdfPos, pdfDir);
+    }
+    bool HasVariants() const { return true; }
+    int NumVariants() const { return (int)lights.size(); }
+    // Radiance of variant _variant_ for the sample variant 0 returned
+    // from _Sample_Li()_ with _ref_ and _u_
+    Spectrum VariantLi(int variant, const Interaction &ref, const Point2f &u,
+                       const Vector3f &wi) const;
+    Spectrum VariantLe(int variant, const RayDifferential &r) const {
+        return lights[variant < NumVariants() ? variant : 0]->Le(r);
+    }
+
+  private:
+    // VariantLight Private Data
+    std::vector<std::shared_ptr<Light>> lights;
+};
+
+// VariantAreaLight Declarations
+class VariantAreaLight : public AreaLight {
+  public:
+    // VariantAreaLight Public Methods
+    VariantAreaLight(const Transform &LightToWorld,
+                     const std::vector<std::shared_ptr<AreaLight>> &lights)
+        : AreaLight(LightToWorld, lights[0]->mediumInterface,
+                    lights[0]->nSamples),
+          lights(lights) {}
+    Spectrum L(const Interaction &intr, const Vector3f &w) const {
+        return lights[0]->L(intr, w);
+    }
+    Spectrum Sample_Li(const Interaction &ref, const Point2f &u, Vector3f *wi,
+                       Float *pdf, VisibilityTester *vis) const {
+        return lights[0]->Sample_Li(ref, u, wi, pdf, vis);
+    }
+    Spectrum Power() const;
+    void Preprocess(const Scene &scene);
+    Float Pdf_Li(const Interaction &ref, const Vector3f &wi) const {
+        return lights[0]->Pdf_Li(ref, wi);
+    }
+    Spectrum Sample_Le(const Point2f &u1, const Point2f &u2, Float time,
+                       Ray *ray, Normal3f *nLight, Float *pdfPos,
+                       Float *pdfDir) const {
+        return lights[0]->Sample_Le(u1, u2, time, ray, nLight, pdfPos, pdfDir);
+    }
+    void Pdf_Le(const Ray &ray, const Normal3f &nLight, Float *pdfPos,
+                Float *pdfDir) const {
+        lights[0]->Pdf_Le(ray, nLight, pdfPos, pdfDir);
+    }
+    bool HasVariants() const { return true; }
+    int NumVariants() const { return (int)lights.size(); }
+    Spectrum VariantL(int variant, const Interaction &intr,
+                      const Vector3f &w) const {
+        return lights[variant < NumVariants() ? variant : 0]->L(intr, w);
+    }
+
+  private:
+    // VariantAreaLight Private Data
+    std::vector<std::shared_ptr<AreaLight>> lights;
+};
+
+// Per-variant emission for the control-variate integrators; lights
+// without variants emit the same radiance for every variant.
+
+// Radiance every variant emits from the area light surface _isect_
+// towards _w_
+void VariantLe(const SurfaceInteraction &isect, const Vector3f &w,
+               int nVariants, Spectrum *Le);
+// Radiance every variant of the infinite light _light_ emits along _ray_
+void VariantLe(const Light &light, const RayDifferential &ray, int nVariants,
+               Spectrum *Le);
+// Radiance every variant of _light_ contributes to the light sample
+// _Li_ that its _Sample_Li()_ returned for _ref_ and _u_
+void VariantLi(const Light &light, const Interaction &ref, const Point2f &u,
+               const Vector3f &wi, const VisibilityTester &vis,
+               const Spectrum &Li, int nVariants, Spectrum *Lis);
+// Whether the scene has any lights with variants
+bool HasLightVariants(const Scene &scene);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CV_VARIANTLIGHT_H
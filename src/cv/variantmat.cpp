@@ -0,0 +1,82 @@
+// cv/variantmat.cpp*
+#include "spectrum.h"
+#include "reflection.h"
+#include "paramset.h"
+#include "texture.h"
+#include "interaction.h"
+#include "primitive.h"
+#include "stats.h"
+
+#include "variantmat.h"
+#include "varianttex.h"
+
+namespace pbrt {
+
+// VariantMaterial Method Definitions
+void VariantMaterial::ComputeScatteringFunctions(SurfaceInteraction *si,
+                                                 MemoryArena &arena,
+                                                 TransportMode mode,
+                                                 bool allowMultipleLobes) const {
+    // Integrators that are not variant-aware only ever see the first material
+    materials[0]->ComputeScatteringFunctions(si, arena, mode,
+                                             allowMultipleLobes);
+}
+
+void VariantMaterial::ComputeVariantScatteringFunctions(
+    SurfaceInteraction *si, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes, int nVariants, VariantBSDF *bsdfs) const {
+    // Build the other variants first from the unperturbed shading geometry
+    // so that bump mapping in one material does not leak into the others.
+    // Each variant evaluates its own variant of any _VariantTexture_s.
+    decltype(si->shading) shading = si->shading;
+    int nMaterials = std::min(nVariants, NumVariants());
+    for (int i = nMaterials - 1; i > 0; --i) {
+        TextureVariantScope scope(i);
+        materials[i]->ComputeScatteringFunctions(si, arena, mode,
+                                                 allowMultipleLobes);
+        bsdfs->bsdf[i] = si->bsdf;
+        si->shading = shading;
+        si->bsdf = nullptr;
+        si->bssrdf = nullptr;
+    }
+
+    // Leave _si_ describing the first variant, which paths are sampled with
+    TextureVariantScope scope(0);
+    materials[0]->ComputeScatteringFunctions(si, arena, mode,
+                                             allowMultipleLobes);
+    bsdfs->bsdf[0] = si->bsdf;
+
+    // Variants beyond this material's count fall back to the first one
+    for (int i = nMaterials; i < nVariants; ++i)
+        bsdfs->bsdf[i] = bsdfs->bsdf[0];
+    bsdfs->nVariants = nVariants;
+}
+
+void ComputeVariantScatteringFunctions(SurfaceInteraction *si,
+                                       const RayDifferential &ray,
+                                       MemoryArena &arena, int nVariants,
+                                       VariantBSDF *bsdfs,
+                                       bool allowMultipleLobes,
+                                       TransportMode mode) {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    si->ComputeDifferentials(ray);
+    const Material *material = si->primitive->GetMaterial();
+    if (material && material->HasVariants() && nVariants > 1) {
+        static_cast<const VariantMaterial *>(material)
+            ->ComputeVariantScatteringFunctions(si, arena, mode,
+                                                allowMultipleLobes, nVariants,
+                                                bsdfs);
+    } else {
+        si->primitive->ComputeScatteringFunctions(si, arena, mode,
+                                                  allowMultipleLobes);
+        bsdfs->bsdf[0] = si->bsdf;
+        bsdfs->nVariants = 1;
+    }
+}
+
+VariantMaterial *CreateVariantMaterial(
+    const std::vector<std::shared_ptr<Material>> &materials) {
+    return new VariantMaterial(materials);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,69 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CV_VARIANTMAT_H
+#define PBRT_CV_VARIANTMAT_H
+
+// cv/variantmat.h*
+#include "pbrt.h"
+#include "material.h"
+
+namespace pbrt {
+
+// Maximum number of material variants rendered in one control-variate pass
+static PBRT_CONSTEXPR int MaxVariants = 8;
+
+// VariantBSDF Declarations
+struct VariantBSDF {
+    // _bsdf[0]_ is the variant paths are sampled with; on surfaces whose
+    // material has no variants only it is set and every variant shares it
+    BSDF *bsdf[MaxVariants];
+    int nVariants = 0;
+    bool HasVariants() const { return nVariants > 1; }
+};
+
+// VariantMaterial Declarations
+class VariantMaterial : public Material {
+  public:
+    // VariantMaterial Public Methods
+    VariantMaterial(const std::vector<std::shared_ptr<Material>> &materials)
+        : materials(materials) {}
+
+    void ComputeScatteringFunctions(SurfaceInteraction *si, MemoryArena &arena,
+                                    TransportMode mode,
+                                    bool allowMultipleLobes) const;
+    bool HasVariants() const { return true; }
+    int NumVariants() const { return (int)materials.size(); }
+    void ComputeVariantScatteringFunctions(SurfaceInteraction *si,
+                                           MemoryArena &arena,
+                                           TransportMode mode,
+                                           bool allowMultipleLobes,
+                                           int nVariants,
+                                           VariantBSDF *bsdfs) const;
+
+  private:
+    // VariantMaterial Private Data
+    std::vector<std::shared_ptr<Material>> materials;
+};
+
+void ComputeVariantScatteringFunctions(
+    SurfaceInteraction *si, const RayDifferential &ray, MemoryArena &arena,
+    int nVariants, VariantBSDF *bsdfs, bool allowMultipleLobes = false,
+    TransportMode mode = TransportMode::Radiance);
+
+// The variant that scenes rendered with "--variant" use of a material,
+// texture or light with _nVariants_ variants, or -1 when all are rendered.
+// Missing variants fall back to the first one.
+inline int SelectedVariant(int nVariants) {
+    if (PbrtOptions.variant < 0) return -1;
+    return PbrtOptions.variant < nVariants ? PbrtOptions.variant : 0;
+}
+
+VariantMaterial *CreateVariantMaterial(
+    const std::vector<std::shared_ptr<Material>> &materials);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CV_VARIANTMAT_H
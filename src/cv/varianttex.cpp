@@ -0,0 +1,55 @@
+// cv/varianttex.cpp*
+#include "varianttex.h"
+#include "variantmat.h"
+
+namespace pbrt {
+
+PBRT_THREAD_LOCAL int TextureVariant;
+
+namespace {
+
+// Collects the textures "tex1", "tex2", ... of a variant texture; the
+// two-variant "dual" form always has two, defaulting like "mix" does
+template <typename T, typename Get, typename GetOrNull>
+std::vector<std::shared_ptr<Texture<T>>> VariantTextures(
+    const TextureParams &tp, const char *type, Get get, GetOrNull getOrNull) {
+    std::vector<std::shared_ptr<Texture<T>>> textures;
+    for (int i = 1; i <= MaxVariants; ++i) {
+        std::shared_ptr<Texture<T>> tex =
+            getOrNull(StringPrintf("tex%d", i));
+        if (!tex) break;
+        textures.push_back(tex);
+    }
+    if (textures.size() < 2) {
+        Warning("Variant %s texture needs at least \"tex1\" and \"tex2\"; "
+                "missing ones default to 0 and 1.", type);
+        textures.resize(2);
+        textures[0] = get("tex1", 0.f);
+        textures[1] = get("tex2", 1.f);
+    }
+    int selected = SelectedVariant(textures.size());
+    if (selected >= 0) return {textures[selected]};
+    return textures;
+}
+
+}  // anonymous namespace
+
+VariantTexture<Float> *CreateVariantFloatTexture(const Transform &tex2world,
+                                                 const TextureParams &tp) {
+    return new VariantTexture<Float>(VariantTextures<Float>(
+        tp, "float",
+        [&](const std::string &n, Float d) { return tp.GetFloatTexture(n, d); },
+        [&](const std::string &n) { return tp.GetFloatTextureOrNull(n); }));
+}
+
+VariantTexture<Spectrum> *CreateVariantSpectrumTexture(
+    const Transform &tex2world, const TextureParams &tp) {
+    return new VariantTexture<Spectrum>(VariantTextures<Spectrum>(
+        tp, "spectrum",
+        [&](const std::string &n, Float d) {
+            return tp.GetSpectrumTexture(n, Spectrum(d));
+        },
+        [&](const std::string &n) { return tp.GetSpectrumTextureOrNull(n); }));
+}
+
+}  // namespace pbrt
@@ -0,0 +1,58 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CV_VARIANTTEX_H
+#define PBRT_CV_VARIANTTEX_H
+
+// cv/varianttex.h*
+#include "pbrt.h"
+#include "texture.h"
+#include "paramset.h"
+
+namespace pbrt {
+
+// The variant that _VariantTexture_s evaluate on the calling thread. It is
+// zero except while _VariantMaterial_ builds the BSDFs of other variants,
+// so integrators that are not variant-aware only ever see the first one.
+extern PBRT_THREAD_LOCAL int TextureVariant;
+
+class TextureVariantScope {
+  public:
+    explicit TextureVariantScope(int variant) : previous(TextureVariant) {
+        TextureVariant = variant;
+    }
+    ~TextureVariantScope() { TextureVariant = previous; }
+
+  private:
+    const int previous;
+};
+
+// VariantTexture Declarations
+template <typename T>
+class VariantTexture : public Texture<T> {
+  public:
+    // VariantTexture Public Methods
+    VariantTexture(const std::vector<std::shared_ptr<Texture<T>>> &textures)
+        : textures(textures) {}
+    T Evaluate(const SurfaceInteraction &si) const {
+        // Variants beyond this texture's count fall back to the first one
+        int i = TextureVariant < (int)textures.size() ? TextureVariant : 0;
+        return textures[i]->Evaluate(si);
+    }
+    int NumVariants() const { return (int)textures.size(); }
+
+  private:
+    // VariantTexture Private Data
+    std::vector<std::shared_ptr<Texture<T>>> textures;
+};
+
+VariantTexture<Float> *CreateVariantFloatTexture(const Transform &tex2world,
+                                                 const TextureParams &tp);
+VariantTexture<Spectrum> *CreateVariantSpectrumTexture(
+    const Transform &tex2world, const TextureParams &tp);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CV_VARIANTTEX_H
@@ -52,6 +52,12 @@ Rendering options:
   --quick              Automatically reduce a number of quality settings to
                        render more quickly.
   --quiet              Suppress all text output other than error messages.
+  --resume             Continue control-variate renders from their
+                       checkpoint files.
+  --seed <num>         Take samples independent of those of runs with
+                       other seeds. Default: 0
+  --variant <num>      Render only the given variant of materials, textures
+                       and lights with variants, with any integrator.
 
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
@@ -108,6 +114,21 @@ int main(int argc, char *argv[]) {
             options.quickRender = true;
         } else if (!strcmp(argv[i], "--quiet") || !strcmp(argv[i], "-quiet")) {
             options.quiet = true;
+        } else if (!strcmp(argv[i], "--resume") || !strcmp(argv[i], "-resume")) {
+            options.resume = true;
+        } else if (!strcmp(argv[i], "--variant") ||
+                   !strcmp(argv[i], "-variant")) {
+            if (i + 1 == argc)
+                usage("missing value after --variant argument");
+            options.variant = atoi(argv[++i]);
+        } else if (!strncmp(argv[i], "--variant=", 10)) {
+            options.variant = atoi(&argv[i][10]);
+        } else if (!strcmp(argv[i], "--seed") || !strcmp(argv[i], "-seed")) {
+            if (i + 1 == argc)
+                usage("missing value after --seed argument");
+            options.seed = atoi(argv[++i]);
+        } else if (!strncmp(argv[i], "--seed=", 7)) {
+            options.seed = atoi(&argv[i][7]);
         } else if (!strcmp(argv[i], "--cat") || !strcmp(argv[i], "-cat")) {
             options.cat = true;
         } else if (!strcmp(argv[i], "--toply") || !strcmp(argv[i], "-toply")) {
@@ -40,6 +40,8 @@ namespace pbrt {
 
 // HaltonSampler Local Constants
 static PBRT_CONSTEXPR int kMaxResolution = 128;
+// Run seed that _radicalInversePermutations_ were computed for
+static int permutationsSeed;
 
 // HaltonSampler Utility Functions
 static void extendedGCD(uint64_t a, uint64_t b, int64_t *x, int64_t *y);
@@ -65,10 +67,14 @@ static void extendedGCD(uint64_t a, uint64_t b, int64_t *x, int64_t *y) {
 HaltonSampler::HaltonSampler(int samplesPerPixel, const Bounds2i &sampleBounds,
                              bool sampleAtPixelCenter)
     : GlobalSampler(samplesPerPixel), sampleAtPixelCenter(sampleAtPixelCenter) {
-    // Generate random digit permutations for Halton sampler
-    if (radicalInversePermutations.empty()) {
+    // Generate random digit permutations for Halton sampler; the run's
+    // seed selects them
+    if (radicalInversePermutations.empty() ||
+        permutationsSeed != PbrtOptions.seed) {
         RNG rng;
+        if (PbrtOptions.seed != 0) rng.SetSequence(SeededSequence(0));
         radicalInversePermutations = ComputeRadicalInversePermutations(rng);
+        permutationsSeed = PbrtOptions.seed;
     }
 
     // Find radical inverse base scales and exponents that cover sampling area
@@ -118,9 +124,11 @@ int64_t HaltonSampler::GetIndexForSample(int64_t sampleNum) const {
 Float HaltonSampler::SampleDimension(int64_t index, int dim) const {
     if (sampleAtPixelCenter && (dim == 0 || dim == 1)) return 0.5f;
     if (dim == 0)
-        return RadicalInverse(dim, index >> baseExponents[0]);
+        return SeededPixelOffset(
+            RadicalInverse(dim, index >> baseExponents[0]), dim);
     else if (dim == 1)
-        return RadicalInverse(dim, index / baseScales[1]);
+        return SeededPixelOffset(RadicalInverse(dim, index / baseScales[1]),
+                                 dim);
     else
         return ScrambledRadicalInverse(dim, index,
                                        PermutationForDimension(dim));
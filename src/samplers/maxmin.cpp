@@ -66,7 +66,7 @@ void MaxMinDistSampler::StartPixel(const Point2i &p) {
 
 std::unique_ptr<Sampler> MaxMinDistSampler::Clone(int seed) {
     MaxMinDistSampler *mmds = new MaxMinDistSampler(*this);
-    mmds->rng.SetSequence(seed);
+    mmds->rng.SetSequence(SeededSequence(seed));
     return std::unique_ptr<Sampler>(mmds);
 }
 
@@ -50,6 +50,7 @@ class RandomSampler : public Sampler {
     void StartPixel(const Point2i &);
     Float Get1D();
     Point2f Get2D();
+    void SetDimension(int dim) { SetRNGDimension(rng, dim); }
     std::unique_ptr<Sampler> Clone(int seed);
 
   private:
@@ -34,6 +34,7 @@
 // samplers/sobol.cpp*
 #include "samplers/sobol.h"
 #include "lowdiscrepancy.h"
+#include "rng.h"
 #include "paramset.h"
 
 namespace pbrt {
@@ -49,11 +50,19 @@ Float SobolSampler::SampleDimension(int64_t index, int dim) const {
         LOG(FATAL) << StringPrintf("SobolSampler can only sample up to %d "
                                    "dimensions! Exiting.",
                                    NumSobolDimensions);
-    Float s = SobolSample(index, dim);
+    // The run's seed scrambles the dimensions past the pixel sample's
+    // position, which must stay in the pixel and is shifted instead
+    uint64_t scramble = 0;
+    if (dim > 1 && PbrtOptions.seed != 0) {
+        RNG rng(SeededSequence(dim));
+        scramble = rng.UniformUInt32();
+    }
+    Float s = SobolSample(index, dim, scramble);
     // Remap Sobol$'$ dimensions used for pixel samples
     if (dim == 0 || dim == 1) {
         s = s * resolution + sampleBounds.pMin[dim];
-        s = Clamp(s - currentPixel[dim], (Float)0, OneMinusEpsilon);
+        s = SeededPixelOffset(
+            Clamp(s - currentPixel[dim], (Float)0, OneMinusEpsilon), dim);
     }
     return s;
 }
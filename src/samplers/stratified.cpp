@@ -72,7 +72,7 @@ void StratifiedSampler::StartPixel(const Point2i &p) {
 
 std::unique_ptr<Sampler> StratifiedSampler::Clone(int seed) {
     StratifiedSampler *ss = new StratifiedSampler(*this);
-    ss->rng.SetSequence(seed);
+    ss->rng.SetSequence(SeededSequence(seed));
     return std::unique_ptr<Sampler>(ss);
 }
 
@@ -70,7 +70,7 @@ void ZeroTwoSequenceSampler::StartPixel(const Point2i &p) {
 
 std::unique_ptr<Sampler> ZeroTwoSequenceSampler::Clone(int seed) {
     ZeroTwoSequenceSampler *lds = new ZeroTwoSequenceSampler(*this);
-    lds->rng.SetSequence(seed);
+    lds->rng.SetSequence(SeededSequence(seed));
     return std::unique_ptr<Sampler>(lds);
 }
 
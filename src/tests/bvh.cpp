@@ -0,0 +1,225 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "accelerators/bvh.h"
+#include "interaction.h"
+#include "parallel.h"
+#include "paramset.h"
+#include "rng.h"
+#include "sampling.h"
+#include "shapes/triangle.h"
+#include <cstdio>
+#include <fstream>
+
+using namespace pbrt;
+
+// Random small triangles in the unit cube at _origin_
+static std::vector<std::shared_ptr<Primitive>> RandomTriangles(
+    int n, RNG &rng, const Point3f &origin = Point3f(0, 0, 0)) {
+    static Transform identity;
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < n; ++i) {
+        Point3f center = origin + Vector3f(rng.UniformFloat(),
+                                           rng.UniformFloat(),
+                                           rng.UniformFloat());
+        for (int v = 0; v < 3; ++v) {
+            indices.push_back(p.size());
+            p.push_back(center + .05f * Vector3f(rng.UniformFloat() - .5f,
+                                                 rng.UniformFloat() - .5f,
+                                                 rng.UniformFloat() - .5f));
+        }
+    }
+    std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+        &identity, &identity, false, n, indices.data(), p.size(), p.data(),
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &tri : tris)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+static std::shared_ptr<BVHAccel> MakeBVH(
+    const std::vector<std::shared_ptr<Primitive>> &prims,
+    const std::string &splitMethod, int maxNodePrims, int width,
+    const std::string &cacheDir = "", bool quantized = false) {
+    ParamSet params;
+    std::unique_ptr<std::string[]> method(new std::string[1]{splitMethod});
+    params.AddString("splitmethod", std::move(method), 1);
+    std::unique_ptr<int[]> nodePrims(new int[1]{maxNodePrims});
+    params.AddInt("maxnodeprims", std::move(nodePrims), 1);
+    std::unique_ptr<int[]> w(new int[1]{width});
+    params.AddInt("width", std::move(w), 1);
+    std::unique_ptr<bool[]> q(new bool[1]{quantized});
+    params.AddBool("quantized", std::move(q), 1);
+    if (!cacheDir.empty()) {
+        std::unique_ptr<std::string[]> dir(new std::string[1]{cacheDir});
+        params.AddString("cachedir", std::move(dir), 1);
+    }
+    return CreateBVHAccelerator(prims, params);
+}
+
+// Checks that _bvh_ finds the same closest and any hits as _reference_
+static void CompareBVHs(const BVHAccel &reference, const BVHAccel &bvh,
+                        RNG &rng) {
+    for (int i = 0; i < 2000; ++i) {
+        Point3f o(Lerp(rng.UniformFloat(), -.5f, 1.5f),
+                  Lerp(rng.UniformFloat(), -.5f, 1.5f),
+                  Lerp(rng.UniformFloat(), -.5f, 1.5f));
+        Vector3f d = UniformSampleSphere(
+            Point2f(rng.UniformFloat(), rng.UniformFloat()));
+        // Some rays are parallel to an axis
+        if (i % 10 == 0) d = Vector3f(0, 0, i % 20 ? 1 : -1);
+        Ray r0(o, d), r1(o, d);
+        SurfaceInteraction isect0, isect1;
+        bool hit0 = reference.Intersect(r0, &isect0);
+        EXPECT_EQ(hit0, bvh.Intersect(r1, &isect1));
+        EXPECT_EQ(r0.tMax, r1.tMax);
+        EXPECT_EQ(hit0, bvh.IntersectP(Ray(o, d)));
+    }
+}
+
+TEST(BVH, WideMatchesBinary) {
+    ParallelInit();
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(5000, rng);
+    for (int maxNodePrims : {1, 4}) {
+        std::shared_ptr<BVHAccel> binary =
+            MakeBVH(prims, "sah", maxNodePrims, 2);
+        for (int width : {4, 8}) {
+            std::shared_ptr<BVHAccel> wide =
+                MakeBVH(prims, "sah", maxNodePrims, width);
+            EXPECT_EQ(binary->WorldBound(), wide->WorldBound());
+            CompareBVHs(*binary, *wide, rng);
+        }
+    }
+
+    // A single primitive is a leaf without a parent
+    std::vector<std::shared_ptr<Primitive>> one(prims.begin(),
+                                                prims.begin() + 1);
+    CompareBVHs(*MakeBVH(one, "sah", 4, 2), *MakeBVH(one, "sah", 4, 8), rng);
+    ParallelCleanup();
+}
+
+TEST(BVH, ParallelBuildMatchesSerial) {
+    // Enough primitives that the upper levels are binned in parallel, in
+    // two clusters so that most of the root's buckets are empty
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomTriangles(100000, rng);
+    std::vector<std::shared_ptr<Primitive>> far =
+        RandomTriangles(50000, rng, Point3f(10, 0, 0));
+    prims.insert(prims.end(), far.begin(), far.end());
+    int savedThreads = PbrtOptions.nThreads;
+    for (const char *splitMethod : {"sah", "middle", "hlbvh"}) {
+        PbrtOptions.nThreads = 1;
+        ParallelInit();
+        std::shared_ptr<BVHAccel> serial = MakeBVH(prims, splitMethod, 4, 2);
+        ParallelCleanup();
+
+        PbrtOptions.nThreads = 4;
+        ParallelInit();
+        std::shared_ptr<BVHAccel> parallel = MakeBVH(prims, splitMethod, 4, 2);
+        std::shared_ptr<BVHAccel> sah = MakeBVH(prims, "sah", 4, 2);
+        ParallelCleanup();
+
+        // The trees only differ in the order of primitives within leaves
+        EXPECT_EQ(serial->SAHCost(), parallel->SAHCost());
+        EXPECT_EQ(serial->WorldBound(), parallel->WorldBound());
+        CompareBVHs(*serial, *parallel, rng);
+        // Other split methods' trees differ but find the same hits
+        CompareBVHs(*sah, *parallel, rng);
+    }
+    PbrtOptions.nThreads = savedThreads;
+}
+
+TEST(BVH, BuildBeforeParallelInit) {
+    // Tools and tests build trees without the worker threads; the build
+    // must not need them even if several threads are configured
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(20000, rng);
+    int savedThreads = PbrtOptions.nThreads;
+    PbrtOptions.nThreads = 4;
+    for (int width : {2, 4}) {
+        std::shared_ptr<BVHAccel> bvh = MakeBVH(prims, "sah", 4, width);
+        std::shared_ptr<BVHAccel> quantized =
+            MakeBVH(prims, "sah", 4, width, "", true);
+        CompareBVHs(*bvh, *quantized, rng);
+    }
+    PbrtOptions.nThreads = savedThreads;
+}
+
+TEST(BVH, Cache) {
+    ParallelInit();
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(3000, rng);
+    for (const char *splitMethod : {"sah", "hlbvh"})
+        for (int width : {2, 8}) {
+            std::shared_ptr<BVHAccel> built =
+                MakeBVH(prims, splitMethod, 4, width, ".");
+            EXPECT_FALSE(built->LoadedFromCache());
+            ASSERT_FALSE(built->CacheFile().empty());
+
+            std::shared_ptr<BVHAccel> cached =
+                MakeBVH(prims, splitMethod, 4, width, ".");
+            EXPECT_TRUE(cached->LoadedFromCache());
+            EXPECT_EQ(built->CacheFile(), cached->CacheFile());
+            EXPECT_EQ(built->SAHCost(), cached->SAHCost());
+            EXPECT_EQ(built->WorldBound(), cached->WorldBound());
+            CompareBVHs(*built, *cached, rng);
+
+            // Other build parameters have their own file
+            std::shared_ptr<BVHAccel> other =
+                MakeBVH(prims, splitMethod, 1, width, ".");
+            EXPECT_NE(built->CacheFile(), other->CacheFile());
+            EXPECT_EQ(0, remove(built->CacheFile().c_str()));
+            EXPECT_EQ(0, remove(other->CacheFile().c_str()));
+        }
+
+    // Damaged files are replaced
+    std::shared_ptr<BVHAccel> built = MakeBVH(prims, "sah", 4, 2, ".");
+    std::ofstream(built->CacheFile()) << "not a tree";
+    EXPECT_FALSE(MakeBVH(prims, "sah", 4, 2, ".")->LoadedFromCache());
+    EXPECT_TRUE(MakeBVH(prims, "sah", 4, 2, ".")->LoadedFromCache());
+    EXPECT_EQ(0, remove(built->CacheFile().c_str()));
+    ParallelCleanup();
+}
+
+TEST(BVH, QuantizedMatchesFull) {
+    ParallelInit();
+    RNG rng;
+    // Far from the origin, so that the quantization grid's spacing is
+    // coarse relative to the primitives' coordinates
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomTriangles(5000, rng, Point3f(1000, -1000, 1000));
+    std::vector<std::shared_ptr<Primitive>> near = RandomTriangles(5000, rng);
+    prims.insert(prims.end(), near.begin(), near.end());
+    for (int width : {2, 4, 8}) {
+        std::shared_ptr<BVHAccel> full = MakeBVH(prims, "sah", 4, width);
+        std::shared_ptr<BVHAccel> quantized =
+            MakeBVH(prims, "sah", 4, width, "", true);
+        EXPECT_EQ(full->SAHCost(), quantized->SAHCost());
+        EXPECT_EQ(full->WorldBound(), quantized->WorldBound());
+        CompareBVHs(*full, *quantized, rng);
+
+        // Quantized trees have their own cache files
+        std::shared_ptr<BVHAccel> built =
+            MakeBVH(prims, "hlbvh", 1, width, ".", true);
+        std::shared_ptr<BVHAccel> cached =
+            MakeBVH(prims, "hlbvh", 1, width, ".", true);
+        std::shared_ptr<BVHAccel> other =
+            MakeBVH(prims, "hlbvh", 1, width, ".");
+        EXPECT_TRUE(cached->LoadedFromCache());
+        EXPECT_NE(built->CacheFile(), other->CacheFile());
+        CompareBVHs(*full, *cached, rng);
+        EXPECT_EQ(0, remove(built->CacheFile().c_str()));
+        EXPECT_EQ(0, remove(other->CacheFile().c_str()));
+    }
+
+    // A single primitive is a leaf without a parent
+    std::vector<std::shared_ptr<Primitive>> one(prims.begin(),
+                                                prims.begin() + 1);
+    CompareBVHs(*MakeBVH(one, "sah", 4, 2),
+                *MakeBVH(one, "sah", 4, 4, "", true), rng);
+    ParallelCleanup();
+}
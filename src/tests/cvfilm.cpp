@@ -0,0 +1,340 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "parallel.h"
+#include "cv/cv_film.h"
+#include "filters/box.h"
+#include "imageio.h"
+#include <chrono>
+#include <cstring>
+
+using namespace pbrt;
+
+// Film with a radius-1 box filter, so that every sample splats into its
+// 3x3 pixel neighborhood and neighboring tiles overlap when merged.
+static std::unique_ptr<CvFilm> MakeFilm(
+    const Point2i &res,
+    const Bounds2f &crop = Bounds2f(Point2f(0, 0), Point2f(1, 1))) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(1, 1)));
+    return std::unique_ptr<CvFilm>(new CvFilm(res, crop, std::move(filter), 35,
+                                              "cvfilm_test.exr", 1));
+}
+
+// One sample at the center of each pixel of each 16x16 tile; variant 0
+// has radiance _L0_ and variant 1 (the baseline) radiance 2.
+static std::vector<std::unique_ptr<CvFilmTile>> MakeTiles(CvFilm *film,
+                                                          Float L0 = 1) {
+    const int tileSize = 16;
+    Bounds2i sampleBounds = film->GetSampleBounds();
+    Vector2i extent = sampleBounds.Diagonal();
+    Spectrum L[2] = {Spectrum(L0), Spectrum(2.f)};
+    CvSample sample(L, 2, 1);
+    std::vector<std::unique_ptr<CvFilmTile>> tiles;
+    for (int y = 0; y < extent.y; y += tileSize)
+        for (int x = 0; x < extent.x; x += tileSize) {
+            Point2i p0 = sampleBounds.pMin + Vector2i(x, y);
+            Point2i p1 = Min(p0 + Vector2i(tileSize, tileSize),
+                             sampleBounds.pMax);
+            std::unique_ptr<CvFilmTile> tile =
+                film->GetCvFilmTile(Bounds2i(p0, p1));
+            for (Point2i p : Bounds2i(p0, p1))
+                tile->AddSample(Point2f(p.x + 0.5f, p.y + 0.5f), sample);
+            tiles.push_back(std::move(tile));
+        }
+    return tiles;
+}
+
+// Merges every tile _nRounds_ times, in parallel over tiles, into
+// _film_ and returns the elapsed time in seconds.
+static double MergeTiles(CvFilm *film,
+                         std::vector<std::unique_ptr<CvFilmTile>> &tiles,
+                         int nRounds) {
+    auto start = std::chrono::steady_clock::now();
+    ParallelFor([&](int64_t i) {
+        // MergeFilmTile() consumes its tile, so merge a copy
+        const CvFilmTile &source = *tiles[i % tiles.size()];
+        film->MergeFilmTile(
+            std::unique_ptr<CvFilmTile>(new CvFilmTile(source)));
+    }, nRounds * tiles.size(), 1);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start).count();
+}
+
+TEST(CvFilm, ConcurrentMerge) {
+    ParallelInit();
+
+    Point2i res(70, 45);
+    std::unique_ptr<CvFilm> film = MakeFilm(res);
+    std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(film.get());
+    const int nRounds = 4;
+    MergeTiles(film.get(), tiles, nRounds);
+
+    for (int y = 0; y < res.y; ++y)
+        for (int x = 0; x < res.x; ++x) {
+            // The film's sample bounds extend one filter radius past the
+            // image, so every pixel is covered by 3x3 samples per round
+            Float expected = nRounds * 9;
+            const CvPixelBuffer &pixels = film->GetPixels();
+            int p = film->PixelIndex(Point2i(x, y));
+            EXPECT_EQ(expected, pixels.WeightSum(p));
+            EXPECT_EQ(expected, pixels.Radiance(p, 0)[0]);
+            EXPECT_EQ(2 * expected, pixels.Radiance(p, 1)[2]);
+            EXPECT_EQ(-expected, pixels.Difference(p, 0)[1]);
+            EXPECT_EQ(expected, pixels.DifferenceSquare(p, 0)[1]);
+        }
+
+    ParallelCleanup();
+}
+
+// Reports tile merge throughput as the number of threads grows. It only
+// prints timings, so it is disabled; run it with
+// --gtest_also_run_disabled_tests.
+TEST(CvFilm, DISABLED_MergeScaling) {
+    int savedThreads = PbrtOptions.nThreads;
+    int maxThreads = std::max(4, NumSystemCores());
+    for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+
+        std::unique_ptr<CvFilm> film = MakeFilm(Point2i(256, 256));
+        std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(film.get());
+        const int nRounds = 8;
+        double seconds = MergeTiles(film.get(), tiles, nRounds);
+        printf("CvFilm::MergeFilmTile: %2d threads, %8.0f tiles/s\n", nThreads,
+               nRounds * tiles.size() / seconds);
+
+        ParallelCleanup();
+    }
+    PbrtOptions.nThreads = savedThreads;
+}
+
+TEST(CvFilm, CheckpointRoundTrip) {
+    ParallelInit();
+
+    Point2i res(37, 20);
+    std::unique_ptr<CvFilm> film = MakeFilm(res);
+    std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(film.get());
+    MergeTiles(film.get(), tiles, 3);
+    std::vector<int> pixelSamples(film->GetSampleBounds().Area());
+    for (size_t i = 0; i < pixelSamples.size(); ++i) pixelSamples[i] = i % 7;
+    const char *name = "cvfilm_test.cvckpt";
+    EXPECT_TRUE(film->WriteCheckpoint(name, 5, pixelSamples));
+
+    std::unique_ptr<CvFilm> resumed = MakeFilm(res);
+    int nPasses = 0;
+    std::vector<int> resumedSamples(pixelSamples.size(), 0);
+    EXPECT_TRUE(resumed->ReadCheckpoint(name, &nPasses, &resumedSamples));
+    EXPECT_EQ(5, nPasses);
+    EXPECT_EQ(pixelSamples, resumedSamples);
+    for (int i = 0; i < res.x * res.y; ++i) {
+        EXPECT_EQ(film->GetPixels().WeightSum(i),
+                  resumed->GetPixels().WeightSum(i));
+        EXPECT_EQ(film->GetPixels().Cross(i, 0),
+                  resumed->GetPixels().Cross(i, 0));
+    }
+
+    // A film of another size must not pick the checkpoint up
+    std::unique_ptr<CvFilm> other = MakeFilm(Point2i(res.y, res.x));
+    std::vector<int> otherSamples(other->GetSampleBounds().Area(), 0);
+    EXPECT_FALSE(other->ReadCheckpoint(name, &nPasses, &otherSamples));
+    EXPECT_EQ(0, other->GetPixels().WeightSum(0));
+
+    EXPECT_EQ(0, remove(name));
+    ParallelCleanup();
+}
+
+TEST(CvFilm, MergeAccumulators) {
+    ParallelInit();
+
+    // Render the top and bottom halves separately, the bottom one with a
+    // splat, and merge their accumulators into a film of the whole image
+    Point2i res(30, 20);
+    std::unique_ptr<CvFilm> full = MakeFilm(res);
+    std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(full.get());
+    MergeTiles(full.get(), tiles, 2);
+    Bounds2f halves[2] = {Bounds2f(Point2f(0, 0), Point2f(1, .5f)),
+                          Bounds2f(Point2f(0, .5f), Point2f(1, 1))};
+    const char *names[2] = {"cvfilm_test_top.cvacc", "cvfilm_test_bottom.cvacc"};
+    Spectrum L[2] = {Spectrum(4.f), Spectrum(8.f)};
+    Point2i splatPixel(3, 15);
+    for (int i = 0; i < 2; ++i) {
+        std::unique_ptr<CvFilm> half = MakeFilm(res, halves[i]);
+        std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(half.get());
+        MergeTiles(half.get(), tiles, 2);
+        if (i == 1)
+            half->AddSplat(Point2f(splatPixel.x + .5f, splatPixel.y + .5f),
+                           CvSample(L, 2, 1));
+        EXPECT_TRUE(half->WriteAccumulators(names[i], .5f, 2));
+
+        CvAccumulatorsInfo info;
+        EXPECT_TRUE(ReadCvAccumulatorsInfo(names[i], &info));
+        EXPECT_EQ(res, info.fullResolution);
+        EXPECT_EQ(half->croppedPixelBounds, info.pixelBounds);
+        EXPECT_EQ(i == 1, info.hasSplats);
+    }
+
+    std::unique_ptr<CvFilm> merged = MakeFilm(res);
+    for (const char *name : names) EXPECT_TRUE(merged->MergeAccumulators(name));
+    // Each half's sample bounds extend one filter radius past its crop
+    // window, so the pixels along the seam match the full render, too
+    for (int i = 0; i < res.x * res.y; ++i) {
+        EXPECT_EQ(full->GetPixels().WeightSum(i),
+                  merged->GetPixels().WeightSum(i));
+        EXPECT_EQ(full->GetPixels().Radiance(i, 1),
+                  merged->GetPixels().Radiance(i, 1));
+        EXPECT_EQ(full->GetPixels().Cross(i, 0),
+                  merged->GetPixels().Cross(i, 0));
+    }
+
+    // The same pixels cannot be merged twice
+    EXPECT_FALSE(merged->MergeAccumulators(names[0]));
+    EXPECT_EQ(full->GetPixels().WeightSum(0), merged->GetPixels().WeightSum(0));
+
+    // Files must lie inside the merging film's pixel bounds
+    std::unique_ptr<CvFilm> top = MakeFilm(res, halves[0]);
+    EXPECT_FALSE(top->MergeAccumulators(names[1]));
+    EXPECT_EQ(0, top->GetPixels().WeightSum(0));
+
+    // A file for a film of another resolution does not merge
+    std::unique_ptr<CvFilm> other = MakeFilm(Point2i(res.y, res.x));
+    EXPECT_FALSE(other->MergeAccumulators(names[0]));
+
+    for (const char *name : names) EXPECT_EQ(0, remove(name));
+    ParallelCleanup();
+}
+
+TEST(CvFilm, DifferenceErrors) {
+    ParallelInit();
+
+    // Every sample of variant 0 has radiance 1 and of the baseline 2, so
+    // the difference of -1 has no variance and is significant everywhere
+    Point2i res(20, 10);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(1, 1)));
+    CvFilm film(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)), std::move(filter),
+                35, "cvfilm_test_errors", 1);
+    std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(&film);
+    MergeTiles(&film, tiles, 1);
+    film.WriteImage(1, 9);
+
+    Point2i errorRes;
+    std::unique_ptr<RGBSpectrum[]> stdError =
+        ReadImage("cvfilm_test_errors_Dstderr.bin", &errorRes);
+    std::unique_ptr<RGBSpectrum[]> significant =
+        ReadImage("cvfilm_test_errors_Dsignificant.bin", &errorRes);
+    ASSERT_TRUE(stdError && significant);
+    EXPECT_EQ(res, errorRes);
+    for (int i = 0; i < res.x * res.y; ++i) {
+        EXPECT_EQ(0.f, stdError[i][1]);
+        EXPECT_EQ(1.f, significant[i][0]);
+    }
+
+    const char *suffixes[] = {"F.bin", "F.png", "Fsquare.bin", "Falpha.bin",
+                              "H.bin", "H.png", "Hsquare.bin", "D.bin",
+                              "Dsquare.bin", "Dstderr.bin", "Drelerr.bin",
+                              "Dsignificant.bin", "Dsignificant.png",
+                              "rpdf.bin", "rpdf.png"};
+    for (const char *suffix : suffixes)
+        EXPECT_EQ(0, remove((std::string("cvfilm_test_errors_") + suffix).c_str()));
+    ParallelCleanup();
+}
+
+TEST(CvFilm, PerPixelSampleCounts) {
+    ParallelInit();
+
+    // Differences of -1 and 1 in equal parts have mean 0 and variance 1,
+    // so the standard error of a pixel with n samples is 1 / sqrt(n)
+    Point2i res(20, 10);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(1, 1)));
+    CvFilm film(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)), std::move(filter),
+                35, "cvfilm_test_counts", 1);
+    for (Float L0 : {1.f, 3.f}) {
+        std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(&film, L0);
+        MergeTiles(&film, tiles, 1);
+    }
+    Bounds2i sampleBounds = film.GetSampleBounds();
+    std::vector<int> counts;
+    for (Point2i p : sampleBounds) counts.push_back(1 + (p.x + 2 * p.y) % 7);
+    film.SetPixelSamples(sampleBounds, counts);
+    // A uniform count passed to WriteImage() does not override them
+    film.WriteImage(1, 64);
+
+    // The counts are stored with the accumulators, so that a merge gives
+    // the same errors
+    EXPECT_TRUE(film.WriteAccumulators("cvfilm_test_counts.cvacc", 1, 64));
+    std::unique_ptr<Filter> mergedFilter(new BoxFilter(Vector2f(1, 1)));
+    CvFilm merged(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                  std::move(mergedFilter), 35, "cvfilm_test_merged", 1);
+    EXPECT_TRUE(merged.MergeAccumulators("cvfilm_test_counts.cvacc"));
+    merged.WriteImage(1);
+
+    // A run of the same pixels with another seed adds its counts; one with
+    // the same seed took the same samples and is rejected
+    int savedSeed = PbrtOptions.seed;
+    PbrtOptions.seed = 1;
+    EXPECT_TRUE(film.WriteAccumulators("cvfilm_test_seed.cvacc", 1, 64));
+    PbrtOptions.seed = savedSeed;
+    std::unique_ptr<Filter> seedsFilter(new BoxFilter(Vector2f(1, 1)));
+    CvFilm seeds(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                 std::move(seedsFilter), 35, "cvfilm_test_seeds", 1);
+    EXPECT_TRUE(seeds.MergeAccumulators("cvfilm_test_counts.cvacc"));
+    EXPECT_TRUE(seeds.MergeAccumulators("cvfilm_test_seed.cvacc"));
+    EXPECT_FALSE(seeds.MergeAccumulators("cvfilm_test_counts.cvacc"));
+    seeds.WriteImage(1);
+
+    for (const char *name :
+         {"cvfilm_test_counts", "cvfilm_test_merged", "cvfilm_test_seeds"}) {
+        Point2i errorRes;
+        std::unique_ptr<RGBSpectrum[]> stdError = ReadImage(
+            std::string(name) + "_Dstderr.bin", &errorRes);
+        ASSERT_TRUE(stdError != nullptr);
+        EXPECT_EQ(res, errorRes);
+        int nRuns = strcmp(name, "cvfilm_test_seeds") ? 1 : 2;
+        for (Point2i p : Bounds2i(Point2i(0, 0), res)) {
+            int n = nRuns * (1 + (p.x + 2 * p.y) % 7);
+            EXPECT_FLOAT_EQ(1 / std::sqrt((Float)n),
+                            stdError[p.y * res.x + p.x][0]);
+        }
+    }
+
+    const char *suffixes[] = {"F.bin", "F.png", "Fsquare.bin", "Falpha.bin",
+                              "H.bin", "H.png", "Hsquare.bin", "D.bin",
+                              "Dsquare.bin", "Dstderr.bin", "Drelerr.bin",
+                              "Dsignificant.bin", "Dsignificant.png",
+                              "rpdf.bin", "rpdf.png"};
+    for (const char *name : {"cvfilm_test_counts_", "cvfilm_test_merged_",
+                             "cvfilm_test_seeds_"})
+        for (const char *suffix : suffixes)
+            EXPECT_EQ(0, remove((std::string(name) + suffix).c_str()));
+    EXPECT_EQ(0, remove("cvfilm_test_counts.cvacc"));
+    EXPECT_EQ(0, remove("cvfilm_test_seed.cvacc"));
+    ParallelCleanup();
+}
+
+TEST(CvFilm, MergePixelBounds) {
+    ParallelInit();
+
+    // Renders restricted to the top and bottom halves with the
+    // integrator's "pixelbounds" write accumulators of the whole image,
+    // without samples in the other half, and merge with the same seed
+    Point2i res(30, 20);
+    const char *names[2] = {"cvfilm_test_top.cvacc", "cvfilm_test_bottom.cvacc"};
+    for (int i = 0; i < 2; ++i) {
+        std::unique_ptr<CvFilm> film = MakeFilm(res);
+        std::vector<std::unique_ptr<CvFilmTile>> tiles = MakeTiles(film.get());
+        MergeTiles(film.get(), tiles, 1);
+        Bounds2i sampleBounds = film->GetSampleBounds();
+        std::vector<int> counts;
+        for (Point2i p : sampleBounds)
+            counts.push_back((p.y < res.y / 2) == (i == 0) ? 1 : 0);
+        film->SetPixelSamples(sampleBounds, counts);
+        EXPECT_TRUE(film->WriteAccumulators(names[i], 1, 1));
+    }
+    std::unique_ptr<CvFilm> merged = MakeFilm(res);
+    for (const char *name : names) EXPECT_TRUE(merged->MergeAccumulators(name));
+    EXPECT_FALSE(merged->MergeAccumulators(names[0]));
+    for (int i = 0; i < res.x * res.y; ++i)
+        EXPECT_EQ(2 * 9, merged->GetPixels().WeightSum(i));
+
+    for (const char *name : names) EXPECT_EQ(0, remove(name));
+    ParallelCleanup();
+}
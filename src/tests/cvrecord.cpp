@@ -0,0 +1,141 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "api.h"
+#include "imageio.h"
+#include "parser.h"
+#include "cv/cv_record.h"
+#include <cstring>
+#include <fstream>
+
+using namespace pbrt;
+
+TEST(CvPathRecording, RoundTrip) {
+    const char *name = "cvrecord_test.cvpaths";
+    {
+        CvPathRecorder recorder(name, 42);
+        ASSERT_TRUE(recorder.IsValid());
+        // Two blocks: one with paths of 0 and 3 vertices, one empty
+        std::vector<CvPathVertex> vertices(3);
+        for (int i = 0; i < 3; ++i) {
+            memset(&vertices[i], 0, sizeof(CvPathVertex));
+            vertices[i].primitive = i - 1;
+            vertices[i].pdf = i + 0.5f;
+        }
+        std::vector<char> block;
+        CvPathRecorder::AddPath(&block, Point2f(1.5f, 2.5f), 1, {});
+        CvPathRecorder::AddPath(&block, Point2f(3.5f, 4.5f), 0.5f, vertices);
+        recorder.WriteBlock(Bounds2i(Point2i(0, 0), Point2i(16, 8)), 2, block);
+        recorder.WriteBlock(Bounds2i(Point2i(16, 0), Point2i(32, 8)), 0, {});
+    }
+
+    std::unique_ptr<CvPathRecording> recording = CvPathRecording::Open(name);
+    ASSERT_TRUE(recording != nullptr);
+    EXPECT_EQ(42, recording->NumPrimitives());
+    ASSERT_EQ(2, (int)recording->Blocks().size());
+    const CvPathRecording::Block &block = recording->Blocks()[0];
+    EXPECT_EQ(Point2i(16, 8), block.sampleBounds.pMax);
+    EXPECT_EQ(2, block.nPaths);
+    EXPECT_EQ(0, recording->Blocks()[1].nPaths);
+
+    CvPathHeader header;
+    const char *ptr = block.data;
+    memcpy(&header, ptr, sizeof(header));
+    EXPECT_EQ(Point2f(1.5f, 2.5f), header.pFilm);
+    EXPECT_EQ(0, header.nVertices);
+    ptr += sizeof(header);
+    memcpy(&header, ptr, sizeof(header));
+    EXPECT_EQ(0.5f, header.rayWeight);
+    ASSERT_EQ(3, header.nVertices);
+    ptr += sizeof(header);
+    for (int i = 0; i < 3; ++i) {
+        CvPathVertex v;
+        memcpy(&v, ptr + i * sizeof(CvPathVertex), sizeof(v));
+        EXPECT_EQ(i - 1, v.primitive);
+        EXPECT_EQ(i + 0.5f, v.pdf);
+    }
+
+    recording.reset();
+    EXPECT_EQ(0, remove(name));
+}
+
+// Renders a quad facing the camera under a distant light, with a "dual"
+// material of two diffuse albedos, to the film _output_. Paths end at
+// their first vertex, so the image is proportional to the albedos.
+static void RenderQuad(const std::string &integratorParams, Float kd0,
+                       Float kd1, const std::string &output) {
+    std::string sceneFile = output + ".pbrt";
+    {
+        std::ofstream out(sceneFile);
+        out << "Integrator \"cv\" \"integer maxdepth\" [ 1 ] "
+            << integratorParams << "\n"
+            << "Sampler \"random\" \"integer pixelsamples\" [ 4 ]\n"
+            << "Film \"cv\" \"integer xresolution\" [ 16 ] "
+               "\"integer yresolution\" [ 16 ] \"string filename\" [ \""
+            << output << "\" ]\n"
+            << "Camera \"perspective\" \"float fov\" [ 60 ]\n"
+            << "WorldBegin\n"
+            << "LightSource \"distant\" \"point from\" [ 0 0 0 ] "
+               "\"point to\" [ 0 .5 1 ]\n"
+            << "MakeNamedMaterial \"a\" \"string type\" [ \"matte\" ] "
+               "\"rgb Kd\" [ " << kd0 << " " << kd0 << " " << kd0 << " ]\n"
+            << "MakeNamedMaterial \"b\" \"string type\" [ \"matte\" ] "
+               "\"rgb Kd\" [ " << kd1 << " " << kd1 << " " << kd1 << " ]\n"
+            << "MakeNamedMaterial \"dual\" \"string type\" [ \"dual\" ] "
+               "\"string namedmaterial1\" [ \"a\" ] "
+               "\"string namedmaterial2\" [ \"b\" ]\n"
+            << "NamedMaterial \"dual\"\n"
+            << "Shape \"trianglemesh\" \"integer indices\" [ 0 1 2 0 2 3 ] "
+               "\"point P\" [ -5 -5 5 5 -5 5 5 5 5 -5 5 5 ]\n"
+            << "WorldEnd\n";
+    }
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+    EXPECT_TRUE(ParseFile(sceneFile));
+    pbrtCleanup();
+    EXPECT_EQ(0, remove(sceneFile.c_str()));
+}
+
+TEST(CvPathRecording, Reshade) {
+    const char *recording = "cvrecord_test_reshade.cvpaths";
+    RenderQuad(std::string("\"string recordpaths\" [ \"") + recording + "\" ]",
+               .5f, .25f, "cvrecord_test_traced");
+    // Re-shading with the recorded materials replays the traced samples,
+    // and halving the albedos halves the image
+    RenderQuad(std::string("\"string reshade\" [ \"") + recording + "\" ]",
+               .5f, .25f, "cvrecord_test_same");
+    RenderQuad(std::string("\"string reshade\" [ \"") + recording + "\" ]",
+               .25f, .125f, "cvrecord_test_half");
+
+    for (const char *variant : {"_F.bin", "_H.bin"}) {
+        Point2i res, sameRes, halfRes;
+        std::unique_ptr<RGBSpectrum[]> traced = ReadImage(
+            std::string("cvrecord_test_traced") + variant, &res);
+        std::unique_ptr<RGBSpectrum[]> same = ReadImage(
+            std::string("cvrecord_test_same") + variant, &sameRes);
+        std::unique_ptr<RGBSpectrum[]> half = ReadImage(
+            std::string("cvrecord_test_half") + variant, &halfRes);
+        ASSERT_TRUE(traced && same && half);
+        ASSERT_EQ(res, sameRes);
+        ASSERT_EQ(res, halfRes);
+        Float sum = 0;
+        for (int i = 0; i < res.x * res.y; ++i) {
+            Float L = traced[i][0];
+            sum += L;
+            EXPECT_NEAR(L, same[i][0], 1e-5f * L);
+            EXPECT_NEAR(.5f * L, half[i][0], 1e-5f * L);
+        }
+        EXPECT_GT(sum, 0);
+    }
+
+    const char *suffixes[] = {"F.bin", "F.png", "Fsquare.bin", "Falpha.bin",
+                              "H.bin", "H.png", "Hsquare.bin", "D.bin",
+                              "Dsquare.bin", "Dstderr.bin", "Drelerr.bin",
+                              "Dsignificant.bin", "Dsignificant.png",
+                              "rpdf.bin", "rpdf.png"};
+    for (const char *name : {"cvrecord_test_traced_", "cvrecord_test_same_",
+                             "cvrecord_test_half_"})
+        for (const char *suffix : suffixes)
+            EXPECT_EQ(0, remove((std::string(name) + suffix).c_str()));
+    EXPECT_EQ(0, remove(recording));
+}
@@ -0,0 +1,48 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "cv/cv_stream.h"
+#include <cstdio>
+
+using namespace pbrt;
+
+TEST(CvSampleStream, RoundTrip) {
+    const char *name = "cvstream_test.cvsamples";
+    const int nSamples = 1000;
+    {
+        // Small chunks and a one-chunk queue, so that tiles wait for the
+        // writer
+        CvSampleStream stream(name, 3, 64, 1);
+        ASSERT_TRUE(stream.IsValid());
+        std::vector<char> chunks[2];
+        for (int n = 0; n < nSamples; ++n) {
+            Spectrum L[3] = {Spectrum(n), Spectrum(2 * n), Spectrum(0.5f)};
+            stream.Add(&chunks[n % 2], Point2f(n + 0.25f, 7.75f),
+                       CvSample(L, 3, 1.f / (n + 1), n % 5));
+        }
+        stream.Submit(&chunks[0]);
+        stream.Submit(&chunks[1]);
+        EXPECT_TRUE(chunks[0].empty());
+        stream.Flush();
+    }
+
+    int nVariants;
+    std::vector<CvStreamedSample> samples;
+    ASSERT_TRUE(ReadCvSampleStream(name, &nVariants, &samples));
+    EXPECT_EQ(3, nVariants);
+    ASSERT_EQ(nSamples, (int)samples.size());
+    // Each chunk keeps its samples in order, but chunks interleave
+    std::vector<bool> seen(nSamples, false);
+    for (const CvStreamedSample &s : samples) {
+        int n = s.pixel.x;
+        ASSERT_TRUE(n >= 0 && n < nSamples);
+        EXPECT_FALSE(seen[n]);
+        seen[n] = true;
+        EXPECT_EQ(7, s.pixel.y);
+        EXPECT_EQ(Point2f(n + 0.25f, 7.75f), s.pFilm);
+        EXPECT_EQ(RGBSpectrum(2 * n), s.L[1]);
+        EXPECT_EQ(RGBSpectrum(0.5f), s.L[2]);
+        EXPECT_FLOAT_EQ(1.f / (n + 1), s.reciprocalPdf);
+        EXPECT_EQ(n % 5, s.pathLength);
+    }
+    EXPECT_EQ(0, remove(name));
+}
@@ -0,0 +1,86 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "interaction.h"
+#include "paramset.h"
+#include "lights/diffuse.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+#include "cv/variantlight.h"
+#include "cv/varianttex.h"
+
+using namespace pbrt;
+
+TEST(VariantTexture, EvaluatesScopedVariant) {
+    std::vector<std::shared_ptr<Texture<Float>>> textures;
+    textures.push_back(std::make_shared<ConstantTexture<Float>>(1.f));
+    textures.push_back(std::make_shared<ConstantTexture<Float>>(2.f));
+    VariantTexture<Float> tex(textures);
+    // A texture built on a variant texture has its variants, too
+    VariantTexture<Float> wrapped(std::vector<std::shared_ptr<Texture<Float>>>(
+        2, std::make_shared<VariantTexture<Float>>(textures)));
+    EXPECT_EQ(2, tex.NumVariants());
+
+    SurfaceInteraction si;
+    EXPECT_EQ(1.f, tex.Evaluate(si));
+    {
+        TextureVariantScope scope(1);
+        EXPECT_EQ(2.f, tex.Evaluate(si));
+        EXPECT_EQ(2.f, wrapped.Evaluate(si));
+        // Variants beyond the texture's count fall back to the first one
+        TextureVariantScope inner(3);
+        EXPECT_EQ(1.f, tex.Evaluate(si));
+    }
+    EXPECT_EQ(1.f, tex.Evaluate(si));
+    EXPECT_EQ(1.f, wrapped.Evaluate(si));
+}
+
+TEST(VariantTexture, SelectedVariant) {
+    // Rendering one variant with "--variant" builds plain textures of it
+    std::map<std::string, std::shared_ptr<Texture<Float>>> floatTextures;
+    std::map<std::string, std::shared_ptr<Texture<Spectrum>>> spectrumTextures;
+    floatTextures["one"] = std::make_shared<ConstantTexture<Float>>(1.f);
+    floatTextures["two"] = std::make_shared<ConstantTexture<Float>>(2.f);
+    ParamSet params, empty;
+    params.AddTexture("tex1", "one");
+    params.AddTexture("tex2", "two");
+    TextureParams tp(params, empty, floatTextures, spectrumTextures);
+
+    SurfaceInteraction si;
+    int savedVariant = PbrtOptions.variant;
+    PbrtOptions.variant = 1;
+    std::unique_ptr<Texture<Float>> tex(
+        CreateVariantFloatTexture(Transform(), tp));
+    EXPECT_EQ(1, tex->NumVariants());
+    EXPECT_EQ(2.f, tex->Evaluate(si));
+    // Missing variants fall back to the first one
+    PbrtOptions.variant = 2;
+    tex.reset(CreateVariantFloatTexture(Transform(), tp));
+    EXPECT_EQ(1.f, tex->Evaluate(si));
+    PbrtOptions.variant = savedVariant;
+}
+
+TEST(VariantAreaLight, PerVariantEmission) {
+    Transform identity;
+    std::shared_ptr<Shape> sphere =
+        std::make_shared<Sphere>(&identity, &identity, false, 1.f, -1.f, 1.f,
+                                 360.f);
+    std::vector<std::shared_ptr<AreaLight>> lights;
+    lights.push_back(std::make_shared<DiffuseAreaLight>(
+        identity, MediumInterface(), Spectrum(1.f), 1, sphere));
+    lights.push_back(std::make_shared<DiffuseAreaLight>(
+        identity, MediumInterface(), Spectrum(3.f), 1, sphere));
+    VariantAreaLight light(identity, lights);
+    EXPECT_TRUE(light.HasVariants());
+    EXPECT_EQ(Spectrum(2.f) * lights[0]->Power(), light.Power());
+
+    Interaction intr;
+    intr.p = Point3f(0, 0, 1);
+    intr.n = Normal3f(0, 0, 1);
+    Vector3f w(0, 0, 1);
+    EXPECT_EQ(Spectrum(1.f), light.L(intr, w));
+    EXPECT_EQ(Spectrum(1.f), light.VariantL(0, intr, w));
+    EXPECT_EQ(Spectrum(3.f), light.VariantL(1, intr, w));
+    EXPECT_EQ(Spectrum(1.f), light.VariantL(2, intr, w));
+    // One-sided lights do not emit backwards in any variant
+    EXPECT_TRUE(light.VariantL(1, intr, -w).IsBlack());
+}
@@ -6,9 +6,13 @@
 #include "rng.h"
 #include "sampling.h"
 #include "lowdiscrepancy.h"
+#include "samplers/halton.h"
 #include "samplers/maxmin.h"
+#include "samplers/random.h"
 #include "samplers/sobol.h"
+#include "samplers/stratified.h"
 #include "samplers/zerotwosequence.h"
+#include "camera.h"
 
 using namespace pbrt;
 
@@ -228,6 +232,95 @@ TEST(MaxMinDist, MinDist) {
     }
 }
 
+TEST(Sampler, DimensionBlocks) {
+    Bounds2i bounds(Point2i(0, 0), Point2i(16, 16));
+    std::vector<std::unique_ptr<Sampler>> samplers;
+    samplers.push_back(std::unique_ptr<Sampler>(new RandomSampler(16)));
+    samplers.push_back(
+        std::unique_ptr<Sampler>(new StratifiedSampler(4, 4, true, 8)));
+    samplers.push_back(std::unique_ptr<Sampler>(new HaltonSampler(16, bounds)));
+    samplers.push_back(std::unique_ptr<Sampler>(new SobolSampler(16, bounds)));
+    for (const auto &sampler : samplers) {
+        // Two clones that consume different numbers of samples before the
+        // blocks still see the same values in each block, both for the
+        // precomputed dimensions of pixel samplers and past them
+        std::unique_ptr<Sampler> a = sampler->Clone(1), b = sampler->Clone(2);
+        a->StartPixel(Point2i(3, 5));
+        b->StartPixel(Point2i(3, 5));
+        a->SetSampleNumber(7);
+        b->SetSampleNumber(7);
+        for (int bounce = 0; bounce < 4; ++bounce) {
+            a->StartDimensionBlock(SamplePurpose::Light, bounce);
+            b->StartDimensionBlock(SamplePurpose::Light, bounce);
+            a->Get1D();
+            for (int i = 0; i <= bounce; ++i) b->Get2D();
+            a->StartDimensionBlock(SamplePurpose::BSDF, bounce);
+            b->StartDimensionBlock(SamplePurpose::BSDF, bounce);
+            EXPECT_EQ(a->Get2D(), b->Get2D());
+            a->StartDimensionBlock(SamplePurpose::RussianRoulette, bounce);
+            b->StartDimensionBlock(SamplePurpose::RussianRoulette, bounce);
+            EXPECT_EQ(a->Get1D(), b->Get1D());
+        }
+        // Different blocks and pixel samples get different values
+        a->StartDimensionBlock(SamplePurpose::BSDF, 0);
+        Point2f u = a->Get2D();
+        a->StartDimensionBlock(SamplePurpose::BSDF, 1);
+        EXPECT_NE(u, a->Get2D());
+        a->SetSampleNumber(8);
+        a->StartDimensionBlock(SamplePurpose::BSDF, 0);
+        EXPECT_NE(u, a->Get2D());
+    }
+}
+
+TEST(Sampler, RequestSampledDimensions) {
+    // Dimension blocks past the default dimensions of a pixel sampler
+    // are stratified once they are requested
+    StratifiedSampler sampler(4, 4, true, 4);
+    sampler.RequestSampledDimensions(Sampler::CameraDimensions +
+                                     3 * Sampler::BounceDimensions);
+    sampler.StartPixel(Point2i(3, 5));
+    std::vector<int> strata(16, 0);
+    for (int i = 0; i < 16; ++i) {
+        sampler.SetSampleNumber(i);
+        sampler.StartDimensionBlock(SamplePurpose::RussianRoulette, 2);
+        ++strata[std::min(15, (int)(sampler.Get1D() * 16))];
+    }
+    for (int count : strata) EXPECT_EQ(1, count);
+}
+
+TEST(Sampler, Seed) {
+    // Runs with different seeds take different samples, whose film
+    // positions still lie in their pixel
+    Bounds2i bounds(Point2i(0, 0), Point2i(16, 16));
+    Point2i pixel(3, 5);
+    int savedSeed = PbrtOptions.seed;
+    for (int type = 0; type < 4; ++type) {
+        CameraSample cameraSamples[2];
+        Point2f bsdfSamples[2];
+        for (int seed = 0; seed < 2; ++seed) {
+            PbrtOptions.seed = seed;
+            std::unique_ptr<Sampler> sampler;
+            if (type == 0) sampler.reset(new RandomSampler(16));
+            if (type == 1) sampler.reset(new StratifiedSampler(4, 4, true, 8));
+            if (type == 2) sampler.reset(new HaltonSampler(16, bounds));
+            if (type == 3) sampler.reset(new SobolSampler(16, bounds));
+            std::unique_ptr<Sampler> clone = sampler->Clone(1);
+            clone->StartPixel(pixel);
+            clone->SetSampleNumber(7);
+            clone->StartDimensionBlock(SamplePurpose::Camera);
+            cameraSamples[seed] = clone->GetCameraSample(pixel);
+            clone->StartDimensionBlock(SamplePurpose::BSDF, 1);
+            bsdfSamples[seed] = clone->Get2D();
+            EXPECT_TRUE(InsideExclusive(
+                cameraSamples[seed].pFilm,
+                Bounds2f(Point2f(pixel), Point2f(pixel + Vector2i(1, 1)))));
+        }
+        EXPECT_NE(cameraSamples[0].pFilm, cameraSamples[1].pFilm);
+        EXPECT_NE(bsdfSamples[0], bsdfSamples[1]);
+    }
+    PbrtOptions.seed = savedSeed;
+}
+
 TEST(Distribution1D, Discrete) {
     // Carefully chosen distribution so that transitions line up with
     // (inverse) powers of 2.
@@ -0,0 +1,252 @@
+//
+// bvhbench.cpp
+//
+// Measures BVH construction time and ray traversal throughput of the BVH
+// layouts on a triangle mesh.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <sstream>
+#include "accelerators/bvh.h"
+#include "api.h"
+#include "interaction.h"
+#include "parallel.h"
+#include "paramset.h"
+#include "pbrt.h"
+#include "primitive.h"
+#include "rng.h"
+#include "sampling.h"
+#include "shapes/plymesh.h"
+#include "shapes/triangle.h"
+#include "stats.h"
+
+#include <glog/logging.h>
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr, ...) {
+    if (msg) {
+        va_list args;
+        va_start(args, msg);
+        fprintf(stderr, "pbrt_bvhbench: ");
+        vfprintf(stderr, msg, args);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, R"(usage: pbrt_bvhbench [options]
+
+Builds a BVH of every requested width over a triangle mesh and traces the
+same random rays through each, reporting the build time, the memory taken
+by the nodes and the rays per second of closest-hit and any-hit queries on
+one thread, along with the tree's SAH cost. Large trees are built with all
+threads given by --nthreads. The hits of every width are checked against
+those of the first one.
+
+options:
+    --cachedir <dir>    BVH cache directory; a second run times loading the
+                        trees the first one wrote
+    --maxnodeprims <n>  Maximum primitives per leaf. Default: 4
+    --nthreads <n>      Threads for BVH construction. Default: all cores
+    --ply <filename>    Mesh to use instead of generated spheres
+    --rays <n>          Rays to trace per query type. Default: 1000000
+    --seed <n>          Seed of the generated mesh and rays. Default: 0
+    --splitmethod <s>   "sah", "hlbvh", "middle" or "equal". Default: "sah"
+    --triangles <n>     Triangles of the generated mesh. Default: 1000000
+    --width <n,n,...>   BVH widths to compare; a "q" suffix, as in "4q",
+                        selects quantized nodes. Default: 2,4,8,2q,4q,8q
+
+)");
+    exit(1);
+}
+
+// Returns about _nTriangles_ triangles of randomly placed and sized
+// tessellated spheres in the unit cube
+static std::vector<std::shared_ptr<Shape>> MakeSpheres(int nTriangles,
+                                                       RNG &rng) {
+    static Transform identity;
+    const int nu = 32, nv = 16;
+    int nSpheres = std::max(1, nTriangles / (2 * nu * nv));
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int s = 0; s < nSpheres; ++s) {
+        Point3f center(rng.UniformFloat(), rng.UniformFloat(),
+                       rng.UniformFloat());
+        Float radius = Lerp(rng.UniformFloat(), .005f, .05f);
+        int first = p.size();
+        for (int v = 0; v <= nv; ++v)
+            for (int u = 0; u <= nu; ++u) {
+                Float phi = 2 * Pi * u / nu, theta = Pi * v / nv;
+                p.push_back(center + radius * SphericalDirection(
+                                                  std::sin(theta),
+                                                  std::cos(theta), phi));
+            }
+        for (int v = 0; v < nv; ++v)
+            for (int u = 0; u < nu; ++u) {
+                int i = first + v * (nu + 1) + u;
+                int quad[6] = {i, i + 1, i + nu + 2, i, i + nu + 2, i + nu + 1};
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+    }
+    return CreateTriangleMesh(&identity, &identity, false, indices.size() / 3,
+                              indices.data(), p.size(), p.data(), nullptr,
+                              nullptr, nullptr, nullptr, nullptr);
+}
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_stderrthreshold = 1;  // Warning and above.
+
+    Options opt;
+    int maxNodePrims = 4, nTriangles = 1000000, nRays = 1000000, seed = 0;
+    std::string cacheDir, plyFile, splitMethod = "sah";
+    std::vector<std::string> widths = {"2", "4", "8", "2q", "4q", "8q"};
+    for (int i = 1; i < argc; ++i) {
+        auto value = [&]() {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            return argv[++i];
+        };
+        if (!strcmp(argv[i], "--cachedir") || !strcmp(argv[i], "-cachedir"))
+            cacheDir = value();
+        else if (!strcmp(argv[i], "--maxnodeprims") ||
+            !strcmp(argv[i], "-maxnodeprims"))
+            maxNodePrims = atoi(value());
+        else if (!strcmp(argv[i], "--nthreads") || !strcmp(argv[i], "-nthreads"))
+            opt.nThreads = atoi(value());
+        else if (!strcmp(argv[i], "--ply") || !strcmp(argv[i], "-ply"))
+            plyFile = value();
+        else if (!strcmp(argv[i], "--rays") || !strcmp(argv[i], "-rays")) {
+            nRays = atoi(value());
+            if (nRays < 1) usage("--rays must be >= 1");
+        } else if (!strcmp(argv[i], "--seed") || !strcmp(argv[i], "-seed"))
+            seed = atoi(value());
+        else if (!strcmp(argv[i], "--splitmethod") ||
+                 !strcmp(argv[i], "-splitmethod"))
+            splitMethod = value();
+        else if (!strcmp(argv[i], "--triangles") ||
+                 !strcmp(argv[i], "-triangles")) {
+            nTriangles = atoi(value());
+            if (nTriangles < 1) usage("--triangles must be >= 1");
+        } else if (!strcmp(argv[i], "--width") || !strcmp(argv[i], "-width")) {
+            widths.clear();
+            std::stringstream list(value());
+            std::string width;
+            while (std::getline(list, width, ','))
+                widths.push_back(width);
+            if (widths.empty()) usage("--width needs a list of widths");
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-help") ||
+                   !strcmp(argv[i], "-h"))
+            usage();
+        else
+            usage("unknown option \"%s\"", argv[i]);
+    }
+    opt.quiet = true;
+    pbrtInit(opt);
+
+    // Create the mesh's primitives
+    RNG rng(seed);
+    std::vector<std::shared_ptr<Shape>> shapes;
+    if (!plyFile.empty()) {
+        static Transform identity;
+        ParamSet params;
+        std::unique_ptr<std::string[]> name(new std::string[1]{plyFile});
+        params.AddString("filename", std::move(name), 1);
+        shapes = CreatePLYMesh(&identity, &identity, false, params);
+        if (shapes.empty()) {
+            fprintf(stderr, "%s: no triangles read.\n", plyFile.c_str());
+            return 1;
+        }
+    } else
+        shapes = MakeSpheres(nTriangles, rng);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.reserve(shapes.size());
+    Bounds3f sceneBounds;
+    for (const auto &shape : shapes) {
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            shape, nullptr, nullptr, MediumInterface()));
+        sceneBounds = Union(sceneBounds, shape->WorldBound());
+    }
+
+    // Generate rays from points around the mesh in uniform directions
+    std::vector<Ray> rays(nRays);
+    for (Ray &ray : rays) {
+        Point3f o = sceneBounds.Lerp(Point3f(
+            Lerp(rng.UniformFloat(), -.25f, 1.25f),
+            Lerp(rng.UniformFloat(), -.25f, 1.25f),
+            Lerp(rng.UniformFloat(), -.25f, 1.25f)));
+        ray = Ray(o, UniformSampleSphere(
+                         Point2f(rng.UniformFloat(), rng.UniformFloat())));
+    }
+
+    printf("%d triangles, %d rays, split method \"%s\", %d primitives per "
+           "leaf\n", (int)prims.size(), nRays, splitMethod.c_str(),
+           maxNodePrims);
+    printf("%6s %10s %9s %9s %16s %16s %s\n", "width", "build s", "SAH cost",
+           "nodes MB", "closest Mrays/s", "any-hit Mrays/s", "hits");
+    std::vector<Float> referenceT;
+    std::vector<bool> referenceHits;
+    for (const std::string &width : widths) {
+        ParamSet params;
+        std::unique_ptr<std::string[]> method(new std::string[1]{splitMethod});
+        params.AddString("splitmethod", std::move(method), 1);
+        std::unique_ptr<int[]> nodePrims(new int[1]{maxNodePrims});
+        params.AddInt("maxnodeprims", std::move(nodePrims), 1);
+        std::unique_ptr<int[]> w(new int[1]{atoi(width.c_str())});
+        params.AddInt("width", std::move(w), 1);
+        std::unique_ptr<bool[]> quantized(new bool[1]{width.back() == 'q'});
+        params.AddBool("quantized", std::move(quantized), 1);
+        if (!cacheDir.empty()) {
+            std::unique_ptr<std::string[]> dir(new std::string[1]{cacheDir});
+            params.AddString("cachedir", std::move(dir), 1);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<BVHAccel> bvh = CreateBVHAccelerator(prims, params);
+        double buildTime = SecondsSince(start);
+
+        // Closest hits
+        std::vector<Float> tHit(nRays);
+        int nHits = 0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nRays; ++i) {
+            Ray ray = rays[i];
+            SurfaceInteraction isect;
+            if (bvh->Intersect(ray, &isect)) ++nHits;
+            tHit[i] = ray.tMax;
+        }
+        double closestTime = SecondsSince(start);
+
+        // Any hits
+        std::vector<bool> anyHit(nRays);
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nRays; ++i) anyHit[i] = bvh->IntersectP(rays[i]);
+        double anyTime = SecondsSince(start);
+
+        // Compare with the first layout's results
+        int nMismatches = 0;
+        if (referenceT.empty()) {
+            referenceT = tHit;
+            referenceHits = anyHit;
+        } else
+            for (int i = 0; i < nRays; ++i)
+                if (tHit[i] != referenceT[i] || anyHit[i] != referenceHits[i])
+                    ++nMismatches;
+        printf("%6s %10.3f %9.3f %9.2f %16.3f %16.3f %d", width.c_str(),
+               buildTime, bvh->SAHCost(), bvh->NodeBytes() / (1024. * 1024.),
+               nRays / closestTime * 1e-6, nRays / anyTime * 1e-6, nHits);
+        if (bvh->LoadedFromCache()) printf(" (loaded from the cache)");
+        if (nMismatches > 0)
+            printf(" (%d rays differ from width %s)", nMismatches,
+                   widths[0].c_str());
+        printf("\n");
+    }
+    pbrtCleanup();
+    return 0;
+}
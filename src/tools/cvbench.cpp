@@ -0,0 +1,381 @@
+//
+// cvbench.cpp
+//
+// Compares the efficiency of the control-variate path tracer with
+// rendering the variants it compares independently with the path tracer.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include "api.h"
+#include "fileutil.h"
+#include "imageio.h"
+#include "parallel.h"
+#include "parser.h"
+#include "pbrt.h"
+#include "spectrum.h"
+#include "stats.h"
+
+#include <glog/logging.h>
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr, ...) {
+    if (msg) {
+        va_list args;
+        va_start(args, msg);
+        fprintf(stderr, "pbrt_cvbench: ");
+        vfprintf(stderr, msg, args);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, R"(usage: pbrt_cvbench [options] [<filename.pbrt...>]
+
+Renders every scene with the "cv" integrator and, independently, its first
+and baseline variants with the "path" integrator at increasing sample
+counts. Reports wall time, which includes parsing the scene and building
+its BVH, rays per second, the variance of the difference image D against a
+high sample count "cv" reference, and the efficiency 1 / (variance * time)
+of both approaches as JSON. The reference and the two independent renders
+are run with their own pbrt --seed values, so that their samples are
+independent of each other and of the "cv" renders'. Without scene files,
+the Cornell box scenes in scenes/cornell-box_cv are used.
+
+The scenes' integrator, sampler and film statements are replaced; their
+"maxdepth", sampler type and resolution are kept. The rewritten scenes and
+the images rendered from them are left in the working directory, so scenes
+must not refer to other files by relative paths.
+
+options:
+    --nthreads <n>     Number of threads to render with. Default: all cores
+    --outfile <name>   File to write the JSON report to. Default: standard
+                       output
+    --refspp <n>       Samples per pixel of the reference. Default: 1024
+    --spp <n,n,...>    Sample counts to benchmark. Default: 4,16,64
+    --workdir <dir>    Directory for rewritten scenes and images.
+                       Default: "."
+
+)");
+    exit(1);
+}
+
+// BenchScene Declarations
+struct BenchScene {
+    std::string filename, name;
+    // The scene's statements before _WorldBegin_, except for the
+    // integrator, sampler and film ones, and from _WorldBegin_ on
+    std::string options, world;
+    int maxDepth = 5;
+    std::string sampler = "halton";
+    Point2i resolution = Point2i(1280, 720);
+};
+
+static bool LoadScene(const std::string &filename, BenchScene *scene) {
+    std::ifstream in(filename);
+    if (!in) return false;
+    scene->filename = filename;
+    std::string base = filename.substr(filename.find_last_of("/\\") + 1);
+    scene->name = base.substr(0, base.find('.'));
+
+    static const std::regex replaced("^\\s*(Integrator|Sampler|Film)\\b");
+    static const std::regex maxDepth("\"integer maxdepth\"\\s*\\[?\\s*(\\d+)");
+    static const std::regex sampler("^\\s*Sampler\\s+\"(\\w+)\"");
+    static const std::regex xres("\"integer xresolution\"\\s*\\[?\\s*(\\d+)");
+    static const std::regex yres("\"integer yresolution\"\\s*\\[?\\s*(\\d+)");
+    bool inWorld = false;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!inWorld && line.find("WorldBegin") != std::string::npos)
+            inWorld = true;
+        if (inWorld) {
+            scene->world += line + "\n";
+            continue;
+        }
+        std::smatch m;
+        if (!std::regex_search(line, m, replaced)) {
+            scene->options += line + "\n";
+            continue;
+        }
+        std::string statement = m[1];
+        if (statement == "Integrator" && std::regex_search(line, m, maxDepth))
+            scene->maxDepth = std::stoi(m[1]);
+        else if (statement == "Sampler" && std::regex_search(line, m, sampler))
+            scene->sampler = m[1];
+        else if (statement == "Film") {
+            if (std::regex_search(line, m, xres))
+                scene->resolution.x = std::stoi(m[1]);
+            if (std::regex_search(line, m, yres))
+                scene->resolution.y = std::stoi(m[1]);
+        }
+    }
+    if (!inWorld) Error("No \"WorldBegin\" in scene \"%s\".", filename.c_str());
+    return inWorld;
+}
+
+// Options shared by every render
+struct BenchOptions {
+    int nThreads = 0;
+    std::string workdir = ".";
+};
+
+// Total of the ray intersection test counters of the last render
+static int64_t RaysTraced() {
+    static const char *counters[] = {"Regular ray intersection tests",
+                                     "Shadow ray intersection tests"};
+    FILE *f = tmpfile();
+    if (!f) return 0;
+    PrintStats(f);
+    rewind(f);
+    int64_t nRays = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+        for (const char *counter : counters)
+            if (strstr(line, counter)) nRays += atoll(strrchr(line, ' ') + 1);
+    fclose(f);
+    return nRays;
+}
+
+// Renders _scene_ with the given integrator and film type and the run
+// seed _seed_ to the image _output_, rendering only _variant_ if it is not
+// -1. Returns the wall time in seconds, scene parsing and BVH construction
+// included.
+static double Render(const BenchScene &scene, const BenchOptions &bench,
+                     const std::string &integrator, const std::string &film,
+                     const std::string &output, int spp, int variant,
+                     int seed, int64_t *nRays) {
+    std::string sceneFile = output + ".pbrt";
+    {
+        std::ofstream out(sceneFile);
+        out << StringPrintf("Integrator \"%s\" \"integer maxdepth\" [ %d ]\n",
+                            integrator.c_str(), scene.maxDepth)
+            << StringPrintf("Sampler \"%s\" \"integer pixelsamples\" [ %d ]\n",
+                            scene.sampler.c_str(), spp)
+            << StringPrintf("Film \"%s\" \"integer xresolution\" [ %d ] "
+                            "\"integer yresolution\" [ %d ] "
+                            "\"string filename\" [ \"%s\" ]\n",
+                            film.c_str(), scene.resolution.x,
+                            scene.resolution.y, output.c_str())
+            << scene.options << scene.world;
+    }
+
+    Options options;
+    options.nThreads = bench.nThreads;
+    options.quiet = true;
+    options.variant = variant;
+    options.seed = seed;
+    pbrtInit(options);
+    pbrtActiveTransformAll();
+    pbrtIdentity();
+    auto start = std::chrono::steady_clock::now();
+    if (!ParseFile(sceneFile))
+        Error("Couldn't open scene file \"%s\"", sceneFile.c_str());
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start).count();
+    pbrtCleanup();
+    // Quiet renders leave their statistics to the caller
+    *nRays = RaysTraced();
+    ClearStats();
+    return seconds;
+}
+
+static bool Exists(const std::string &filename) {
+    return (bool)std::ifstream(filename);
+}
+
+// Difference image of the first variant against the baseline written by
+// a "cv" render to _base_, and the number of variants
+static std::unique_ptr<RGBSpectrum[]> ReadDifference(const std::string &base,
+                                                     Point2i *res,
+                                                     int *nVariants) {
+    if (Exists(base + "_D.bin")) {
+        *nVariants = 2;
+        return ReadImage(base + "_D.bin", res);
+    }
+    for (*nVariants = 0; Exists(base + "_V" + std::to_string(*nVariants) + ".bin");
+         ++*nVariants)
+        ;
+    return ReadImage(base + "_D0.bin", res);
+}
+
+// Mean squared error of _D_ against _reference_ over all pixels and
+// channels
+static double Variance(const RGBSpectrum *D, const RGBSpectrum *reference,
+                       const Point2i &res) {
+    double sum = 0;
+    int n = res.x * res.y;
+    for (int i = 0; i < n; ++i)
+        for (int c = 0; c < 3; ++c) {
+            double d = D[i][c] - reference[i][c];
+            sum += d * d;
+        }
+    return sum / (3 * n);
+}
+
+struct BenchRun {
+    const char *method;
+    int spp;
+    double seconds, variance;
+    int64_t nRays;
+    double Efficiency() const {
+        return seconds > 0 && variance > 0 ? 1 / (variance * seconds) : 0;
+    }
+};
+
+static void PrintRun(FILE *f, const BenchRun &run, bool last) {
+    fprintf(f,
+            "        {\"method\": \"%s\", \"spp\": %d, \"seconds\": %g, "
+            "\"rays\": %lld, \"raysPerSecond\": %g, \"variance\": %g, "
+            "\"efficiency\": %g}%s\n",
+            run.method, run.spp, run.seconds, (long long)run.nRays,
+            run.seconds > 0 ? run.nRays / run.seconds : 0, run.variance,
+            run.Efficiency(), last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_stderrthreshold = 1;  // Warning and above.
+
+    BenchOptions bench;
+    std::vector<int> spps = {4, 16, 64};
+    int refSpp = 1024;
+    const char *outfile = nullptr;
+    std::vector<std::string> filenames;
+    for (int i = 1; i < argc; ++i) {
+        auto value = [&]() {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            return argv[++i];
+        };
+        if (!strcmp(argv[i], "--nthreads") || !strcmp(argv[i], "-nthreads"))
+            bench.nThreads = atoi(value());
+        else if (!strcmp(argv[i], "--outfile") || !strcmp(argv[i], "-outfile"))
+            outfile = value();
+        else if (!strcmp(argv[i], "--refspp") || !strcmp(argv[i], "-refspp")) {
+            refSpp = atoi(value());
+            if (refSpp < 1) usage("--refspp must be >= 1");
+        } else if (!strcmp(argv[i], "--spp") || !strcmp(argv[i], "-spp")) {
+            spps.clear();
+            std::stringstream list(value());
+            std::string spp;
+            while (std::getline(list, spp, ','))
+                if (atoi(spp.c_str()) > 0) spps.push_back(atoi(spp.c_str()));
+            if (spps.empty()) usage("--spp needs positive sample counts");
+        } else if (!strcmp(argv[i], "--workdir") ||
+                   !strcmp(argv[i], "-workdir"))
+            bench.workdir = value();
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-help") ||
+                 !strcmp(argv[i], "-h"))
+            usage();
+        else if (argv[i][0] == '-')
+            usage("unknown option \"%s\"", argv[i]);
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (filenames.empty()) {
+        filenames.push_back(PBRT_CVBENCH_SCENES "/scene_64spp.pbrt");
+        filenames.push_back(PBRT_CVBENCH_SCENES "/scene_variants_64spp.pbrt");
+    }
+
+    FILE *f = outfile ? fopen(outfile, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "%s: unable to open for writing.\n", outfile);
+        return 1;
+    }
+    fprintf(f, "{\n  \"threads\": %d,\n  \"referenceSpp\": %d,\n  \"scenes\": [",
+            bench.nThreads ? bench.nThreads : NumSystemCores(), refSpp);
+    bool firstScene = true;
+    for (const std::string &filename : filenames) {
+        BenchScene scene;
+        if (!LoadScene(filename, &scene)) {
+            Error("Couldn't read scene \"%s\". Skipping it.", filename.c_str());
+            continue;
+        }
+        std::string base = bench.workdir + "/cvbench_" + scene.name;
+        // Samplers are deterministic, so renders of the same seed share
+        // their first samples: a reference of the "cv" runs' seed would
+        // bias their variance low, and independent renders of one seed
+        // would be correlated
+        const int cvSeed = 0, refSeed = 1, independentSeeds[2] = {2, 3};
+        fprintf(stderr, "%s: rendering reference\n", scene.name.c_str());
+        int64_t nRays;
+        double refSeconds = Render(scene, bench, "cv", "cv", base + "_ref",
+                                   refSpp, -1, refSeed, &nRays);
+        Point2i res;
+        int nVariants;
+        std::unique_ptr<RGBSpectrum[]> reference =
+            ReadDifference(base + "_ref", &res, &nVariants);
+        if (!reference || nVariants < 2) {
+            Error("Scene \"%s\" has no variants to compare. Skipping it.",
+                  filename.c_str());
+            continue;
+        }
+
+        std::vector<BenchRun> runs;
+        for (int spp : spps) {
+            fprintf(stderr, "%s: %d spp\n", scene.name.c_str(), spp);
+            // One "cv" render estimates D directly
+            BenchRun cv = {"cv", spp, 0, 0, 0};
+            std::string cvBase = base + "_cv" + std::to_string(spp);
+            cv.seconds = Render(scene, bench, "cv", "cv", cvBase, spp, -1,
+                                cvSeed, &cv.nRays);
+            Point2i cvRes;
+            int n;
+            std::unique_ptr<RGBSpectrum[]> D = ReadDifference(cvBase, &cvRes, &n);
+            if (D && cvRes == res) cv.variance = Variance(D.get(), reference.get(), res);
+            runs.push_back(cv);
+
+            // Independent renders of the first and the baseline variants,
+            // whose difference is the estimate of D
+            BenchRun independent = {"independent", spp, 0, 0, 0};
+            std::unique_ptr<RGBSpectrum[]> images[2];
+            int variants[2] = {0, nVariants - 1};
+            bool ok = true;
+            for (int k = 0; k < 2; ++k) {
+                std::string name = base + "_path" + std::to_string(spp) + "_V" +
+                                   std::to_string(variants[k]) + ".pfm";
+                int64_t rays;
+                independent.seconds +=
+                    Render(scene, bench, "path", "image", name, spp,
+                           variants[k], independentSeeds[k], &rays);
+                independent.nRays += rays;
+                Point2i pathRes;
+                images[k] = ReadImage(name, &pathRes);
+                ok &= images[k] && pathRes == res;
+            }
+            if (ok) {
+                for (int i = 0; i < res.x * res.y; ++i)
+                    images[0][i] = images[0][i] - images[1][i];
+                independent.variance =
+                    Variance(images[0].get(), reference.get(), res);
+            }
+            runs.push_back(independent);
+        }
+
+        fprintf(f, "%s\n    {\n      \"scene\": \"%s\",\n", firstScene ? "" : ",",
+                filename.c_str());
+        fprintf(f, "      \"resolution\": [%d, %d],\n      \"variants\": %d,\n",
+                res.x, res.y, nVariants);
+        fprintf(f, "      \"sampler\": \"%s\",\n", scene.sampler.c_str());
+        fprintf(f, "      \"referenceSeconds\": %g,\n      \"runs\": [\n",
+                refSeconds);
+        for (size_t i = 0; i < runs.size(); ++i)
+            PrintRun(f, runs[i], i + 1 == runs.size());
+        // Efficiency of the "cv" render relative to the independent ones
+        fprintf(f, "      ],\n      \"speedups\": [\n");
+        for (size_t i = 0; i < runs.size(); i += 2) {
+            double independent = runs[i + 1].Efficiency();
+            fprintf(f, "        {\"spp\": %d, \"efficiency\": %g}%s\n",
+                    runs[i].spp,
+                    independent > 0 ? runs[i].Efficiency() / independent : 0,
+                    i + 2 == runs.size() ? "" : ",");
+        }
+        fprintf(f, "      ]\n    }");
+        firstScene = false;
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (outfile) fclose(f);
+    return 0;
+}
@@ -13,7 +13,10 @@
 #include "imageio.h"
 #include "pbrt.h"
 #include "spectrum.h"
+#include "stats.h"
 #include "parallel.h"
+#include "cv/cv_film.h"
+#include "filters/box.h"
 extern "C" {
 #include "ext/ArHosekSkyModel.h"
 }
@@ -31,7 +34,7 @@ static void usage(const char *msg = nullptr, ...) {
     }
     fprintf(stderr, R"(usage: imgtool <command> [options] <filenames...>
 
-commands: assemble, cat, convert, diff, info, makesky
+commands: assemble, cat, convert, cvmerge, diff, info, makesky
 
 assemble option:
     --outfile          Output image filename.
@@ -64,6 +67,26 @@ convert options:
     --tonemap          Apply tonemapping to the image (Reinhard et al.'s
                        photographic tone mapping operator)
 
+cvmerge options:
+    --alpharadius <r>  Radius of the neighborhood over which the control-variate
+                       coefficients are estimated. Default: 0
+    --confidence <c>   Confidence level of the masks of significant
+                       differences. Default: 0.95
+    --outfile <name>   Output filename, as for the control-variate film's
+                       "filename": an ".exr" name writes one multi-layer
+                       image, other names are used as the base of per-quantity
+                       files. Default: "cvmerge.exr"
+    --reference <name> Converged image of the baseline variant, for writing
+                       control-variate estimates.
+    Merges the ".cvacc" raw accumulator files that control-variate films
+    write with "bool accumulators" "true", from renders split by crop
+    window, by the integrator's "pixelbounds" or by sample count, and
+    writes the result as a single render would, followed by summary
+    statistics of the differences' errors. Renders of the same pixels
+    take the same samples unless they are run with different pbrt --seed
+    values, so files of one seed that sampled the same pixels are
+    rejected.
+
 diff options:
     --difftol <v>      Acceptable image difference percentage before differences
                        are reported. Default: 0
@@ -762,6 +785,87 @@ int convert(int argc, char *argv[]) {
     return 0;
 }
 
+int cvmerge(int argc, char *argv[]) {
+    const char *outfile = "cvmerge.exr";
+    const char *reference = "";
+    int alphaRadius = 0;
+    Float confidence = 0.95f;
+    std::vector<const char *> infiles;
+    for (int i = 0; i < argc; ++i) {
+        if (!strcmp(argv[i], "--outfile") || !strcmp(argv[i], "-outfile")) {
+            if (i + 1 == argc)
+                usage("missing filename for %s parameter", argv[i]);
+            outfile = argv[++i];
+        } else if (!strcmp(argv[i], "--reference") ||
+                   !strcmp(argv[i], "-reference")) {
+            if (i + 1 == argc)
+                usage("missing filename for %s parameter", argv[i]);
+            reference = argv[++i];
+        } else if (!strcmp(argv[i], "--alpharadius") ||
+                   !strcmp(argv[i], "-alpharadius")) {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            alphaRadius = atoi(argv[++i]);
+            if (alphaRadius < 0) usage("--alpharadius must be >= 0");
+        } else if (!strcmp(argv[i], "--confidence") ||
+                   !strcmp(argv[i], "-confidence")) {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            confidence = atof(argv[++i]);
+            if (confidence <= 0 || confidence >= 1)
+                usage("--confidence must be between 0 and 1");
+        } else
+            infiles.push_back(argv[i]);
+    }
+    if (infiles.empty()) usage("no filenames provided to \"cvmerge\"?");
+
+    // Check that the files come from renders of the same image and find
+    // the bounds of the pixels they cover
+    CvAccumulatorsInfo first;
+    Bounds2i bounds;
+    for (size_t i = 0; i < infiles.size(); ++i) {
+        CvAccumulatorsInfo info;
+        if (!ReadCvAccumulatorsInfo(infiles[i], &info)) return 1;
+        if (i == 0) {
+            first = info;
+            bounds = info.pixelBounds;
+            continue;
+        }
+        const CvChannels &c0 = first.channels, &c = info.channels;
+        if (info.fullResolution != first.fullResolution ||
+            c.nVariants != c0.nVariants || c.baseline != c0.baseline ||
+            c.secondMoments != c0.secondMoments ||
+            c.reciprocalPdf != c0.reciprocalPdf) {
+            fprintf(stderr,
+                    "%s: resolution or film channels don't match those of "
+                    "%s.\n",
+                    infiles[i], infiles[0]);
+            return 1;
+        }
+        bounds = Union(bounds, info.pixelBounds);
+    }
+
+    // Choose a crop window whose pixel bounds are exactly _bounds_; the
+    // film rounds them up from the window's raster coordinates
+    Point2i res = first.fullResolution;
+    Bounds2f crop(Point2f((bounds.pMin.x - .25f) / res.x,
+                          (bounds.pMin.y - .25f) / res.y),
+                  Point2f((bounds.pMax.x - .25f) / res.x,
+                          (bounds.pMax.y - .25f) / res.y));
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    CvFilm film(res, crop, std::move(filter), 35, outfile, first.scale,
+                Infinity, first.channels, reference, alphaRadius, false, "zip",
+                false, confidence);
+    CHECK(film.croppedPixelBounds == bounds);
+    for (const char *file : infiles)
+        if (!film.MergeAccumulators(file)) return 1;
+    // Merged splats are already scaled
+    ParallelInit();
+    film.WriteImage(1);
+    ParallelCleanup();
+    ReportThreadStats();
+    PrintStats(stdout);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     google::InitGoogleLogging(argv[0]);
     FLAGS_stderrthreshold = 1; // Warning and above.
@@ -774,6 +878,8 @@ int main(int argc, char *argv[]) {
         return cat(argc - 2, argv + 2);
     else if (!strcmp(argv[1], "convert"))
         return convert(argc - 2, argv + 2);
+    else if (!strcmp(argv[1], "cvmerge"))
+        return cvmerge(argc - 2, argv + 2);
     else if (!strcmp(argv[1], "diff"))
         return diff(argc - 2, argv + 2);
     else if (!strcmp(argv[1], "info"))